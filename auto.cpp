@@ -0,0 +1,169 @@
+#ifdef HISTEQ_WITH_MPI
+#include <mpi.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "utils.hpp"
+#include "histeq.hpp"
+
+using namespace cv;
+using namespace std;
+
+#define BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH "output/auto/before/histogram_before_auto.png"
+#define AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH "output/auto/after/histogram_after_auto.png"
+#define BEFORE_IMAGE_OUTPUT_PATH "output/auto/before/image_before_auto.png"
+#define AFTER_IMAGE_OUTPUT_PATH "output/auto/after/image_after_auto.png"
+#define BEFORE_IMAGE_HISTOGRAM_COMBINED_PATH "output/auto/before/image_histo_before_auto.png"
+#define AFTER_IMAGE_HISTOGRAM_COMBINED_PATH "output/auto/after/image_histo_after_auto.png"
+#define BEFORE_AFTER_COMBINED_PATH "output/auto/result_auto.png"
+#define RUNTIME_OUTPUT_PATH "output/auto/runtime_auto.txt"
+
+// Ends the program on every rank
+int finish(int status)
+{
+#ifdef HISTEQ_WITH_MPI
+    MPI_Finalize();
+#endif
+    return status;
+}
+
+// One binary for every engine: libhisteq picks the backend (and thread count) from the tuning
+// cache, or --backend forces one. Run it under mpirun to make the MPI backend a candidate.
+int main(int argc, char **argv)
+{
+    int rank = 0, size = 1;
+#ifdef HISTEQ_WITH_MPI
+    // Only the master thread of rank 0 calls MPI while OpenMP threads run
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+#endif
+
+    // Global 8-bit grayscale equalization of every pixel of one image only
+    ProgramOptions options;
+    HisteqBackend backend = HISTEQ_SIMD;
+    bool valid = parseOptions(argc, argv, options) && options.bits == 8 && !options.color && !options.clahe && options.batch.empty() && !options.stream &&
+                 options.sequence.empty() && !hasMpiOnlyOptions(options) && !options.profile &&
+                 options.sampleRate == 1 && options.sampleError == 0;
+    bool autoBackend = options.backend == "auto";
+    if (valid && !autoBackend && !parseHisteqBackend(options.backend, backend))
+        valid = false;
+    if (!valid)
+    {
+        if (rank == 0)
+            cout << "Usage: [mpirun -np <num_processes>] " << argv[0] << " [--quiet|-q] [--verify] [--no-artifacts] [--png-compression <0-9>] [--timings <path>] [--backend <auto|scalar|simd|omp|mpi>] [--threads <n>] [--retune] [--tuning-cache <path>] <image_path>" << endl;
+        return finish(-1);
+    }
+    if (!autoBackend && !histeqBackendAvailable(backend))
+    {
+        if (rank == 0)
+            cerr << "The " << options.backend << " backend is not available (omp needs -fopenmp, mpi a HISTEQ_WITH_MPI build run on more than one rank)" << endl;
+        return finish(-1);
+    }
+#ifdef _OPENMP
+    if (options.threads > 0)
+        omp_set_num_threads(options.threads);
+#endif
+    bool quiet = options.quiet;
+
+    ImageType image;
+    if (rank == 0)
+    {
+        try
+        {
+            readImage(options.filename, image);
+        }
+        catch (const std::exception &)
+        {
+#ifdef HISTEQ_WITH_MPI
+            MPI_Abort(MPI_COMM_WORLD, -1);
+#endif
+            throw;
+        }
+    }
+
+    // Calibration, when the size bucket has no cached plan yet, is not part of the runtime
+    HisteqPlan plan;
+    plan.backend = backend;
+#ifdef _OPENMP
+    plan.threads = omp_get_max_threads();
+#endif
+    auto tuneStart = chrono::high_resolution_clock::now();
+    if (autoBackend)
+    {
+        HisteqTuner tuner(options.tuningCache.empty() ? HISTEQ_DEFAULT_TUNING_CACHE : options.tuningCache);
+        plan = tuner.plan(image.rows(), image.cols(), options.retune);
+    }
+    auto tuneEnd = chrono::high_resolution_clock::now();
+
+    ImageType equalizedImage;
+    vector<int> histBefore, histAfter;
+    double duration = 0;
+    if (rank == 0)
+    {
+        duration = measureRuntime(
+            RUNTIME_OUTPUT_PATH,
+            [&]()
+            { histeqEqualize(image, equalizedImage, histBefore, histAfter, plan); });
+    }
+    else
+    {
+        histeqEqualize(image, equalizedImage, histBefore, histAfter, plan);
+    }
+
+    if (rank == 0)
+    {
+        if (options.verify && !histogramMatches(equalizedImage.getData(), equalizedImage.rows() * equalizedImage.cols(), histAfter.data()))
+        {
+            cerr << "Derived histogram after equalization does not match the equalized image" << endl;
+#ifdef HISTEQ_WITH_MPI
+            MPI_Abort(MPI_COMM_WORLD, -1);
+#endif
+            return -1;
+        }
+
+        // Every output is encoded on its own thread; the histogram plots go to the composites in memory
+        ImageWriter writer(options.pngCompression);
+        writer.write(AFTER_IMAGE_OUTPUT_PATH, equalizedImage);
+        if (!options.noArtifacts)
+        {
+            writer.write(BEFORE_IMAGE_OUTPUT_PATH, image);
+            Mat plotBefore = outputHistogram(histBefore, BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram BEFORE Equalization", quiet, writer);
+            Mat plotAfter = outputHistogram(histAfter, AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram AFTER Equalization", quiet, writer);
+
+            generateCombinedOutputs(
+                image,
+                equalizedImage,
+                plotBefore,
+                plotAfter,
+                BEFORE_IMAGE_HISTOGRAM_COMBINED_PATH,
+                AFTER_IMAGE_HISTOGRAM_COMBINED_PATH,
+                BEFORE_AFTER_COMBINED_PATH,
+                writer);
+        }
+        writer.wait();
+
+        if (!quiet && !options.noArtifacts)
+            cout << "\nSaved " << BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH << " and " << AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH << " successfully." << endl;
+
+        cout << "Backend: " << histeqBackendName(plan.backend);
+        if (plan.backend == HISTEQ_OMP)
+            cout << " x " << plan.threads << " thread(s)";
+        else if (plan.backend == HISTEQ_MPI)
+            cout << " x " << size << " rank(s)";
+        if (autoBackend)
+            cout << " (tuning " << chrono::duration<double, milli>(tuneEnd - tuneStart).count() << " ms)";
+        cout << endl;
+        cout << "Runtime: " << duration << " ms" << endl;
+        if (!options.timingsPath.empty())
+        {
+            // The engine column names the plan that ran, so runs of different plans stay apart
+            int workers = plan.backend == HISTEQ_OMP ? plan.threads : plan.backend == HISTEQ_MPI ? size : 1;
+            appendTiming(options.timingsPath, string("auto-") + histeqBackendName(plan.backend), workers, image.rows(), image.cols(), duration);
+        }
+    }
+
+    return finish(0);
+}
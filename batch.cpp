@@ -0,0 +1,413 @@
+#include "batch.hpp"
+#include "kernels.hpp"
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <dirent.h>
+#include <sys/stat.h>
+
+namespace
+{
+    typedef chrono::steady_clock Clock;
+
+    double elapsedMs(Clock::time_point start)
+    {
+        return chrono::duration<double, milli>(Clock::now() - start).count();
+    }
+
+    string baseName(const string &path)
+    {
+        size_t slash = path.find_last_of('/');
+        return slash == string::npos ? path : path.substr(slash + 1);
+    }
+
+    void printUtilisation(const string &stage, double busyMs, int threads, double wallMs)
+    {
+        double utilisation = threads > 0 && wallMs > 0 ? 100.0 * busyMs / (threads * wallMs) : 0;
+        cout << "  " << left << setw(10) << stage << right << setw(3) << threads << " thread(s)"
+             << setw(8) << fixed << setprecision(1) << utilisation << " % busy" << endl;
+    }
+}
+
+bool listBatchInputs(const string &path, vector<string> &files)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        return false;
+
+    if (S_ISDIR(info.st_mode))
+    {
+        DIR *dir = opendir(path.c_str());
+        if (dir == nullptr)
+            return false;
+        while (dirent *entry = readdir(dir))
+        {
+            string file = path + "/" + entry->d_name;
+            struct stat fileInfo;
+            if (entry->d_name[0] != '.' && stat(file.c_str(), &fileInfo) == 0 && S_ISREG(fileInfo.st_mode))
+                files.push_back(file);
+        }
+        closedir(dir);
+        sort(files.begin(), files.end());
+        return true;
+    }
+
+    ifstream list(path);
+    if (!list)
+        return false;
+    string line;
+    while (getline(list, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (!line.empty())
+            files.push_back(line);
+    }
+    return true;
+}
+
+BatchStats runBatch(const vector<string> &files, const string &outputDir, int ioThreads, bool keepColor, int pngCompression,
+                    const BatchEqualizer &equalize)
+{
+    BatchStats stats;
+    stats.decodeThreads = stats.encodeThreads = max(ioThreads, 1);
+    stats.equalizeThreads = 1;
+    makeDirectories(outputDir);
+
+    // Two items per thread on either side keeps every stage fed without buffering the whole batch
+    BoundedQueue<BatchItem> decoded(2 * stats.decodeThreads);
+    BoundedQueue<BatchItem> equalized(2 * stats.encodeThreads);
+
+    atomic<size_t> nextFile(0), failures(0), written(0);
+    atomic<int> decodersLeft(stats.decodeThreads);
+    vector<double> decodeBusy(stats.decodeThreads, 0), encodeBusy(stats.encodeThreads, 0);
+    mutex logLock;
+
+    auto report = [&](const string &file, const exception &e)
+    {
+        failures++;
+        lock_guard<mutex> guard(logLock);
+        cerr << "Skipping " << file << ": " << e.what() << endl;
+    };
+
+    Clock::time_point start = Clock::now();
+
+    vector<thread> workers;
+    for (int t = 0; t < stats.decodeThreads; t++)
+    {
+        workers.emplace_back([&, t]()
+                             {
+            for (size_t i = nextFile++; i < files.size(); i = nextFile++)
+            {
+                Clock::time_point begin = Clock::now();
+                BatchItem item;
+                item.name = baseName(files[i]);
+                try
+                {
+                    readImage(files[i], item.image, keepColor);
+                }
+                catch (const exception &e)
+                {
+                    report(files[i], e);
+                    continue;
+                }
+                decodeBusy[t] += elapsedMs(begin);
+                decoded.push(std::move(item));
+            }
+            if (--decodersLeft == 0)
+                decoded.close(); });
+    }
+
+    for (int t = 0; t < stats.encodeThreads; t++)
+    {
+        workers.emplace_back([&, t]()
+                             {
+            BatchItem item;
+            while (equalized.pop(item))
+            {
+                Clock::time_point begin = Clock::now();
+                string file = outputDir + "/" + item.name;
+                try
+                {
+                    writeImage(file, item.image, pngCompression);
+                    written++;
+                }
+                catch (const exception &e)
+                {
+                    report(file, e);
+                }
+                encodeBusy[t] += elapsedMs(begin);
+            } });
+    }
+
+    // Equalize stage on the calling thread
+    BatchItem item;
+    while (decoded.pop(item))
+    {
+        Clock::time_point begin = Clock::now();
+        BatchItem result;
+        result.name = item.name;
+        try
+        {
+            equalize(item.image, result.image);
+        }
+        catch (const exception &e)
+        {
+            report(item.name, e);
+            continue;
+        }
+        stats.equalizeBusyMs += elapsedMs(begin);
+        equalized.push(std::move(result));
+    }
+    equalized.close();
+
+    for (thread &worker : workers)
+        worker.join();
+
+    stats.wallMs = elapsedMs(start);
+    stats.images = written;
+    stats.failures = failures;
+    for (double ms : decodeBusy)
+        stats.decodeBusyMs += ms;
+    for (double ms : encodeBusy)
+        stats.encodeBusyMs += ms;
+    return stats;
+}
+
+void printBatchStats(const BatchStats &stats)
+{
+    double seconds = stats.wallMs / 1000;
+    cout << "\n=== Batch ===" << endl;
+    cout << "  Images: " << stats.images << " (" << stats.failures << " failed) in "
+         << fixed << setprecision(2) << seconds << " s, "
+         << setprecision(1) << (seconds > 0 ? stats.images / seconds : 0) << " images/s" << endl;
+    printUtilisation("decode", stats.decodeBusyMs, stats.decodeThreads, stats.wallMs);
+    printUtilisation("equalize", stats.equalizeBusyMs, stats.equalizeThreads, stats.wallMs);
+    printUtilisation("encode", stats.encodeBusyMs, stats.encodeThreads, stats.wallMs);
+}
+
+namespace
+{
+    // Buffers of one frame, reused for the whole sequence
+    struct SequenceSlot
+    {
+        Mat decoded;     // Decoder output; VideoCapture::read and imdecode refill it in place
+        ImageType frame; // Grayscale frame
+        ImageType output;
+        string name;
+        Clock::time_point decodeStart;
+    };
+
+    string stemName(const string &path)
+    {
+        string name = baseName(path);
+        size_t dot = name.find_last_of('.');
+        return dot == string::npos ? name : name.substr(0, dot);
+    }
+
+    // Reads the whole file into bytes, keeping its capacity from the previous file
+    bool readFileBytes(const string &path, vector<uchar> &bytes)
+    {
+        ifstream file(path, ios::binary | ios::ate);
+        if (!file)
+            return false;
+        bytes.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        return static_cast<bool>(file.read(reinterpret_cast<char *>(bytes.data()), bytes.size()));
+    }
+}
+
+SequenceStats runSequence(const string &source, const string &outputDir, double smoothing, int pngCompression,
+                          const SequenceCounter &count, const SequenceRemapper &remap)
+{
+    SequenceStats stats;
+    makeDirectories(outputDir);
+
+    // A directory is a numbered frame sequence, anything else goes to the video decoder
+    struct stat info;
+    bool frameDirectory = stat(source.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+    vector<string> files;
+    VideoCapture capture;
+    double fps = 25;
+    if (frameDirectory)
+        listBatchInputs(source, files);
+    else
+    {
+        if (!capture.open(source))
+            throw runtime_error("Could not open video " + source);
+        if (capture.get(CAP_PROP_FPS) > 0)
+            fps = capture.get(CAP_PROP_FPS);
+    }
+    double expectedFrames = frameDirectory ? files.size() : capture.get(CAP_PROP_FRAME_COUNT);
+    stats.latencyMs.reserve(expectedFrames > 0 ? static_cast<size_t>(expectedFrames) : 1024);
+
+    // Slots cycle free -> decoded -> equalized -> free; only their indices travel through the queues
+    vector<SequenceSlot> slots(SEQUENCE_SLOTS);
+    BoundedQueue<int> freeSlots(SEQUENCE_SLOTS), decodedSlots(SEQUENCE_SLOTS), equalizedSlots(SEQUENCE_SLOTS);
+    for (int i = 0; i < SEQUENCE_SLOTS; i++)
+        freeSlots.push(int(i));
+
+    // First error of any stage. It closes every queue, so the other stages drain and stop, and it is
+    // rethrown once both threads have been joined (a joinable thread on unwinding would terminate)
+    exception_ptr failure;
+    mutex failureLock;
+    auto fail = [&](exception_ptr error)
+    {
+        {
+            lock_guard<mutex> guard(failureLock);
+            if (!failure)
+                failure = error;
+        }
+        freeSlots.close();
+        decodedSlots.close();
+        equalizedSlots.close();
+    };
+
+    Clock::time_point start = Clock::now();
+
+    thread decoder([&]()
+                   {
+        try
+        {
+            size_t next = 0;
+            int index;
+            // imread allocates every frame anew; reading the file into a reused buffer and decoding it
+            // into the slot's Mat keeps both allocations for frames of the same size
+            vector<uchar> encoded;
+            while (freeSlots.pop(index))
+            {
+                SequenceSlot &slot = slots[index];
+                slot.decodeStart = Clock::now();
+                if (frameDirectory)
+                {
+                    if (next == files.size())
+                        break;
+                    slot.name = baseName(files[next]);
+                    bool loaded = readFileBytes(files[next++], encoded);
+                    if (!loaded || imdecode(encoded, IMREAD_GRAYSCALE, &slot.decoded).empty())
+                    {
+                        cerr << "Skipping " << slot.name << ": could not decode" << endl;
+                        freeSlots.push(int(index));
+                        continue;
+                    }
+                }
+                else if (!capture.read(slot.decoded))
+                    break;
+
+                // Colour video is converted straight into the frame buffer; grayscale frames are adopted
+                if (slot.decoded.channels() == 1)
+                    slot.frame.assign(slot.decoded);
+                else
+                {
+                    slot.frame.resize(slot.decoded.rows, slot.decoded.cols);
+                    Mat gray = slot.frame.asMat();
+                    cvtColor(slot.decoded, gray, slot.decoded.channels() == 4 ? COLOR_BGRA2GRAY : COLOR_BGR2GRAY);
+                }
+                stats.decodeBusyMs += elapsedMs(slot.decodeStart);
+                decodedSlots.push(int(index));
+            }
+        }
+        catch (...)
+        {
+            fail(current_exception());
+        }
+        decodedSlots.close(); });
+
+    thread encoder([&]()
+                   {
+        VideoWriter writer;
+        int index;
+        while (equalizedSlots.pop(index))
+        {
+            SequenceSlot &slot = slots[index];
+            Clock::time_point begin = Clock::now();
+            try
+            {
+                if (frameDirectory)
+                    writeImage(outputDir + "/" + slot.name, slot.output, pngCompression);
+                else
+                {
+                    if (!writer.isOpened())
+                    {
+                        string path = outputDir + "/" + stemName(source) + ".avi";
+                        writer.open(path, VideoWriter::fourcc('M', 'J', 'P', 'G'), fps,
+                                    Size(static_cast<int>(slot.output.cols()), static_cast<int>(slot.output.rows())), false);
+                        // Without an MJPG encoder every later write would silently do nothing
+                        if (!writer.isOpened())
+                        {
+                            fail(make_exception_ptr(runtime_error("Could not open " + path + " for writing (MJPG)")));
+                            break;
+                        }
+                    }
+                    writer.write(slot.output.asMat());
+                }
+            }
+            catch (const exception &e)
+            {
+                cerr << "Could not write frame " << stats.latencyMs.size() << ": " << e.what() << endl;
+            }
+            stats.encodeBusyMs += elapsedMs(begin);
+            stats.latencyMs.push_back(elapsedMs(slot.decodeStart));
+            freeSlots.push(int(index));
+        } });
+
+    // Equalize stage on the calling thread
+    vector<int> hist(HIST_SIZE), smoothedCounts(HIST_SIZE);
+    vector<double> smoothed(HIST_SIZE);
+    vector<uint8_t> lut(HIST_SIZE);
+    int index;
+    try
+    {
+        while (decodedSlots.pop(index))
+        {
+            SequenceSlot &slot = slots[index];
+            Clock::time_point begin = Clock::now();
+            count(slot.frame, hist.data());
+
+            // Running histogram; its CDF gives the LUT, so it moves as slowly as the histogram does
+            long long total = 0;
+            for (int v = 0; v < HIST_SIZE; v++)
+            {
+                smoothed[v] = stats.frames == 0 ? hist[v] : smoothed[v] + smoothing * (hist[v] - smoothed[v]);
+                smoothedCounts[v] = static_cast<int>(llround(smoothed[v]));
+                total += smoothedCounts[v];
+            }
+            HistogramKernels<uint8_t, HIST_SIZE>::buildLookupTable(smoothedCounts.data(), max<long long>(total, 1), lut.data());
+
+            slot.output.resize(slot.frame.rows(), slot.frame.cols());
+            remap(slot.frame, slot.output, lut.data());
+            stats.frames++;
+            stats.equalizeBusyMs += elapsedMs(begin);
+            equalizedSlots.push(int(index));
+        }
+    }
+    catch (...)
+    {
+        fail(current_exception());
+    }
+    equalizedSlots.close();
+
+    decoder.join();
+    encoder.join();
+    freeSlots.close();
+    if (failure)
+        rethrow_exception(failure);
+    stats.wallMs = elapsedMs(start);
+    return stats;
+}
+
+void printSequenceStats(const SequenceStats &stats)
+{
+    double seconds = stats.wallMs / 1000;
+    vector<double> latency = stats.latencyMs;
+    sort(latency.begin(), latency.end());
+
+    cout << "\n=== Sequence ===" << endl;
+    cout << "  Frames: " << stats.frames << " in " << fixed << setprecision(2) << seconds << " s, "
+         << setprecision(1) << (seconds > 0 ? stats.frames / seconds : 0) << " fps sustained" << endl;
+    cout << "  Latency: " << setprecision(2) << percentile(latency, 50) << " ms p50, " << percentile(latency, 99) << " ms p99, "
+         << (latency.empty() ? 0 : latency.back()) << " ms max" << endl;
+    printUtilisation("decode", stats.decodeBusyMs, 1, stats.wallMs);
+    printUtilisation("equalize", stats.equalizeBusyMs, 1, stats.wallMs);
+    printUtilisation("encode", stats.encodeBusyMs, 1, stats.wallMs);
+}
@@ -0,0 +1,125 @@
+#include "utils.hpp"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+// Fixed-capacity FIFO between two pipeline stages. push blocks while the queue is full, which
+// throttles the producer to the consumer's pace and keeps the number of decoded images flat.
+// pop blocks while it is empty and returns false once the queue is closed and drained.
+template <typename T>
+class BoundedQueue
+{
+private:
+  deque<T> items;
+  size_t capacity;
+  bool closed;
+  mutex lock;
+  condition_variable notFull;
+  condition_variable notEmpty;
+
+public:
+  explicit BoundedQueue(size_t capacity) : capacity(max<size_t>(capacity, 1)), closed(false) {}
+
+  void push(T &&item)
+  {
+    unique_lock<mutex> guard(lock);
+    notFull.wait(guard, [&]()
+                 { return items.size() < capacity || closed; });
+    items.push_back(std::move(item));
+    notEmpty.notify_one();
+  }
+
+  bool pop(T &item)
+  {
+    unique_lock<mutex> guard(lock);
+    notEmpty.wait(guard, [&]()
+                  { return !items.empty() || closed; });
+    if (items.empty())
+      return false;
+    item = std::move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  // No more pushes; wakes every waiting consumer
+  void close()
+  {
+    lock_guard<mutex> guard(lock);
+    closed = true;
+    notEmpty.notify_all();
+    notFull.notify_all();
+  }
+};
+
+// One image travelling through the pipeline
+struct BatchItem
+{
+  string name; // Output file name (the input's base name)
+  ImageType image;
+};
+
+// Equalizes input into output; may throw to mark the image as failed
+typedef function<void(const ImageType &input, ImageType &output)> BatchEqualizer;
+
+struct BatchStats
+{
+  size_t images = 0;   // Written successfully
+  size_t failures = 0; // Failed to decode, equalize or encode
+  double wallMs = 0;
+  // Time spent working (not waiting on a queue), summed over the threads of each stage
+  double decodeBusyMs = 0;
+  double equalizeBusyMs = 0;
+  double encodeBusyMs = 0;
+  int decodeThreads = 0;
+  int equalizeThreads = 0;
+  int encodeThreads = 0;
+};
+
+// Files of a directory (sorted), or the lines of a list file; false if path is neither
+bool listBatchInputs(const string &path, vector<string> &files);
+
+// Decodes files on ioThreads threads, equalizes them one at a time on the calling thread (so the
+// engine's own parallelism and MPI calls stay on it) and encodes the results into outputDir on
+// ioThreads threads, PNGs at zlib level pngCompression
+BatchStats runBatch(const vector<string> &files, const string &outputDir, int ioThreads, bool keepColor, int pngCompression,
+                    const BatchEqualizer &equalize);
+
+void printBatchStats(const BatchStats &stats);
+
+// Frames in flight in sequence mode: one being decoded, one equalized, one encoded, one spare
+#define SEQUENCE_SLOTS 4
+
+// Engine kernels of sequence mode, called on the equalize thread: the histogram of a frame
+// (HIST_SIZE bins, overwritten), and the remap of a frame into output (already sized) through a LUT
+typedef function<void(const ImageType &frame, int *hist)> SequenceCounter;
+typedef function<void(const ImageType &frame, ImageType &output, const uint8_t *lut)> SequenceRemapper;
+
+struct SequenceStats
+{
+  size_t frames = 0;
+  double wallMs = 0;
+  double decodeBusyMs = 0;
+  double equalizeBusyMs = 0;
+  double encodeBusyMs = 0;
+  vector<double> latencyMs; // Per frame, from the start of its decode to the end of its encode
+};
+
+// Equalizes a video file, or the frames of a directory in name order, as one sequence. Every frame
+// is equalized with the LUT of an exponentially smoothed histogram, smoothed += smoothing *
+// (hist - smoothed), so the brightness does not flicker from frame to frame (smoothing 1 equalizes
+// every frame on its own). Decoding, equalizing and encoding run on three threads that pass
+// SEQUENCE_SLOTS reused frame buffers around. Frames go to outputDir under their own names (PNGs at
+// zlib level pngCompression), or into <outputDir>/<video name>.avi (MJPG) for a video. Throws
+// runtime_error if the video cannot be opened or written; an exception of count, remap or the decoder
+// stops every stage and is rethrown once the threads have been joined.
+SequenceStats runSequence(const string &source, const string &outputDir, double smoothing, int pngCompression,
+                          const SequenceCounter &count, const SequenceRemapper &remap);
+
+void printSequenceStats(const SequenceStats &stats);
+
+#endif
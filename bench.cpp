@@ -0,0 +1,923 @@
+#ifdef BENCH_MPI
+#include <mpi.h>
+#endif
+#include "utils.hpp"
+#include "kernels.hpp"
+#include "omp_kernels.hpp"
+#include "clahe.hpp"
+#include "delta.hpp"
+#include "tiles.hpp"
+#include <random>
+#include <sstream>
+
+using namespace std;
+
+#define DEFAULT_BENCH_WIDTH 4096
+#define DEFAULT_BENCH_HEIGHT 4096
+#define DEFAULT_BENCH_REPS 20
+#define DEFAULT_BENCH_WARMUP 3
+
+// Size of input/photo.jpeg, used for the ingest/egress comparison
+#define PHOTO_WIDTH 3648
+#define PHOTO_HEIGHT 5472
+
+// Side of the remap + histogram image: 64 MB in and 64 MB out, beyond any last-level cache
+#define TILE_BENCH_SIZE 8192
+
+// Where the output-writing section puts its files, and how many times it writes them at most
+#define OUTPUT_BENCH_DIR "output/bench"
+#define OUTPUT_BENCH_REPS 3
+
+namespace
+{
+    // Best-of-N wall time in milliseconds (after one untimed warm-up call)
+    template <typename Func>
+    double bestOf(int reps, Func &&func)
+    {
+        func();
+        double best = 1e300;
+        for (int r = 0; r < reps; r++)
+        {
+            auto start = chrono::high_resolution_clock::now();
+            func();
+            auto end = chrono::high_resolution_clock::now();
+            best = min(best, chrono::duration<double, milli>(end - start).count());
+        }
+        return best;
+    }
+
+    void printResult(const string &name, double ms, double bytes, double baselineMs)
+    {
+        cout << "  " << left << setw(28) << name << right
+             << setw(10) << fixed << setprecision(3) << ms << " ms"
+             << setw(10) << setprecision(2) << bytes / (ms * 1e6) << " GB/s"
+             << setw(9) << setprecision(2) << baselineMs / ms << "x" << endl;
+    }
+
+    void fillRandom(ImageType &image, unsigned seed)
+    {
+        mt19937 gen(seed);
+        uniform_int_distribution<int> dist(0, 255);
+        uint8_t *data = image.getData();
+        for (size_t i = 0; i < image.rows() * image.cols(); i++)
+            data[i] = static_cast<uint8_t>(dist(gen));
+    }
+
+    // Low-entropy patterns where consecutive pixels mostly share a value
+    void fillConstant(ImageType &image)
+    {
+        memset(image.getData(), 128, image.rows() * image.cols());
+    }
+
+    void fillTwoTone(ImageType &image, unsigned seed)
+    {
+        // Black/white runs of random length, like a thresholded document scan
+        mt19937 gen(seed);
+        uniform_int_distribution<int> runLength(8, 256);
+        uint8_t *data = image.getData();
+        size_t total = image.rows() * image.cols();
+        uint8_t value = 255;
+        for (size_t i = 0; i < total;)
+        {
+            size_t run = min<size_t>(runLength(gen), total - i);
+            memset(data + i, value, run);
+            i += run;
+            value = 255 - value;
+        }
+    }
+
+    void fillGradient(ImageType &image)
+    {
+        for (size_t i = 0; i < image.rows(); i++)
+            for (size_t j = 0; j < image.cols(); j++)
+                image.at(i, j) = static_cast<uint8_t>(255 * (i + j) / (image.rows() + image.cols()));
+    }
+
+    // Histogram pass: the single-table at() loop the engines used to run vs the banked kernel
+    void benchHistogram(size_t rows, size_t cols, int reps)
+    {
+        ImageType image(rows, cols);
+        vector<int> hist(HIST_SIZE);
+        double bytes = 1.0 * rows * cols;
+
+        cout << "\n=== Histogram (" << cols << "x" << rows << ", best of " << reps << ") ===" << endl;
+
+        const char *patterns[] = {"constant", "two-tone", "gradient", "random"};
+        for (const char *pattern : patterns)
+        {
+            string name = pattern;
+            if (name == "constant")
+                fillConstant(image);
+            else if (name == "two-tone")
+                fillTwoTone(image, 7);
+            else if (name == "gradient")
+                fillGradient(image);
+            else
+                fillRandom(image, 42);
+
+            cout << " " << name << ":" << endl;
+            double baselineMs = bestOf(reps, [&]()
+                                       {
+                fill(hist.begin(), hist.end(), 0);
+                for (size_t i = 0; i < image.rows(); i++)
+                    for (size_t j = 0; j < image.cols(); j++)
+                        hist[image.at(i, j)]++; });
+            printResult("at() loop", baselineMs, bytes, baselineMs);
+
+            double ms = bestOf(reps, [&]()
+                               {
+                fill(hist.begin(), hist.end(), 0);
+                computeHistogram(image.getData(), rows * cols, hist.data()); });
+            printResult("computeHistogram", ms, bytes, baselineMs);
+        }
+    }
+
+    // Approximate histograms for previews: the exact count vs samples by rate and by error budget,
+    // with the LUT deviation each one ends up with. GB/s is relative to the whole image.
+    void benchSampling(size_t rows, size_t cols, int reps)
+    {
+        ImageType image(rows, cols);
+        fillGradient(image);
+        size_t total = rows * cols;
+        vector<int> hist(HIST_SIZE), exactHist(HIST_SIZE, 0);
+        vector<uint8_t> eqLookupTable(HIST_SIZE);
+        computeHistogram(image.getData(), total, exactHist.data());
+        double bytes = 1.0 * total;
+
+        cout << "\n=== Sampled histogram (" << cols << "x" << rows << ", gradient, best of " << reps << ") ===" << endl;
+
+        double exactMs = bestOf(reps, [&]()
+                                {
+            fill(hist.begin(), hist.end(), 0);
+            computeHistogram(image.getData(), total, hist.data()); });
+        printResult("exact", exactMs, bytes, exactMs);
+
+        const HistogramSampling samplings[] = {{0.5, 0}, {0.1, 0}, {0.01, 0}, {1, 1}, {1, 2}, {1, 4}};
+        for (const HistogramSampling &sampling : samplings)
+        {
+            size_t stride = sampling.stride(total, HIST_SIZE), sampled = 0;
+            double ms = bestOf(reps, [&]()
+                               {
+                fill(hist.begin(), hist.end(), 0);
+                sampled = forEachSampleBlock(total, stride, [&](size_t begin, size_t length)
+                                             { computeHistogram(image.getData() + begin, length, hist.data()); }); });
+            buildEqualizationLookupTable(hist.data(), sampled, eqLookupTable.data());
+            int deviation = lookupTableDeviation<uint8_t, HIST_SIZE>(exactHist.data(), total, eqLookupTable.data());
+
+            ostringstream name;
+            if (sampling.errorLevels > 0)
+                name << "budget " << sampling.errorLevels << " (";
+            else
+                name << "rate " << sampling.rate << " (";
+            name << "max dev " << deviation << ")";
+            printResult(name.str(), ms, bytes, exactMs);
+        }
+    }
+
+    // Remap pass: the per-pixel at() loop the engines used to run vs the shared SIMD kernel
+    void benchLookupTable(size_t rows, size_t cols, int reps)
+    {
+        ImageType input(rows, cols), output(rows, cols);
+        fillRandom(input, 42);
+
+        vector<uint8_t> eqLookupTable(HIST_SIZE);
+        for (int i = 0; i < HIST_SIZE; i++)
+            eqLookupTable[i] = static_cast<uint8_t>(255 - i);
+
+        // Read + write traffic of one remap pass
+        double bytes = 2.0 * rows * cols;
+
+        cout << "\n=== LUT remap (" << cols << "x" << rows << ", best of " << reps << ") ===" << endl;
+
+        double baselineMs = bestOf(reps, [&]()
+                                   {
+            for (size_t i = 0; i < input.rows(); i++)
+                for (size_t j = 0; j < input.cols(); j++)
+                    output.at(i, j) = eqLookupTable[input.at(i, j)]; });
+        printResult("at() loop", baselineMs, bytes, baselineMs);
+
+        for (int level = SIMD_SCALAR; level <= detectSimdLevel(); level++)
+        {
+            SimdLevel simd = static_cast<SimdLevel>(level);
+            double ms = bestOf(reps, [&]()
+                               { applyLookupTable(input.getData(), output.getData(), rows * cols, eqLookupTable.data(), simd); });
+            printResult(string("applyLookupTable/") + simdLevelName(simd), ms, bytes, baselineMs);
+        }
+    }
+
+    // Full sequential pipelines: global equalization vs tiled CLAHE on the same gradient image
+    void benchClahe(size_t rows, size_t cols, int reps)
+    {
+        ImageType input(rows, cols), output(rows, cols);
+        fillGradient(input);
+        double bytes = 2.0 * rows * cols;
+
+        cout << "\n=== Global vs CLAHE (" << cols << "x" << rows << ", best of " << reps << ") ===" << endl;
+
+        vector<int> hist(HIST_SIZE);
+        vector<uint8_t> eqLookupTable(HIST_SIZE);
+        double globalMs = bestOf(reps, [&]()
+                                 {
+            fill(hist.begin(), hist.end(), 0);
+            computeHistogram(input.getData(), rows * cols, hist.data());
+            int sum = 0;
+            for (int i = 0; i < HIST_SIZE; i++)
+            {
+                sum += hist[i];
+                eqLookupTable[i] = static_cast<uint8_t>(round(255.0 * sum / (rows * cols)));
+            }
+            applyLookupTable(input.getData(), output.getData(), rows * cols, eqLookupTable.data()); });
+        printResult("global", globalMs, bytes, globalMs);
+
+        const int grids[] = {4, 8, 16};
+        for (int grid : grids)
+        {
+            ClaheParams params{grid, grid, CLAHE_DEFAULT_CLIP_LIMIT};
+            fitClaheParams(params, rows, cols);
+            double ms = bestOf(reps, [&]()
+                               {
+                vector<uint8_t> luts(static_cast<size_t>(params.tilesY) * params.tilesX * HIST_SIZE);
+                for (int ty = 0; ty < params.tilesY; ty++)
+                    for (int tx = 0; tx < params.tilesX; tx++)
+                        computeClaheTile(input, 0, rows, params, ty, tx, luts);
+                ClaheAxis xAxis, yAxis;
+                buildClaheAxis(cols, params.tilesX, xAxis);
+                buildClaheAxis(rows, params.tilesY, yAxis);
+                interpolateClaheRows(input, output, 0, rows, 0, xAxis, yAxis, params, luts); });
+            printResult("clahe " + to_string(grid) + "x" + to_string(grid), ms, bytes, globalMs);
+        }
+    }
+
+    // Interactive edits: a full re-equalization vs a DeltaEqualizer update after a square brush
+    // stroke of noise is painted over, then erased from, a random image. Each rep applies one of the
+    // two (the pixel copy included); GB/s is relative to the whole image.
+    void benchDeltaUpdate(size_t rows, size_t cols, int reps)
+    {
+        ImageType image(rows, cols), output(rows, cols), expected(rows, cols);
+        fillRandom(image, 42);
+        double bytes = 2.0 * rows * cols;
+
+        cout << "\n=== Delta update (" << cols << "x" << rows << ", " << DELTA_DEFAULT_TILE << "px tiles, best of " << reps << ") ===" << endl;
+
+        DeltaEqualizer equalizer;
+        double fullMs = bestOf(reps, [&]()
+                               { equalizer.reset(image, output); });
+        printResult("full", fullMs, bytes, fullMs);
+
+        const size_t sides[] = {16, 128, 1024};
+        for (size_t side : sides)
+        {
+            side = min(side, min(rows, cols));
+            Rect rect(static_cast<int>((cols - side) / 2), static_cast<int>((rows - side) / 2), static_cast<int>(side), static_cast<int>(side));
+            ImageType original(side, side), stroke(side, side);
+            fillRandom(stroke, static_cast<unsigned>(side));
+            for (size_t i = 0; i < side; i++)
+                memcpy(&original.at(i, 0), &image.at(rect.y + i, rect.x), side);
+
+            bool painted = false;
+            int lutChanges = 0, updates = 0;
+            double ms = bestOf(reps, [&]()
+                               {
+                const ImageType &patch = painted ? original : stroke;
+                for (size_t i = 0; i < side; i++)
+                    memcpy(&image.at(rect.y + i, rect.x), &patch.at(i, 0), side);
+                painted = !painted;
+                lutChanges += equalizer.update(image, {rect}, output);
+                updates++; });
+            printResult("update " + to_string(side) + "x" + to_string(side) + " (" + to_string(lutChanges) + "/" + to_string(updates) + " LUT)", ms, bytes, fullMs);
+
+            // The incremental output must match equalizing the edited image from scratch
+            DeltaEqualizer().reset(image, expected);
+            if (memcmp(output.getData(), expected.getData(), rows * cols) != 0)
+                cerr << "Delta update " << side << "x" << side << " differs from a full equalization" << endl;
+        }
+
+        // An image of another size than reset saw must be refused, not indexed past the tile histograms
+        ImageType smaller(rows / 2 + 1, cols / 2 + 1);
+        fillRandom(smaller, 7);
+        bool refused = false;
+        try
+        {
+            equalizer.update(smaller, {Rect(0, 0, static_cast<int>(cols), static_cast<int>(rows))}, output);
+        }
+        catch (const invalid_argument &)
+        {
+            refused = true;
+        }
+        if (!refused)
+            cerr << "Delta update accepted an image of another size than reset" << endl;
+    }
+
+    // Remap plus a histogram of the output (what --verify checks) on an image far larger than the
+    // last-level cache: a remap sweep followed by a counting sweep, which reads the output back from
+    // DRAM, vs the tile scheduler counting every tile right after remapping it. GB/s is of the
+    // bytes the two-sweep version moves (read input, write output, read output).
+    void benchTiles(int reps)
+    {
+        const size_t rows = TILE_BENCH_SIZE, cols = TILE_BENCH_SIZE, total = rows * cols;
+        ImageType input(rows, cols), output(rows, cols);
+        fillRandom(input, 42);
+        vector<uint8_t> eqLookupTable(HIST_SIZE);
+        for (int i = 0; i < HIST_SIZE; i++)
+            eqLookupTable[i] = static_cast<uint8_t>(255 - i);
+        double bytes = 3.0 * total;
+        int threads = omp_get_max_threads();
+
+        cout << "\n=== Remap + output histogram (" << cols << "x" << rows << ", best of " << reps << ") ===" << endl;
+
+        vector<int> hist(HIST_SIZE);
+        double baselineMs = bestOf(reps, [&]()
+                                   {
+            fill(hist.begin(), hist.end(), 0);
+            applyLookupTable(input.getData(), output.getData(), total, eqLookupTable.data());
+            computeHistogram(output.getData(), total, hist.data()); });
+        printResult("2 sweeps", baselineMs, bytes, baselineMs);
+
+        const size_t tileBytes[] = {16 << 10, TILE_DEFAULT_BYTES, 256 << 10, 1 << 20};
+        double bestFusedMs = baselineMs;
+        for (size_t tile : tileBytes)
+        {
+            double ms = bestOf(reps, [&]()
+                               {
+                fill(hist.begin(), hist.end(), 0);
+                TileScheduler scheduler(total, tile, 1);
+                remapTiles<uint8_t, HIST_SIZE>(scheduler, 0, input.getData(), output.getData(), eqLookupTable.data(), hist.data()); });
+            printResult("fused, " + to_string(tile >> 10) + " KB tiles", ms, bytes, baselineMs);
+            bestFusedMs = min(bestFusedMs, ms);
+        }
+
+        // OpenMP: static row split and a parallel counting sweep vs work-stealing fused tiles
+        OmpEqualizationState<uint8_t, HIST_SIZE> state;
+        double ompMs = bestOf(reps, [&]()
+                              {
+#pragma omp parallel
+            {
+                ompApplyLookupTable<uint8_t, HIST_SIZE>(input, output, eqLookupTable.data());
+                ompCountHistogram(output.getData(), total, state, hist.data());
+            } });
+        printResult("2 sweeps, " + to_string(threads) + " threads", ompMs, bytes, baselineMs);
+
+        vector<int> threadHists(static_cast<size_t>(threads) * HIST_SIZE);
+        size_t steals = 0;
+        double tiledMs = bestOf(reps, [&]()
+                                {
+            fill(threadHists.begin(), threadHists.end(), 0);
+            TileScheduler scheduler(total, defaultTileItems<uint8_t>(), threads);
+#pragma omp parallel
+            {
+                int t = omp_get_thread_num();
+                remapTiles<uint8_t, HIST_SIZE>(scheduler, t, input.getData(), output.getData(), eqLookupTable.data(), &threadHists[static_cast<size_t>(t) * HIST_SIZE]);
+            }
+            steals = scheduler.steals(); });
+        printResult("fused, " + to_string(threads) + " threads", tiledMs, bytes, baselineMs);
+
+        // The traffic is a model (the output is read back from DRAM or not), not a counter reading;
+        // the time saved is measured, by the best single-threaded tile size and by the threaded runs
+        size_t sweepsMB = 3 * total >> 20, fusedMB = 2 * total >> 20;
+        cout << fixed << setprecision(0);
+        cout << "  Modelled DRAM traffic (analytic estimate, not measured): 2 sweeps " << sweepsMB << " MB, fused " << fusedMB
+             << " MB (" << -100.0 * (sweepsMB - fusedMB) / sweepsMB << "%)" << endl;
+        cout << "  Measured time: fused " << -100.0 * (baselineMs - bestFusedMs) / baselineMs << "% on 1 thread, "
+             << -100.0 * (ompMs - tiledMs) / ompMs << "% on " << threads << " threads; "
+             << steals << " range(s) stolen in the last threaded run" << endl;
+        cout.unsetf(ios::floatfield);
+        cout << setprecision(6);
+    }
+
+    // Mat -> ImageType and back at the size of input/photo.jpeg: the per-pixel at() copies
+    // readImage/writeImage used to make vs adopting the decoded Mat and handing out a Mat view
+    void benchIngestEgress(int reps)
+    {
+        cout << "\n=== Ingest/egress (" << PHOTO_WIDTH << "x" << PHOTO_HEIGHT << ", best of " << reps << ") ===" << endl;
+
+        const int channelCounts[] = {1, 3};
+        for (int channels : channelCounts)
+        {
+            Mat decoded(PHOTO_HEIGHT, PHOTO_WIDTH, CV_8UC(channels));
+            randu(decoded, Scalar::all(0), Scalar::all(256));
+            double bytes = 1.0 * decoded.total() * decoded.elemSize();
+            cout << " " << (channels == 1 ? "grayscale" : "BGR") << ":" << endl;
+
+            ImageType image;
+            double ingestBaselineMs = bestOf(reps, [&]()
+                                             {
+                image.resize(decoded.rows, decoded.cols, channels);
+                for (int i = 0; i < decoded.rows; i++)
+                    for (int j = 0; j < decoded.cols * channels; j++)
+                        image.getData()[(static_cast<size_t>(i) * decoded.cols) * channels + j] = decoded.ptr(i)[j]; });
+            printResult("ingest at() copy", ingestBaselineMs, bytes, ingestBaselineMs);
+
+            double ms = bestOf(reps, [&]()
+                               { image = ImageType(decoded); });
+            printResult("ingest adopt", ms, bytes, ingestBaselineMs);
+
+            Mat encoded;
+            ImageType owned(decoded.rows, decoded.cols, channels);
+            double egressBaselineMs = bestOf(reps, [&]()
+                                             {
+                encoded.create(decoded.rows, decoded.cols, decoded.type());
+                for (int i = 0; i < encoded.rows; i++)
+                    for (int j = 0; j < encoded.cols * channels; j++)
+                        encoded.ptr(i)[j] = owned.getData()[(static_cast<size_t>(i) * encoded.cols) * channels + j]; });
+            printResult("egress at() copy", egressBaselineMs, bytes, egressBaselineMs);
+
+            ms = bestOf(reps, [&]()
+                        { encoded = owned.asMat(); });
+            printResult("egress asMat view", ms, bytes, egressBaselineMs);
+        }
+    }
+
+    // The outputs of one run on a photo-sized image: the before and after images, the two
+    // histogram plots and the three composites. The baseline encodes them one after another and
+    // reads the two plots back from disk, as the engines used to. ImageWriter encodes them
+    // concurrently, at several zlib levels. --no-artifacts writes the equalized image alone.
+    // GB/s is of the raw pixels of the seven images.
+    void benchOutputs(int reps)
+    {
+        reps = min(reps, OUTPUT_BENCH_REPS);
+        const string dir = OUTPUT_BENCH_DIR;
+        ImageType before(PHOTO_HEIGHT, PHOTO_WIDTH), after(PHOTO_HEIGHT, PHOTO_WIDTH);
+        fillGradient(before);
+        vector<int> histBefore(HIST_SIZE, 0), histAfter(HIST_SIZE, 0);
+        computeHistogram(before.getData(), before.rows() * before.cols(), histBefore.data());
+        vector<uint8_t> eqLookupTable(HIST_SIZE);
+        buildEqualizationLookupTable(histBefore.data(), before.rows() * before.cols(), eqLookupTable.data());
+        applyLookupTable(before.getData(), after.getData(), before.rows() * before.cols(), eqLookupTable.data());
+        remapHistogram(histBefore.data(), eqLookupTable.data(), histAfter.data());
+
+        Mat plotBefore, plotAfter, combinedBefore, combinedAfter, result;
+        {
+            ImageWriter writer;
+            plotBefore = outputHistogram(histBefore, dir + "/histogram_before.png", "", true, writer);
+            plotAfter = outputHistogram(histAfter, dir + "/histogram_after.png", "", true, writer);
+            writer.wait();
+        }
+        stackImages(before.asMat(), plotBefore, combinedBefore, true);
+        stackImages(after.asMat(), plotAfter, combinedAfter, true);
+        stackImages(combinedBefore, combinedAfter, result, false);
+        const pair<string, Mat> outputs[] = {
+            {"image_before.png", before.asMat()}, {"image_after.png", after.asMat()}, {"histogram_before.png", plotBefore}, {"histogram_after.png", plotAfter}, {"image_histo_before.png", combinedBefore}, {"image_histo_after.png", combinedAfter}, {"result.png", result}};
+        double bytes = 0;
+        for (const auto &output : outputs)
+            bytes += 1.0 * output.second.total() * output.second.elemSize();
+
+        cout << "\n=== Outputs (" << PHOTO_WIDTH << "x" << PHOTO_HEIGHT << ", 7 PNGs, best of " << reps << ") ===" << endl;
+
+        double baselineMs = bestOf(reps, [&]()
+                                   {
+            for (const auto &output : outputs)
+                imwrite(dir + "/" + output.first, output.second);
+            imread(dir + "/histogram_before.png", IMREAD_GRAYSCALE);
+            imread(dir + "/histogram_after.png", IMREAD_GRAYSCALE); });
+        printResult("serial + plot re-reads", baselineMs, bytes, baselineMs);
+
+        const int levels[] = {0, PNG_DEFAULT_COMPRESSION, 3, 6};
+        for (int level : levels)
+        {
+            double ms = bestOf(reps, [&]()
+                               {
+                ImageWriter writer(level);
+                for (const auto &output : outputs)
+                    writer.write(dir + "/" + output.first, output.second);
+                writer.wait(); });
+            printResult("ImageWriter level " + to_string(level), ms, bytes, baselineMs);
+        }
+
+        double ms = bestOf(reps, [&]()
+                           { writeImage(dir + "/image_after.png", after); });
+        printResult("--no-artifacts", ms, bytes, baselineMs);
+    }
+
+    // ---- Phase suite (--suite) ----
+
+    // Every timed repetition of one phase of one engine on one synthetic image
+    struct PhaseResult
+    {
+        string engine;
+        string phase;
+        size_t cols;
+        size_t rows;
+        int entropyBits;
+        int workers;  // Threads (omp) or ranks (mpi); 1 for seq
+        double bytes; // Bytes the phase reads and writes, for GB/s
+        vector<double> ms;
+    };
+
+    struct SuiteConfig
+    {
+        vector<pair<size_t, size_t>> sizes; // cols, rows
+        vector<int> entropyBits;
+        vector<int> threads;
+        vector<string> engines;
+        int warmup;
+        int reps;
+        string csvPath;
+        string jsonPath;
+    };
+
+    // Wall time of each of reps calls in milliseconds, after warmup untimed calls
+    template <typename Func>
+    vector<double> timeReps(int warmup, int reps, Func &&func)
+    {
+        for (int w = 0; w < warmup; w++)
+            func();
+        vector<double> ms;
+        ms.reserve(reps);
+        for (int r = 0; r < reps; r++)
+        {
+            auto start = chrono::high_resolution_clock::now();
+            func();
+            auto end = chrono::high_resolution_clock::now();
+            ms.push_back(chrono::duration<double, milli>(end - start).count());
+        }
+        return ms;
+    }
+
+    // Pixels drawn uniformly from 2^bits evenly spaced grey levels, so the image carries bits bits
+    // of entropy per pixel (0: a constant image)
+    void fillEntropy(ImageType &image, int bits, unsigned seed)
+    {
+        mt19937 gen(seed);
+        int levels = 1 << bits;
+        uniform_int_distribution<int> dist(0, levels - 1);
+        uint8_t *data = image.getData();
+        for (size_t i = 0; i < image.rows() * image.cols(); i++)
+            data[i] = levels == 1 ? 128 : static_cast<uint8_t>(dist(gen) * 255 / (levels - 1));
+    }
+
+    // The sequential engine's phases: the shared kernels on one thread
+    void suiteSeq(const ImageType &input, int entropyBits, const SuiteConfig &config, vector<PhaseResult> &results)
+    {
+        typedef HistogramKernels<uint8_t, HIST_SIZE> Kernels;
+        size_t rows = input.rows(), cols = input.cols(), total = rows * cols;
+        ImageType output(rows, cols);
+        vector<int> hist(HIST_SIZE), histAfter(HIST_SIZE);
+        vector<uint8_t> lut(HIST_SIZE);
+
+        auto record = [&](const string &phase, double bytes, vector<double> ms)
+        { results.push_back(PhaseResult{"seq", phase, cols, rows, entropyBits, 1, bytes, std::move(ms)}); };
+        auto count = [&](const ImageType &image, vector<int> &into)
+        {
+            fill(into.begin(), into.end(), 0);
+            Kernels::count(image.getData(), total, into.data());
+        };
+
+        record("histogram", total, timeReps(config.warmup, config.reps, [&]()
+                                            { count(input, hist); }));
+        record("lut", HIST_SIZE * (sizeof(int) + 1), timeReps(config.warmup, config.reps, [&]()
+                                                              { Kernels::buildLookupTable(hist.data(), total, lut.data()); }));
+        record("remap", 2.0 * total, timeReps(config.warmup, config.reps, [&]()
+                                              { Kernels::apply(input.getData(), output.getData(), total, lut.data()); }));
+        record("post-histogram", HIST_SIZE * (2 * sizeof(int) + 1), timeReps(config.warmup, config.reps, [&]()
+                                                                      { Kernels::remap(hist.data(), lut.data(), histAfter.data()); }));
+        record("post-histogram-rescan", total, timeReps(config.warmup, config.reps, [&]()
+                                                        { count(output, histAfter); }));
+        record("full", 2.0 * total, timeReps(config.warmup, config.reps, [&]()
+                                             {
+            count(input, hist);
+            Kernels::buildLookupTable(hist.data(), total, lut.data());
+            Kernels::apply(input.getData(), output.getData(), total, lut.data());
+            Kernels::remap(hist.data(), lut.data(), histAfter.data()); }));
+    }
+
+    // The OpenMP engine's phases at every thread count; each phase is its own parallel region, and
+    // "full" is the single region omp.cpp runs
+    void suiteOmp(const ImageType &input, int entropyBits, const SuiteConfig &config, vector<PhaseResult> &results)
+    {
+        typedef HistogramKernels<uint8_t, HIST_SIZE> Kernels;
+        size_t rows = input.rows(), cols = input.cols(), total = rows * cols;
+        ImageType output(rows, cols);
+        vector<int> hist(HIST_SIZE), histAfter(HIST_SIZE);
+        vector<uint8_t> lut(HIST_SIZE);
+
+        for (int threads : config.threads)
+        {
+            omp_set_num_threads(threads);
+            OmpEqualizationState<uint8_t, HIST_SIZE> state;
+            auto record = [&](const string &phase, double bytes, vector<double> ms)
+            { results.push_back(PhaseResult{"omp", phase, cols, rows, entropyBits, threads, bytes, std::move(ms)}); };
+
+            record("histogram", total, timeReps(config.warmup, config.reps, [&]()
+                                                {
+#pragma omp parallel
+                ompCountHistogram(input.getData(), total, state, hist.data()); }));
+            record("lut", HIST_SIZE * (sizeof(int) + 1), timeReps(config.warmup, config.reps, [&]()
+                                                                  {
+#pragma omp parallel
+                ompBuildLookupTable(hist.data(), total, state, lut.data()); }));
+            record("remap", 2.0 * total, timeReps(config.warmup, config.reps, [&]()
+                                                  {
+#pragma omp parallel
+                ompApplyLookupTable<uint8_t, HIST_SIZE>(input, output, lut.data()); }));
+            record("post-histogram", HIST_SIZE * (2 * sizeof(int) + 1), timeReps(config.warmup, config.reps, [&]()
+                                                                          { Kernels::remap(hist.data(), lut.data(), histAfter.data()); }));
+            record("post-histogram-rescan", total, timeReps(config.warmup, config.reps, [&]()
+                                                            {
+#pragma omp parallel
+                ompCountHistogram(output.getData(), total, state, histAfter.data()); }));
+            record("full", 2.0 * total, timeReps(config.warmup, config.reps, [&]()
+                                                 {
+#pragma omp parallel
+                {
+                    ompCountHistogram(input.getData(), total, state, hist.data());
+                    ompBuildLookupTable(hist.data(), total, state, lut.data());
+#pragma omp single nowait
+                    Kernels::remap(hist.data(), lut.data(), histAfter.data());
+                    ompApplyLookupTable<uint8_t, HIST_SIZE>(input, output, lut.data());
+                } }));
+        }
+    }
+
+#ifdef BENCH_MPI
+    // The MPI engine's phases (scatter, count, reduce, LUT on rank 0, LUT broadcast, remap, gather)
+    // on MPI_COMM_WORLD. Every repetition starts on a barrier and keeps the slowest rank's time of
+    // each phase. input only needs to be filled on rank 0.
+    void suiteMpi(const ImageType &input, size_t rows, size_t cols, int entropyBits, const SuiteConfig &config, vector<PhaseResult> &results)
+    {
+        typedef HistogramKernels<uint8_t, HIST_SIZE> Kernels;
+        const int PHASES = 8;
+        const char *phaseNames[PHASES] = {"scatter", "histogram", "reduce", "lut", "bcast", "remap", "gather", "full"};
+        double total = 1.0 * rows * cols;
+        const double phaseBytes[PHASES] = {total, total, 0, HIST_SIZE * (sizeof(int) + 1.0), HIST_SIZE, 2 * total, total, 2 * total};
+
+        int rank, size;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+        int localRows = static_cast<int>(rows) / size;
+        int remainder = static_cast<int>(rows) % size;
+        int myRows = (rank < remainder) ? localRows + 1 : localRows;
+        vector<int> sendCounts(size), displs(size);
+        int offset = 0;
+        for (int i = 0; i < size; i++)
+        {
+            sendCounts[i] = ((i < remainder) ? localRows + 1 : localRows) * static_cast<int>(cols);
+            displs[i] = offset;
+            offset += sendCounts[i];
+        }
+
+        ImageType localImage(max(myRows, 1), cols), output(rank == 0 ? rows : 0, cols);
+        vector<int> localHist(HIST_SIZE), hist(HIST_SIZE);
+        vector<uint8_t> lut(HIST_SIZE);
+        vector<vector<double>> samples(PHASES);
+        double phaseBytesReduce = HIST_SIZE * sizeof(int) * size;
+
+        for (int r = -config.warmup; r < config.reps; r++)
+        {
+            double ms[PHASES];
+            MPI_Barrier(MPI_COMM_WORLD);
+            double begin = MPI_Wtime(), mark = begin;
+            auto lap = [&](int phase)
+            {
+                double now = MPI_Wtime();
+                ms[phase] = 1000 * (now - mark);
+                mark = now;
+            };
+
+            MPI_Scatterv(input.getData(), sendCounts.data(), displs.data(), MPI_UNSIGNED_CHAR,
+                         localImage.getData(), sendCounts[rank], MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+            lap(0);
+            fill(localHist.begin(), localHist.end(), 0);
+            Kernels::count(localImage.getData(), sendCounts[rank], localHist.data());
+            lap(1);
+            MPI_Reduce(localHist.data(), hist.data(), HIST_SIZE, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+            lap(2);
+            if (rank == 0)
+                Kernels::buildLookupTable(hist.data(), rows * cols, lut.data());
+            lap(3);
+            MPI_Bcast(lut.data(), HIST_SIZE, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+            lap(4);
+            Kernels::apply(localImage.getData(), localImage.getData(), sendCounts[rank], lut.data());
+            lap(5);
+            MPI_Gatherv(localImage.getData(), sendCounts[rank], MPI_UNSIGNED_CHAR,
+                        output.getData(), sendCounts.data(), displs.data(), MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+            lap(6);
+            ms[7] = 1000 * (mark - begin);
+
+            double slowest[PHASES];
+            MPI_Reduce(ms, slowest, PHASES, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+            if (r >= 0 && rank == 0)
+            {
+                for (int p = 0; p < PHASES; p++)
+                    samples[p].push_back(slowest[p]);
+            }
+        }
+
+        if (rank == 0)
+        {
+            for (int p = 0; p < PHASES; p++)
+                results.push_back(PhaseResult{"mpi", phaseNames[p], cols, rows, entropyBits, size, p == 2 ? phaseBytesReduce : phaseBytes[p], samples[p]});
+        }
+    }
+#endif
+
+    void printSuiteResult(const PhaseResult &result, const vector<double> &sorted)
+    {
+        double median = percentile(sorted, 50);
+        cout << "  " << left << setw(5) << result.engine << setw(23) << result.phase << right
+             << setw(12) << (to_string(result.cols) + "x" + to_string(result.rows)) << setw(4) << result.entropyBits
+             << setw(5) << result.workers << fixed << setprecision(3)
+             << setw(11) << sorted.front() << setw(11) << median << setw(11) << percentile(sorted, 95) << setw(11) << percentile(sorted, 99)
+             << setw(9) << setprecision(2) << (median > 0 ? result.bytes / (median * 1e6) : 0) << endl;
+    }
+
+    void writeSuiteCsv(const string &path, const vector<PhaseResult> &results)
+    {
+        ofstream csv(path, ios::trunc);
+        if (!csv)
+        {
+            cerr << "Could not write " << path << endl;
+            return;
+        }
+        csv << "engine,phase,width,height,entropy_bits,workers,reps,min_ms,median_ms,p95_ms,p99_ms,gb_per_s" << endl;
+        for (const PhaseResult &result : results)
+        {
+            vector<double> sorted = result.ms;
+            sort(sorted.begin(), sorted.end());
+            double median = percentile(sorted, 50);
+            csv << result.engine << "," << result.phase << "," << result.cols << "," << result.rows << ","
+                << result.entropyBits << "," << result.workers << "," << sorted.size() << ","
+                << sorted.front() << "," << median << "," << percentile(sorted, 95) << "," << percentile(sorted, 99) << ","
+                << (median > 0 ? result.bytes / (median * 1e6) : 0) << endl;
+        }
+    }
+
+    void writeSuiteJson(const string &path, const vector<PhaseResult> &results)
+    {
+        ofstream json(path, ios::trunc);
+        if (!json)
+        {
+            cerr << "Could not write " << path << endl;
+            return;
+        }
+        json << "{\n  \"simd\": \"" << simdLevelName(detectSimdLevel()) << "\",\n  \"results\": [";
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const PhaseResult &result = results[i];
+            vector<double> sorted = result.ms;
+            sort(sorted.begin(), sorted.end());
+            double median = percentile(sorted, 50);
+            json << (i ? "," : "") << "\n    {\"engine\": \"" << result.engine << "\", \"phase\": \"" << result.phase
+                 << "\", \"width\": " << result.cols << ", \"height\": " << result.rows
+                 << ", \"entropy_bits\": " << result.entropyBits << ", \"workers\": " << result.workers
+                 << ", \"reps\": " << sorted.size() << ", \"min_ms\": " << sorted.front() << ", \"median_ms\": " << median
+                 << ", \"p95_ms\": " << percentile(sorted, 95) << ", \"p99_ms\": " << percentile(sorted, 99)
+                 << ", \"gb_per_s\": " << (median > 0 ? result.bytes / (median * 1e6) : 0) << "}";
+        }
+        json << "\n  ]\n}" << endl;
+    }
+
+    // Every engine, phase, size, entropy and thread count of config; rank 0 prints and writes the results
+    void runSuite(const SuiteConfig &config, int rank)
+    {
+        vector<PhaseResult> results;
+        auto runs = [&](const string &engine)
+        { return find(config.engines.begin(), config.engines.end(), engine) != config.engines.end(); };
+
+        for (const pair<size_t, size_t> &size : config.sizes)
+        {
+            for (int bits : config.entropyBits)
+            {
+                ImageType image(rank == 0 ? size.second : 0, size.first);
+                if (rank == 0)
+                {
+                    fillEntropy(image, bits, 42);
+                    if (runs("seq"))
+                        suiteSeq(image, bits, config, results);
+                    if (runs("omp"))
+                        suiteOmp(image, bits, config, results);
+                }
+#ifdef BENCH_MPI
+                if (runs("mpi"))
+                    suiteMpi(image, size.second, size.first, bits, config, results);
+#endif
+            }
+        }
+        if (rank != 0)
+            return;
+
+        cout << "\n=== Phase suite (" << config.warmup << " warm-up, " << config.reps << " timed reps; H: entropy bits, W: threads or ranks) ===" << endl;
+        cout << "  " << left << setw(5) << "eng" << setw(23) << "phase" << right << setw(12) << "size" << setw(4) << "H" << setw(5) << "W"
+             << setw(11) << "min ms" << setw(11) << "median" << setw(11) << "p95" << setw(11) << "p99" << setw(9) << "GB/s" << endl;
+        for (const PhaseResult &result : results)
+        {
+            vector<double> sorted = result.ms;
+            sort(sorted.begin(), sorted.end());
+            printSuiteResult(result, sorted);
+        }
+
+        if (!config.csvPath.empty())
+            writeSuiteCsv(config.csvPath, results);
+        if (!config.jsonPath.empty())
+            writeSuiteJson(config.jsonPath, results);
+    }
+
+}
+
+int main(int argc, char **argv)
+{
+    int rank = 0;
+#ifdef BENCH_MPI
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+#endif
+
+    size_t cols = DEFAULT_BENCH_WIDTH, rows = DEFAULT_BENCH_HEIGHT;
+    int reps = DEFAULT_BENCH_REPS;
+    bool suite = false;
+    SuiteConfig config;
+    config.entropyBits = {1, 4, 8};
+    config.threads = {1, omp_get_max_threads()};
+#ifdef BENCH_MPI
+    config.engines = {"seq", "omp", "mpi"};
+#else
+    config.engines = {"seq", "omp"};
+#endif
+    config.warmup = DEFAULT_BENCH_WARMUP;
+
+    bool valid = true;
+    for (int i = 1; i < argc && valid; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--size" && i + 1 < argc && parseSize(argv[i + 1], cols, rows))
+            i++;
+        else if (arg == "--reps" && i + 1 < argc)
+            reps = max(1, atoi(argv[++i]));
+        else if (arg == "--suite")
+            suite = true;
+        else if (arg == "--sizes" && i + 1 < argc)
+        {
+            for (const string &item : splitList(argv[++i]))
+            {
+                size_t w, h;
+                valid = valid && parseSize(item, w, h);
+                config.sizes.push_back({w, h});
+            }
+        }
+        else if (arg == "--entropy" && i + 1 < argc)
+        {
+            config.entropyBits.clear();
+            for (const string &item : splitList(argv[++i]))
+            {
+                config.entropyBits.push_back(atoi(item.c_str()));
+                valid = valid && config.entropyBits.back() >= 0 && config.entropyBits.back() <= 8;
+            }
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+        {
+            config.threads.clear();
+            for (const string &item : splitList(argv[++i]))
+            {
+                config.threads.push_back(atoi(item.c_str()));
+                valid = valid && config.threads.back() >= 1;
+            }
+        }
+        else if (arg == "--engines" && i + 1 < argc)
+            config.engines = splitList(argv[++i]);
+        else if (arg == "--warmup" && i + 1 < argc)
+            config.warmup = max(0, atoi(argv[++i]));
+        else if (arg == "--csv" && i + 1 < argc)
+            config.csvPath = argv[++i];
+        else if (arg == "--json" && i + 1 < argc)
+            config.jsonPath = argv[++i];
+        else
+            valid = false;
+    }
+    if (!valid)
+    {
+        if (rank == 0)
+            cout << "Usage: " << argv[0] << " [--size <width>x<height>] [--reps <n>] | --suite [--sizes <w>x<h>,...] [--entropy <bits>,...] [--threads <n>,...] [--engines seq,omp,mpi] [--warmup <n>] [--reps <n>] [--csv <path>] [--json <path>]" << endl;
+#ifdef BENCH_MPI
+        MPI_Finalize();
+#endif
+        return -1;
+    }
+
+    if (rank == 0)
+        cout << "SIMD level: " << simdLevelName(detectSimdLevel()) << endl;
+
+    if (suite)
+    {
+        if (config.sizes.empty())
+            config.sizes.push_back({cols, rows});
+        config.reps = reps;
+        runSuite(config, rank);
+    }
+    else if (rank == 0)
+    {
+        benchHistogram(rows, cols, reps);
+        benchSampling(rows, cols, reps);
+        benchLookupTable(rows, cols, reps);
+        benchClahe(rows, cols, reps);
+        benchDeltaUpdate(rows, cols, reps);
+        benchTiles(reps);
+        benchIngestEgress(reps);
+        benchOutputs(reps);
+    }
+
+#ifdef BENCH_MPI
+    MPI_Finalize();
+#endif
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include "clahe.hpp"
+#include "kernels.hpp"
+
+void fitClaheParams(ClaheParams &params, size_t rows, size_t cols)
+{
+    params.tilesX = static_cast<int>(min<size_t>(max(params.tilesX, 1), max<size_t>(cols, 1)));
+    params.tilesY = static_cast<int>(min<size_t>(max(params.tilesY, 1), max<size_t>(rows, 1)));
+}
+
+void buildClaheAxis(size_t length, int tiles, ClaheAxis &axis)
+{
+    axis.lo.assign(length, 0);
+    axis.hi.assign(length, 0);
+    axis.weight.assign(length, 0);
+    axis.segments.clear();
+
+    // Tile centers, between which coordinates are blended
+    vector<double> centers(tiles);
+    for (int t = 0; t < tiles; t++)
+        centers[t] = (claheTileBegin(length, tiles, t) + claheTileBegin(length, tiles, t + 1) - 1) / 2.0;
+
+    int t = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        while (i >= claheTileBegin(length, tiles, t + 1))
+            t++;
+
+        int lo = i < centers[t] ? t - 1 : t;
+        int hi = lo + 1;
+        if (lo < 0 || hi >= tiles)
+        {
+            // Before the first or past the last center only one tile applies
+            axis.lo[i] = axis.hi[i] = lo < 0 ? 0 : tiles - 1;
+            axis.weight[i] = 0;
+        }
+        else
+        {
+            axis.lo[i] = lo;
+            axis.hi[i] = hi;
+            axis.weight[i] = static_cast<uint16_t>(cvRound((i - centers[lo]) / (centers[hi] - centers[lo]) * 256));
+        }
+
+        if (axis.segments.empty() || axis.segments.back().lo != axis.lo[i] || axis.segments.back().hi != axis.hi[i])
+            axis.segments.push_back({i, i + 1, axis.lo[i], axis.hi[i]});
+        else
+            axis.segments.back().end = i + 1;
+    }
+}
+
+void computeClaheTileLookupTable(const ImageType &image, size_t rowBegin, size_t rowEnd, size_t colBegin, size_t colEnd,
+                                 double clipLimit, uint8_t *lut)
+{
+    int hist[HIST_SIZE] = {0};
+    for (size_t i = rowBegin; i < rowEnd; i++)
+        computeHistogram(&image.at(i, colBegin), colEnd - colBegin, hist);
+
+    size_t area = (rowEnd - rowBegin) * (colEnd - colBegin);
+
+    // Clip every bin at the limit and spread the excess evenly over all bins
+    if (clipLimit > 0)
+    {
+        int clip = max(1, static_cast<int>(clipLimit * area / HIST_SIZE));
+        int clipped = 0;
+        for (int i = 0; i < HIST_SIZE; i++)
+        {
+            if (hist[i] > clip)
+            {
+                clipped += hist[i] - clip;
+                hist[i] = clip;
+            }
+        }
+
+        int redistBatch = clipped / HIST_SIZE;
+        int residual = clipped - redistBatch * HIST_SIZE;
+        for (int i = 0; i < HIST_SIZE; i++)
+            hist[i] += redistBatch;
+
+        if (residual > 0)
+        {
+            int step = max(HIST_SIZE / residual, 1);
+            for (int i = 0; i < HIST_SIZE && residual > 0; i += step, residual--)
+                hist[i]++;
+        }
+    }
+
+    // Cumulative Distribution Function scaled to the output range
+    float lutScale = 255.0f / area;
+    int sum = 0;
+    for (int i = 0; i < HIST_SIZE; i++)
+    {
+        sum += hist[i];
+        lut[i] = static_cast<uint8_t>(min(255, cvRound(sum * lutScale)));
+    }
+}
+
+void computeClaheTile(const ImageType &image, size_t rowOffset, size_t imageRows, const ClaheParams &params,
+                      int tileRow, int tileCol, vector<uint8_t> &luts)
+{
+    size_t rowBegin = claheTileBegin(imageRows, params.tilesY, tileRow) - rowOffset;
+    size_t rowEnd = claheTileBegin(imageRows, params.tilesY, tileRow + 1) - rowOffset;
+    size_t colBegin = claheTileBegin(image.cols(), params.tilesX, tileCol);
+    size_t colEnd = claheTileBegin(image.cols(), params.tilesX, tileCol + 1);
+
+    uint8_t *lut = &luts[(static_cast<size_t>(tileRow) * params.tilesX + tileCol) * HIST_SIZE];
+    computeClaheTileLookupTable(image, rowBegin, rowEnd, colBegin, colEnd, params.clipLimit, lut);
+}
+
+void interpolateClaheRows(const ImageType &input, ImageType &output, size_t rowBegin, size_t rowEnd,
+                          size_t rowOffset, const ClaheAxis &xAxis, const ClaheAxis &yAxis,
+                          const ClaheParams &params, const vector<uint8_t> &luts)
+{
+    size_t cols = input.cols();
+    size_t tileRowSize = static_cast<size_t>(params.tilesX) * HIST_SIZE;
+
+    // The four corner lookups of a segment go through the SIMD LUT kernel into scratch rows;
+    // the blend below is plain integer arithmetic the compiler vectorizes.
+    vector<uint8_t> scratch(4 * cols);
+    uint8_t *topLo = scratch.data();
+    uint8_t *topHi = topLo + cols;
+    uint8_t *bottomLo = topHi + cols;
+    uint8_t *bottomHi = bottomLo + cols;
+
+    for (size_t i = rowBegin; i < rowEnd; i++)
+    {
+        size_t row = rowOffset + i;
+        const uint8_t *top = &luts[yAxis.lo[row] * tileRowSize];
+        const uint8_t *bottom = &luts[yAxis.hi[row] * tileRowSize];
+        uint32_t wy = yAxis.weight[row];
+        const uint8_t *src = &input.at(i, 0);
+        uint8_t *dst = &output.at(i, 0);
+
+        for (const ClaheAxis::Segment &segment : xAxis.segments)
+        {
+            size_t begin = segment.begin;
+            size_t count = segment.end - segment.begin;
+            applyLookupTable(src + begin, topLo + begin, count, top + segment.lo * HIST_SIZE);
+            applyLookupTable(src + begin, topHi + begin, count, top + segment.hi * HIST_SIZE);
+            applyLookupTable(src + begin, bottomLo + begin, count, bottom + segment.lo * HIST_SIZE);
+            applyLookupTable(src + begin, bottomHi + begin, count, bottom + segment.hi * HIST_SIZE);
+        }
+
+        const uint16_t *weightX = xAxis.weight.data();
+        for (size_t j = 0; j < cols; j++)
+        {
+            uint32_t wx = weightX[j];
+            uint32_t upper = topLo[j] * (256 - wx) + topHi[j] * wx;
+            uint32_t lower = bottomLo[j] * (256 - wx) + bottomHi[j] * wx;
+            dst[j] = static_cast<uint8_t>((upper * (256 - wy) + lower * wy + 32768) >> 16);
+        }
+    }
+}
@@ -0,0 +1,56 @@
+#include "utils.hpp"
+
+#ifndef CLAHE_HPP
+#define CLAHE_HPP
+
+struct ClaheParams
+{
+  int tilesX = CLAHE_DEFAULT_TILES;
+  int tilesY = CLAHE_DEFAULT_TILES;
+  // Histogram bins are clipped at clipLimit times the tile's mean bin height (OpenCV semantics)
+  double clipLimit = CLAHE_DEFAULT_CLIP_LIMIT;
+};
+
+// Tile t of an axis of the given length split into tiles parts covers [claheTileBegin(t), claheTileBegin(t + 1))
+inline size_t claheTileBegin(size_t length, int tiles, int t)
+{
+  return length * t / tiles;
+}
+
+// Bilinear blend of the tile LUTs on one axis: coordinate i mixes tiles lo[i] and hi[i]
+// with weight[i]/256 towards hi. Runs of coordinates sharing the same tile pair are stored
+// as segments so the row kernel can process them with the vectorized LUT kernel.
+struct ClaheAxis
+{
+  struct Segment
+  {
+    size_t begin, end;
+    int lo, hi;
+  };
+
+  vector<int> lo, hi;
+  vector<uint16_t> weight;
+  vector<Segment> segments;
+};
+
+// Caps the tile grid at one pixel per tile so no tile is empty
+void fitClaheParams(ClaheParams &params, size_t rows, size_t cols);
+
+void buildClaheAxis(size_t length, int tiles, ClaheAxis &axis);
+
+// Clipped-histogram LUT (256 entries) of image rows [rowBegin, rowEnd) x cols [colBegin, colEnd)
+void computeClaheTileLookupTable(const ImageType &image, size_t rowBegin, size_t rowEnd, size_t colBegin, size_t colEnd,
+                                 double clipLimit, uint8_t *lut);
+
+// Computes the LUT of tile (tileRow, tileCol) into its slot of luts (tilesY * tilesX * 256 entries).
+// image holds the global rows starting at rowOffset of an image imageRows tall.
+void computeClaheTile(const ImageType &image, size_t rowOffset, size_t imageRows, const ClaheParams &params,
+                      int tileRow, int tileCol, vector<uint8_t> &luts);
+
+// Interpolates local rows [rowBegin, rowEnd) of input into output. input/output hold global rows
+// starting at rowOffset; luts must contain every tile row those rows blend between.
+void interpolateClaheRows(const ImageType &input, ImageType &output, size_t rowBegin, size_t rowEnd,
+                          size_t rowOffset, const ClaheAxis &xAxis, const ClaheAxis &yAxis,
+                          const ClaheParams &params, const vector<uint8_t> &luts);
+
+#endif
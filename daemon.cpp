@@ -0,0 +1,436 @@
+#include "daemon.hpp"
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+    volatile sig_atomic_t stopRequested = 0;
+
+    void onStopSignal(int)
+    {
+        stopRequested = 1;
+    }
+
+    size_t alignUp(size_t bytes)
+    {
+        return (bytes + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+    }
+
+    sockaddr_un socketAddress(const string &path)
+    {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(address.sun_path))
+            throw runtime_error("Invalid socket path: " + path);
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return address;
+    }
+
+    // Sends the size bytes of data, with fd attached (SCM_RIGHTS) unless it is -1
+    bool sendMessage(int socket, const void *data, size_t size, int fd = -1)
+    {
+        const char *bytes = static_cast<const char *>(data);
+        while (size > 0)
+        {
+            iovec part{const_cast<char *>(bytes), size};
+            msghdr message{};
+            message.msg_iov = &part;
+            message.msg_iovlen = 1;
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+            if (fd >= 0)
+            {
+                message.msg_control = control;
+                message.msg_controllen = sizeof(control);
+                cmsghdr *header = CMSG_FIRSTHDR(&message);
+                header->cmsg_level = SOL_SOCKET;
+                header->cmsg_type = SCM_RIGHTS;
+                header->cmsg_len = CMSG_LEN(sizeof(int));
+                memcpy(CMSG_DATA(header), &fd, sizeof(int));
+            }
+            ssize_t sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent <= 0)
+                return false;
+            bytes += sent;
+            size -= sent;
+            fd = -1; // It went with the first byte
+        }
+        return true;
+    }
+
+    // Receives exactly size bytes into data; a descriptor passed with them goes to fd (-1 if none).
+    // False if the peer closed the connection or it failed.
+    bool receiveMessage(int socket, void *data, size_t size, int &fd)
+    {
+        char *bytes = static_cast<char *>(data);
+        fd = -1;
+        while (size > 0)
+        {
+            iovec part{bytes, size};
+            msghdr message{};
+            message.msg_iov = &part;
+            message.msg_iovlen = 1;
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            ssize_t received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+            if (received < 0 && errno == EINTR)
+                continue;
+            for (cmsghdr *header = received > 0 ? CMSG_FIRSTHDR(&message) : nullptr; header != nullptr; header = CMSG_NXTHDR(&message, header))
+            {
+                if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+                    continue;
+                int passed;
+                memcpy(&passed, CMSG_DATA(header), sizeof(int));
+                if (fd < 0)
+                    fd = passed;
+                else
+                    close(passed);
+            }
+            if (received <= 0)
+                return false;
+            bytes += received;
+            size -= received;
+        }
+        return true;
+    }
+
+    double elapsedMs(chrono::steady_clock::time_point start)
+    {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+}
+
+DaemonFrameLayout::DaemonFrameLayout(size_t pixels)
+{
+    inputOffset = 0;
+    outputOffset = alignUp(pixels);
+    histBeforeOffset = outputOffset + alignUp(pixels);
+    histAfterOffset = histBeforeOffset + alignUp(HIST_SIZE * sizeof(int));
+    bytes = histAfterOffset + alignUp(HIST_SIZE * sizeof(int));
+}
+
+DaemonServer::DaemonServer(const string &socketPath, HisteqTuner *tuner, const HisteqPlan &plan)
+    : socketPath(socketPath), listenFd(-1), tuner(tuner), plan(plan), histBefore(HIST_SIZE), histAfter(HIST_SIZE), served(0), maxServiceMs(0)
+{
+    sockaddr_un address = socketAddress(socketPath);
+
+    // A socket file nobody accepts on is left over from a server that died; a live one is not ours
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool live = probe >= 0 && connect(probe, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0;
+    if (probe >= 0)
+        close(probe);
+    if (live)
+        throw runtime_error("A server is already listening on " + socketPath);
+    unlink(socketPath.c_str());
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listenFd, DAEMON_MAX_CLIENTS) != 0)
+    {
+        string reason = strerror(errno);
+        if (listenFd >= 0)
+            close(listenFd);
+        throw runtime_error("Cannot listen on " + socketPath + ": " + reason);
+    }
+}
+
+DaemonServer::~DaemonServer()
+{
+    while (!connections.empty())
+        closeConnection(connections.size() - 1);
+    close(listenFd);
+    unlink(socketPath.c_str());
+}
+
+void DaemonServer::closeConnection(size_t index)
+{
+    Connection &connection = connections[index];
+    if (connection.segment != nullptr)
+        munmap(connection.segment, connection.bytes);
+    close(connection.fd);
+    connections.erase(connections.begin() + index);
+}
+
+void DaemonServer::serve()
+{
+    // No SA_RESTART, so the signal interrupts poll
+    struct sigaction action{};
+    action.sa_handler = onStopSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    stopRequested = 0;
+
+    vector<pollfd> fds;
+    bool shutdown = false;
+    while (!shutdown && !stopRequested)
+    {
+        // Past DAEMON_MAX_CLIENTS new connections wait in the backlog until one closes
+        fds.assign(1, pollfd{listenFd, static_cast<short>(connections.size() < DAEMON_MAX_CLIENTS ? POLLIN : 0), 0});
+        for (const Connection &connection : connections)
+            fds.push_back(pollfd{connection.fd, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw runtime_error(string("poll failed: ") + strerror(errno));
+        }
+
+        // One request per ready connection per round, so a busy client cannot starve the others.
+        // Backwards, so closing a connection does not shift the ones still to visit.
+        for (size_t i = connections.size(); i-- > 0 && !shutdown;)
+        {
+            if ((fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) && !handle(i, shutdown))
+                closeConnection(i);
+        }
+        if ((fds[0].revents & POLLIN) && !shutdown)
+        {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0)
+                connections.push_back(Connection{fd, nullptr, 0});
+        }
+    }
+}
+
+bool DaemonServer::handle(size_t index, bool &shutdown)
+{
+    Connection &connection = connections[index];
+    DaemonRequest request;
+    int passedFd;
+    if (!receiveMessage(connection.fd, &request, sizeof(request), passedFd))
+    {
+        if (passedFd >= 0)
+            close(passedFd);
+        return false;
+    }
+    auto start = chrono::steady_clock::now();
+
+    DaemonReply reply{DAEMON_OK, 0, 0, 0, 0};
+    switch (request.op)
+    {
+    case DAEMON_ATTACH:
+    {
+        // The segment must really be as large as claimed, and sealed so it stays that large, or a
+        // client truncating it later would make the server's next access to its end raise SIGBUS
+        int seals = passedFd >= 0 ? fcntl(passedFd, F_GET_SEALS) : -1;
+        bool sealed = seals >= 0 && (seals & F_SEAL_SHRINK) != 0;
+        struct stat info;
+        void *mapped = MAP_FAILED;
+        if (sealed && request.bytes > 0 && fstat(passedFd, &info) == 0 && static_cast<uint64_t>(info.st_size) >= request.bytes)
+            mapped = mmap(nullptr, request.bytes, PROT_READ | PROT_WRITE, MAP_SHARED, passedFd, 0);
+        if (mapped == MAP_FAILED)
+        {
+            reply.status = sealed ? DAEMON_NO_SEGMENT : DAEMON_BAD_REQUEST;
+            break;
+        }
+        if (connection.segment != nullptr)
+            munmap(connection.segment, connection.bytes);
+        connection.segment = static_cast<uint8_t *>(mapped);
+        connection.bytes = request.bytes;
+        break;
+    }
+    case DAEMON_EQUALIZE:
+        reply = equalize(connection, request);
+        break;
+    case DAEMON_SHUTDOWN:
+        shutdown = true;
+        break;
+    default:
+        reply.status = DAEMON_BAD_REQUEST;
+        break;
+    }
+    // The mapping keeps the segment alive on its own
+    if (passedFd >= 0)
+        close(passedFd);
+
+    reply.serviceMs = elapsedMs(start);
+    if (request.op == DAEMON_EQUALIZE && reply.status == DAEMON_OK)
+    {
+        if (serviceTimes.size() < DAEMON_LATENCY_WINDOW)
+            serviceTimes.push_back(reply.serviceMs);
+        else
+            serviceTimes[served % DAEMON_LATENCY_WINDOW] = reply.serviceMs;
+        served++;
+        maxServiceMs = max(maxServiceMs, reply.serviceMs);
+    }
+    return sendMessage(connection.fd, &reply, sizeof(reply));
+}
+
+DaemonReply DaemonServer::equalize(Connection &connection, const DaemonRequest &request)
+{
+    DaemonReply reply{DAEMON_OK, 0, 0, 0, 0};
+    size_t pixels = static_cast<size_t>(request.rows) * request.cols;
+    DaemonFrameLayout layout(pixels);
+    if (request.rows > INT_MAX || request.cols > INT_MAX || pixels == 0)
+    {
+        reply.status = DAEMON_BAD_REQUEST;
+        return reply;
+    }
+    if (connection.segment == nullptr || layout.bytes > connection.bytes)
+    {
+        reply.status = DAEMON_NO_SEGMENT;
+        return reply;
+    }
+
+    try
+    {
+        // Views of the segment: the kernels read the client's frame and write its output in place
+        int rows = static_cast<int>(request.rows), cols = static_cast<int>(request.cols);
+        ImageType input(Mat(rows, cols, CV_8UC1, connection.segment + layout.inputOffset));
+        ImageType output(Mat(rows, cols, CV_8UC1, connection.segment + layout.outputOffset));
+        HisteqPlan current = tuner != nullptr ? tuner->plan(request.rows, request.cols) : plan;
+        histeqEqualize(input, output, histBefore, histAfter, current);
+        memcpy(connection.segment + layout.histBeforeOffset, histBefore.data(), HIST_SIZE * sizeof(int));
+        memcpy(connection.segment + layout.histAfterOffset, histAfter.data(), HIST_SIZE * sizeof(int));
+        reply.backend = current.backend;
+        reply.threads = current.threads;
+    }
+    catch (const exception &error)
+    {
+        cerr << "Request of " << request.cols << "x" << request.rows << " failed: " << error.what() << endl;
+        reply.status = DAEMON_FAILED;
+    }
+    return reply;
+}
+
+void DaemonServer::printStats() const
+{
+    vector<double> sorted(serviceTimes);
+    sort(sorted.begin(), sorted.end());
+    cout << "Served " << served << " request(s)";
+    if (!sorted.empty())
+    {
+        cout << ": service time " << fixed << setprecision(3) << percentile(sorted, 50) << " ms p50, "
+             << percentile(sorted, 99) << " ms p99";
+        if (served > sorted.size())
+            cout << " (last " << sorted.size() << ")";
+        cout << ", " << maxServiceMs << " ms max";
+    }
+    cout << endl;
+}
+
+DaemonClient::DaemonClient(const string &socketPath) : fd(-1), segmentFd(-1), segment(nullptr), bytes(0)
+{
+    sockaddr_un address = socketAddress(socketPath);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        string reason = strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        throw runtime_error("Cannot connect to " + socketPath + ": " + reason + " (is histeqd.out running?)");
+    }
+}
+
+DaemonClient::~DaemonClient()
+{
+    if (segment != nullptr)
+        munmap(segment, bytes);
+    if (segmentFd >= 0)
+        close(segmentFd);
+    close(fd);
+}
+
+DaemonReply DaemonClient::call(const DaemonRequest &request, int passFd)
+{
+    DaemonReply reply;
+    int passedFd;
+    if (!sendMessage(fd, &request, sizeof(request), passFd) || !receiveMessage(fd, &reply, sizeof(reply), passedFd))
+        throw runtime_error("Lost the connection to the server");
+    if (passedFd >= 0)
+        close(passedFd);
+    return reply;
+}
+
+void DaemonClient::grow(size_t needed)
+{
+    // Anonymous memory file: nothing to name or clean up, and it is gone once both sides unmap it.
+    // Doubling keeps a client whose frames grow from re-attaching on every one. The server only maps
+    // a segment sealed against shrinking.
+    size_t size = max(needed, 2 * bytes);
+    int newFd = memfd_create("histeqd-frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (newFd < 0 || ftruncate(newFd, size) != 0 || fcntl(newFd, F_ADD_SEALS, F_SEAL_SHRINK) != 0)
+    {
+        string reason = strerror(errno);
+        if (newFd >= 0)
+            close(newFd);
+        throw runtime_error("Cannot create a shared frame of " + to_string(size) + " bytes: " + reason);
+    }
+    void *mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, newFd, 0);
+    if (mapped == MAP_FAILED)
+    {
+        close(newFd);
+        throw runtime_error("Cannot map a shared frame of " + to_string(size) + " bytes");
+    }
+    if (segment != nullptr)
+        munmap(segment, bytes);
+    if (segmentFd >= 0)
+        close(segmentFd);
+    segment = static_cast<uint8_t *>(mapped);
+    segmentFd = newFd;
+    bytes = size;
+
+    DaemonReply reply = call(DaemonRequest{DAEMON_ATTACH, 0, 0, 0, size}, segmentFd);
+    if (reply.status != DAEMON_OK)
+        throw runtime_error("The server refused the shared frame (status " + to_string(reply.status) + ")");
+}
+
+uint8_t *DaemonClient::input(size_t rows, size_t cols)
+{
+    DaemonFrameLayout layout(rows * cols);
+    if (layout.bytes > bytes)
+        grow(layout.bytes);
+    return segment + layout.inputOffset;
+}
+
+DaemonReply DaemonClient::equalize(size_t rows, size_t cols)
+{
+    if (rows > UINT32_MAX || cols > UINT32_MAX || DaemonFrameLayout(rows * cols).bytes > bytes)
+        throw runtime_error("Frame of " + to_string(cols) + "x" + to_string(rows) + " was not written with input()");
+    DaemonReply reply = call(DaemonRequest{DAEMON_EQUALIZE, static_cast<uint32_t>(rows), static_cast<uint32_t>(cols), 0, 0});
+    if (reply.status != DAEMON_OK)
+        throw runtime_error("The server failed to equalize a " + to_string(cols) + "x" + to_string(rows) + " frame (status " + to_string(reply.status) + ")");
+    return reply;
+}
+
+const uint8_t *DaemonClient::output(size_t rows, size_t cols) const
+{
+    return segment + DaemonFrameLayout(rows * cols).outputOffset;
+}
+
+const int *DaemonClient::histBefore(size_t rows, size_t cols) const
+{
+    return reinterpret_cast<const int *>(segment + DaemonFrameLayout(rows * cols).histBeforeOffset);
+}
+
+const int *DaemonClient::histAfter(size_t rows, size_t cols) const
+{
+    return reinterpret_cast<const int *>(segment + DaemonFrameLayout(rows * cols).histAfterOffset);
+}
+
+DaemonReply DaemonClient::equalize(const ImageType &image, ImageType &output, vector<int> &histBefore, vector<int> &histAfter)
+{
+    size_t rows = image.rows(), cols = image.cols(), pixels = rows * cols;
+    if (image.channels() != 1)
+        throw runtime_error("The server equalizes grayscale frames only");
+    memcpy(input(rows, cols), image.getData(), pixels);
+    DaemonReply reply = equalize(rows, cols);
+    output.resize(rows, cols);
+    memcpy(output.getData(), this->output(rows, cols), pixels);
+    histBefore.assign(this->histBefore(rows, cols), this->histBefore(rows, cols) + HIST_SIZE);
+    histAfter.assign(this->histAfter(rows, cols), this->histAfter(rows, cols) + HIST_SIZE);
+    return reply;
+}
+
+void DaemonClient::shutdownServer()
+{
+    call(DaemonRequest{DAEMON_SHUTDOWN, 0, 0, 0, 0});
+}
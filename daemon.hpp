@@ -0,0 +1,159 @@
+#include "utils.hpp"
+#include "histeq.hpp"
+#include <climits>
+#include <cstdint>
+
+#ifndef DAEMON_HPP
+#define DAEMON_HPP
+
+// Where histeqd.out listens unless --socket says otherwise
+#define DAEMON_DEFAULT_SOCKET "/tmp/histeqd.sock"
+
+// Connections served at once; more wait in the listen backlog
+#define DAEMON_MAX_CLIENTS 64
+
+// Service times kept for the percentiles printed on exit: the most recent ones, so a server that
+// stays up for weeks does not grow with every request
+#define DAEMON_LATENCY_WINDOW 65536
+
+// Control messages on the socket. A client first attaches a shared-memory segment (its file
+// descriptor travels with the message as SCM_RIGHTS), then writes frames into it and asks for them
+// to be equalized; pixels and histograms never go through the socket. The segment must be a memfd
+// sealed with F_SEAL_SHRINK, so the client cannot truncate it under the server's mapping.
+enum DaemonOp : uint32_t
+{
+  DAEMON_ATTACH = 1,   // Map the segment of bytes bytes passed with this message, replacing the previous one
+  DAEMON_EQUALIZE = 2, // Equalize the rows x cols frame at the input of the segment
+  DAEMON_SHUTDOWN = 3  // Stop the server once the reply is sent
+};
+
+enum DaemonStatus : int32_t
+{
+  DAEMON_OK = 0,
+  DAEMON_BAD_REQUEST = 1, // Unknown op, or no segment sealed against shrinking passed with DAEMON_ATTACH
+  DAEMON_NO_SEGMENT = 2,  // The frame does not fit the attached segment (or none is attached)
+  DAEMON_FAILED = 3       // The equalization threw
+};
+
+struct DaemonRequest
+{
+  uint32_t op;
+  uint32_t rows;
+  uint32_t cols;
+  uint32_t reserved;
+  uint64_t bytes; // Segment size of DAEMON_ATTACH
+};
+
+struct DaemonReply
+{
+  int32_t status;
+  uint32_t backend; // HisteqBackend of the plan that ran
+  uint32_t threads; // and its OpenMP threads
+  uint32_t reserved;
+  double serviceMs; // From the request arriving to the reply being sent, as the server saw it
+};
+
+// Where the parts of a frame of pixels pixels live in a segment: the input, the equalized output,
+// then histBefore and histAfter (HIST_SIZE ints each), each at an IMAGE_ALIGNMENT boundary so the
+// SIMD kernels run on them as on any ImageType
+struct DaemonFrameLayout
+{
+  size_t inputOffset;
+  size_t outputOffset;
+  size_t histBeforeOffset;
+  size_t histAfterOffset;
+  size_t bytes; // Segment size it needs
+
+  explicit DaemonFrameLayout(size_t pixels);
+};
+
+// Resident equalizer behind a Unix domain socket. One thread serves every connection with poll(),
+// one request at a time, so each request gets the whole (already warm) OpenMP pool of the process
+// and the tuner's plan for its size. Segments stay mapped for the life of their connection.
+class DaemonServer
+{
+private:
+  struct Connection
+  {
+    int fd;
+    uint8_t *segment;
+    size_t bytes;
+  };
+
+  string socketPath;
+  int listenFd;
+  HisteqTuner *tuner; // Plans per size, or null to always run plan
+  HisteqPlan plan;
+  vector<Connection> connections;
+  vector<int> histBefore, histAfter;
+  vector<double> serviceTimes; // ms of the last DAEMON_LATENCY_WINDOW DAEMON_EQUALIZE requests, as a ring
+  size_t served;               // DAEMON_EQUALIZE requests answered
+  double maxServiceMs;
+
+  void closeConnection(size_t index);
+
+  // Reads and answers one request of connection index (shutdown is set by DAEMON_SHUTDOWN); false
+  // once the connection is closed or broken
+  bool handle(size_t index, bool &shutdown);
+
+  DaemonReply equalize(Connection &connection, const DaemonRequest &request);
+
+public:
+  // Listens on socketPath, replacing a stale socket file but not a live server (throws runtime_error)
+  DaemonServer(const string &socketPath, HisteqTuner *tuner, const HisteqPlan &plan);
+  ~DaemonServer();
+
+  DaemonServer(const DaemonServer &) = delete;
+  DaemonServer &operator=(const DaemonServer &) = delete;
+
+  // Serves until a client sends DAEMON_SHUTDOWN or SIGINT/SIGTERM arrives
+  void serve();
+
+  // Requests served, the service time percentiles of the most recent ones and the maximum
+  void printStats() const;
+};
+
+// Connection to a DaemonServer with its own shared-memory segment. Write a frame into input(),
+// call equalize(), and read output() and the histograms until the next frame. Not thread safe: use
+// one client per thread.
+class DaemonClient
+{
+private:
+  int fd;
+  int segmentFd;
+  uint8_t *segment;
+  size_t bytes;
+
+  DaemonReply call(const DaemonRequest &request, int passFd = -1);
+
+  // Attaches a new segment of at least needed bytes
+  void grow(size_t needed);
+
+public:
+  // Connects to the server at socketPath (throws runtime_error)
+  explicit DaemonClient(const string &socketPath = DAEMON_DEFAULT_SOCKET);
+  ~DaemonClient();
+
+  DaemonClient(const DaemonClient &) = delete;
+  DaemonClient &operator=(const DaemonClient &) = delete;
+
+  // Where to write the next rows x cols frame (grows the segment first if it is too small)
+  uint8_t *input(size_t rows, size_t cols);
+
+  // Equalizes the rows x cols frame written at input(rows, cols); throws runtime_error unless the
+  // status is DAEMON_OK
+  DaemonReply equalize(size_t rows, size_t cols);
+
+  // Results of the last equalize of a rows x cols frame
+  const uint8_t *output(size_t rows, size_t cols) const;
+  const int *histBefore(size_t rows, size_t cols) const;
+  const int *histAfter(size_t rows, size_t cols) const;
+
+  // Copies image in and the results out; a convenience for callers that hold an ImageType
+  DaemonReply equalize(const ImageType &image, ImageType &output, vector<int> &histBefore, vector<int> &histAfter);
+
+  // Asks the server to stop
+  void shutdownServer();
+};
+
+#endif
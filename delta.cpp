@@ -0,0 +1,109 @@
+#include "delta.hpp"
+#include "kernels.hpp"
+#include <stdexcept>
+
+typedef HistogramKernels<uint8_t, HIST_SIZE> Kernels;
+
+void DeltaEqualizer::countTile(const ImageType &image, size_t t)
+{
+    size_t row = t / tilesX * tileSize, col = t % tilesX * tileSize;
+    size_t rows = min(tileSize, image.rows() - row), cols = min(tileSize, image.cols() - col);
+    int *tileHist = &tileHists[t * HIST_SIZE];
+    memset(tileHist, 0, HIST_SIZE * sizeof(int));
+    for (size_t i = row; i < row + rows; i++)
+        Kernels::count(&image.at(i, col), cols, tileHist);
+}
+
+void DeltaEqualizer::remapTile(const ImageType &image, ImageType &output, size_t t) const
+{
+    size_t row = t / tilesX * tileSize, col = t % tilesX * tileSize;
+    size_t rows = min(tileSize, image.rows() - row), cols = min(tileSize, image.cols() - col);
+    for (size_t i = row; i < row + rows; i++)
+        Kernels::apply(&image.at(i, col), &output.at(i, col), cols, lut.data());
+}
+
+void DeltaEqualizer::reset(const ImageType &image, ImageType &output)
+{
+    if (image.channels() != 1)
+        throw invalid_argument("DeltaEqualizer needs a single-channel image");
+    rows = image.rows();
+    cols = image.cols();
+    tilesX = (image.cols() + tileSize - 1) / tileSize;
+    tilesY = (image.rows() + tileSize - 1) / tileSize;
+    size_t tiles = tilesX * tilesY;
+    tileHists.assign(tiles * HIST_SIZE, 0);
+    hist.assign(HIST_SIZE, 0);
+    lut.assign(HIST_SIZE, 0);
+    newLut.assign(HIST_SIZE, 0);
+    dirtyMarks.assign(tiles, 0);
+    dirtyTiles.clear();
+    dirtyTiles.reserve(tiles);
+
+    for (size_t t = 0; t < tiles; t++)
+    {
+        countTile(image, t);
+        for (int v = 0; v < HIST_SIZE; v++)
+            hist[v] += tileHists[t * HIST_SIZE + v];
+    }
+
+    Kernels::buildLookupTable(hist.data(), image.rows() * image.cols(), lut.data());
+    output.resize(image.rows(), image.cols());
+    Kernels::apply(image.getData(), output.getData(), image.rows() * image.cols(), lut.data());
+}
+
+bool DeltaEqualizer::update(const ImageType &image, const vector<Rect> &dirty, ImageType &output)
+{
+    if (hist.empty())
+        throw invalid_argument("DeltaEqualizer::update called before reset");
+    if (image.rows() != rows || image.cols() != cols || image.channels() != 1 || output.rows() != rows || output.cols() != cols || output.channels() != 1)
+        throw invalid_argument("DeltaEqualizer::update needs the " + to_string(cols) + "x" + to_string(rows) + " image and output of reset");
+
+    // Tiles the rectangles touch, each once
+    dirtyTiles.clear();
+    for (const Rect &rect : dirty)
+    {
+        size_t x0 = static_cast<size_t>(max(rect.x, 0)), y0 = static_cast<size_t>(max(rect.y, 0));
+        size_t x1 = min(image.cols(), static_cast<size_t>(max(rect.x + rect.width, 0)));
+        size_t y1 = min(image.rows(), static_cast<size_t>(max(rect.y + rect.height, 0)));
+        if (x0 >= x1 || y0 >= y1)
+            continue;
+        for (size_t ty = y0 / tileSize; ty <= (y1 - 1) / tileSize; ty++)
+        {
+            for (size_t tx = x0 / tileSize; tx <= (x1 - 1) / tileSize; tx++)
+            {
+                size_t t = ty * tilesX + tx;
+                if (!dirtyMarks[t])
+                {
+                    dirtyMarks[t] = 1;
+                    dirtyTiles.push_back(t);
+                }
+            }
+        }
+    }
+
+    // Swap every dirty tile's old counts in the global histogram for its new ones
+    for (size_t t : dirtyTiles)
+    {
+        int *tileHist = &tileHists[t * HIST_SIZE];
+        for (int v = 0; v < HIST_SIZE; v++)
+            hist[v] -= tileHist[v];
+        countTile(image, t);
+        for (int v = 0; v < HIST_SIZE; v++)
+            hist[v] += tileHist[v];
+        dirtyMarks[t] = 0;
+    }
+
+    Kernels::buildLookupTable(hist.data(), image.rows() * image.cols(), newLut.data());
+    bool lutChanged = memcmp(newLut.data(), lut.data(), HIST_SIZE) != 0;
+    if (lutChanged)
+    {
+        lut.swap(newLut);
+        Kernels::apply(image.getData(), output.getData(), image.rows() * image.cols(), lut.data());
+    }
+    else
+    {
+        for (size_t t : dirtyTiles)
+            remapTile(image, output, t);
+    }
+    return lutChanged;
+}
@@ -0,0 +1,53 @@
+#include "utils.hpp"
+
+#ifndef DELTA_HPP
+#define DELTA_HPP
+
+// Side of the square tiles whose histograms a DeltaEqualizer keeps, in pixels
+#define DELTA_DEFAULT_TILE 64
+
+// Global equalization of an 8-bit grayscale image that is edited in place a few regions at a time,
+// as in an interactive paint or annotation tool. It keeps one histogram per tile, so an update
+// recounts only the tiles the dirty rectangles touch and fixes the global histogram by
+// subtracting their old counts and adding the new ones. If the LUT built from it is unchanged,
+// only those tiles are remapped; otherwise every pixel is. The cost of an edit then follows the
+// edited area, not the image size, unless the edit is large enough to move the LUT.
+class DeltaEqualizer
+{
+private:
+  size_t tileSize;
+  size_t rows; // Size of the image reset saw
+  size_t cols;
+  size_t tilesX;
+  size_t tilesY;
+  vector<int> tileHists; // HIST_SIZE bins per tile, row-major over the tiles
+  vector<int> hist;      // Sum of the tile histograms
+  vector<uint8_t> lut;
+  vector<uint8_t> newLut;
+  vector<char> dirtyMarks; // Per tile, while an update collects its tiles
+  vector<size_t> dirtyTiles;
+
+  // Recounts tile t of image into its histogram
+  void countTile(const ImageType &image, size_t t);
+  // Remaps tile t of image into output through lut
+  void remapTile(const ImageType &image, ImageType &output, size_t t) const;
+
+public:
+  explicit DeltaEqualizer(size_t tileSize = DELTA_DEFAULT_TILE) : tileSize(max<size_t>(tileSize, 1)), rows(0), cols(0), tilesX(0), tilesY(0) {}
+
+  // Full equalization of image into output; builds every tile histogram. Throws invalid_argument
+  // unless image has one channel.
+  void reset(const ImageType &image, ImageType &output);
+
+  // Brings output up to date after the pixels of image inside dirty changed (rectangles are
+  // clipped to the image). Throws invalid_argument before reset, or if image or output is not the
+  // size of the image reset saw, since the tile histograms would no longer cover it. Returns true
+  // if the LUT changed and the whole image was remapped, false if only the dirty tiles were.
+  bool update(const ImageType &image, const vector<Rect> &dirty, ImageType &output);
+
+  // Histogram of the current image, and the LUT output was equalized with
+  const vector<int> &histogram() const { return hist; }
+  const vector<uint8_t> &lookupTable() const { return lut; }
+};
+
+#endif
@@ -0,0 +1,328 @@
+#ifdef HISTEQ_WITH_MPI
+#include <mpi.h>
+#endif
+#include "histeq.hpp"
+#ifdef _OPENMP
+#include "omp_kernels.hpp"
+#endif
+#include <random>
+
+namespace
+{
+    const char *BACKEND_NAMES[HISTEQ_BACKENDS] = {"scalar", "simd", "omp", "mpi"};
+
+    // Rank and size in MPI_COMM_WORLD; 0 and 1 when MPI is not built in or not initialized
+    void mpiWorld(int &rank, int &size)
+    {
+        rank = 0;
+        size = 1;
+#ifdef HISTEQ_WITH_MPI
+        int initialized = 0;
+        MPI_Initialized(&initialized);
+        if (initialized)
+        {
+            MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+            MPI_Comm_size(MPI_COMM_WORLD, &size);
+        }
+#endif
+    }
+
+    // Rank 0's values on every rank
+    void broadcast(long long *values, int count)
+    {
+#ifdef HISTEQ_WITH_MPI
+        int rank, size;
+        mpiWorld(rank, size);
+        if (size > 1)
+            MPI_Bcast(values, count, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+#else
+        (void)values;
+        (void)count;
+#endif
+    }
+
+    int maxThreads()
+    {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    // One thread; level picks the remap kernel
+    void equalizeSingle(const ImageType &input, ImageType &output, int *histBefore, uint8_t *lut, SimdLevel level)
+    {
+        size_t totalPixels = input.rows() * input.cols();
+        computeHistogram(input.getData(), totalPixels, histBefore);
+        buildEqualizationLookupTable(histBefore, totalPixels, lut);
+        applyLookupTable(input.getData(), output.getData(), totalPixels, lut, level);
+    }
+
+#ifdef _OPENMP
+    // The phases of the OpenMP engine in one parallel region of threads threads
+    void equalizeOmp(const ImageType &input, ImageType &output, int *histBefore, uint8_t *lut, int threads)
+    {
+        size_t totalPixels = input.rows() * input.cols();
+        OmpEqualizationState<uint8_t, HIST_SIZE> state;
+#pragma omp parallel num_threads(max(1, min(threads, omp_get_max_threads())))
+        {
+            ompCountHistogram(input.getData(), totalPixels, state, histBefore);
+            ompBuildLookupTable(histBefore, totalPixels, state, lut);
+            ompApplyLookupTable<uint8_t, HIST_SIZE>(input, output, lut);
+        }
+    }
+#endif
+
+#ifdef HISTEQ_WITH_MPI
+    // Rank 0 scatters a stripe of rows per rank; the stripe histograms are summed with an
+    // Allreduce, every rank builds the LUT and remaps its stripe, and rank 0 gathers the stripes
+    void equalizeMpi(const ImageType &input, ImageType &output, int *histBefore, uint8_t *lut, int rank, int size)
+    {
+        long long shape[2] = {static_cast<long long>(input.rows()), static_cast<long long>(input.cols())};
+        broadcast(shape, 2);
+        int rows = static_cast<int>(shape[0]), cols = static_cast<int>(shape[1]);
+
+        vector<int> sendCounts(size), displs(size);
+        int offset = 0;
+        for (int i = 0; i < size; i++)
+        {
+            int stripeRows = rows / size + (i < rows % size ? 1 : 0);
+            sendCounts[i] = stripeRows * cols;
+            displs[i] = offset;
+            offset += sendCounts[i];
+        }
+
+        ImageType stripe(sendCounts[rank] / max(cols, 1), cols);
+        MPI_Scatterv(input.getData(), sendCounts.data(), displs.data(), MPI_UNSIGNED_CHAR,
+                     stripe.getData(), sendCounts[rank], MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+
+        vector<int> localHist(HIST_SIZE, 0);
+        computeHistogram(stripe.getData(), sendCounts[rank], localHist.data());
+        MPI_Allreduce(localHist.data(), histBefore, HIST_SIZE, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+        buildEqualizationLookupTable(histBefore, static_cast<size_t>(rows) * cols, lut);
+        applyLookupTable(stripe.getData(), stripe.getData(), sendCounts[rank], lut);
+
+        MPI_Gatherv(stripe.getData(), sendCounts[rank], MPI_UNSIGNED_CHAR,
+                    output.getData(), sendCounts.data(), displs.data(), MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+    }
+#endif
+}
+
+const char *histeqBackendName(HisteqBackend backend)
+{
+    return backend >= 0 && backend < HISTEQ_BACKENDS ? BACKEND_NAMES[backend] : "unknown";
+}
+
+bool parseHisteqBackend(const string &name, HisteqBackend &backend)
+{
+    for (int b = 0; b < HISTEQ_BACKENDS; b++)
+    {
+        if (name == BACKEND_NAMES[b])
+        {
+            backend = static_cast<HisteqBackend>(b);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool histeqBackendAvailable(HisteqBackend backend)
+{
+    int rank, size;
+    switch (backend)
+    {
+    case HISTEQ_SCALAR:
+    case HISTEQ_SIMD:
+        return true;
+    case HISTEQ_OMP:
+#ifdef _OPENMP
+        return true;
+#else
+        return false;
+#endif
+    case HISTEQ_MPI:
+        mpiWorld(rank, size);
+        return size > 1;
+    default:
+        return false;
+    }
+}
+
+void histeqEqualize(const ImageType &input, ImageType &output, vector<int> &histBefore, vector<int> &histAfter, const HisteqPlan &plan)
+{
+    if (!histeqBackendAvailable(plan.backend))
+        throw runtime_error(string("The ") + histeqBackendName(plan.backend) + " backend is not available in this build or process");
+
+    int rank, size;
+    mpiWorld(rank, size);
+    if (rank != 0 && plan.backend != HISTEQ_MPI)
+        return;
+
+    histBefore.assign(HIST_SIZE, 0);
+    histAfter.assign(HIST_SIZE, 0);
+    vector<uint8_t> eqLookupTable(HIST_SIZE, 0);
+    // An output of the right size is written in place, so it may be a view of the caller's memory
+    if (rank == 0 && (output.rows() != input.rows() || output.cols() != input.cols() || output.channels() != 1))
+        output.resize(input.rows(), input.cols());
+
+    switch (plan.backend)
+    {
+    case HISTEQ_SCALAR:
+        equalizeSingle(input, output, histBefore.data(), eqLookupTable.data(), SIMD_SCALAR);
+        break;
+    case HISTEQ_SIMD:
+        equalizeSingle(input, output, histBefore.data(), eqLookupTable.data(), detectSimdLevel());
+        break;
+#ifdef _OPENMP
+    case HISTEQ_OMP:
+        equalizeOmp(input, output, histBefore.data(), eqLookupTable.data(), plan.threads);
+        break;
+#endif
+#ifdef HISTEQ_WITH_MPI
+    case HISTEQ_MPI:
+        equalizeMpi(input, output, histBefore.data(), eqLookupTable.data(), rank, size);
+        break;
+#endif
+    default:
+        break;
+    }
+
+    // Histogram after equalization follows from the LUT
+    if (rank == 0)
+        remapHistogram(histBefore.data(), eqLookupTable.data(), histAfter.data());
+}
+
+int HisteqTuner::sizeBucket(size_t pixels)
+{
+    int bucket = 0;
+    while (pixels > 1)
+    {
+        pixels >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+string HisteqTuner::hardwareSignature()
+{
+    int rank, size;
+    mpiWorld(rank, size);
+    return string("simd=") + simdLevelName(detectSimdLevel()) + " threads=" + to_string(maxThreads()) + " ranks=" + to_string(size);
+}
+
+void HisteqTuner::load()
+{
+    loaded = true;
+    ifstream cache(cachePath);
+    string line;
+    if (!getline(cache, line) || line != "# " + hardwareSignature())
+        return;
+
+    // One "<bucket> <backend> <threads>" line per measured bucket
+    int bucket, threads;
+    string name;
+    HisteqBackend backend;
+    while (cache >> bucket >> name >> threads)
+    {
+        if (parseHisteqBackend(name, backend) && histeqBackendAvailable(backend) && threads >= 1)
+            plans[bucket] = HisteqPlan{backend, threads};
+    }
+}
+
+void HisteqTuner::save() const
+{
+    ofstream cache(cachePath, ios::trunc);
+    if (!cache)
+    {
+        cerr << "Unable to open file: " << cachePath << endl;
+        return;
+    }
+    cache << "# " << hardwareSignature() << "\n";
+    for (const auto &entry : plans)
+        cache << entry.first << " " << histeqBackendName(entry.second.backend) << " " << entry.second.threads << "\n";
+}
+
+HisteqPlan HisteqTuner::plan(size_t rows, size_t cols, bool retune)
+{
+    int rank, size;
+    mpiWorld(rank, size);
+
+    // Only rank 0 knows the image size and reads the cache: [rows, cols, cached, backend, threads]
+    long long shared[5] = {static_cast<long long>(rows), static_cast<long long>(cols), 0, 0, 0};
+    if (rank == 0)
+    {
+        if (!loaded)
+            load();
+        auto cached = plans.find(sizeBucket(rows * cols));
+        if (!retune && cached != plans.end())
+        {
+            shared[2] = 1;
+            shared[3] = cached->second.backend;
+            shared[4] = cached->second.threads;
+        }
+    }
+    broadcast(shared, 5);
+    if (shared[2])
+        return HisteqPlan{static_cast<HisteqBackend>(shared[3]), static_cast<int>(shared[4])};
+
+    HisteqPlan best = calibrate(static_cast<size_t>(shared[0]), static_cast<size_t>(shared[1]));
+    if (rank == 0)
+    {
+        plans[sizeBucket(static_cast<size_t>(shared[0] * shared[1]))] = best;
+        save();
+    }
+    return best;
+}
+
+HisteqPlan HisteqTuner::calibrate(size_t rows, size_t cols)
+{
+    int rank, size;
+    mpiWorld(rank, size);
+
+    vector<HisteqPlan> candidates = {HisteqPlan{HISTEQ_SCALAR, 1}, HisteqPlan{HISTEQ_SIMD, 1}};
+    if (histeqBackendAvailable(HISTEQ_OMP))
+    {
+        for (int threads = 2; threads < 2 * maxThreads(); threads *= 2)
+            candidates.push_back(HisteqPlan{HISTEQ_OMP, min(threads, maxThreads())});
+    }
+    if (histeqBackendAvailable(HISTEQ_MPI))
+        candidates.push_back(HisteqPlan{HISTEQ_MPI, 1});
+
+    // Uniform random pixels fill every bin, so no backend gains from a degenerate histogram
+    ImageType image, output;
+    if (rank == 0)
+    {
+        image.resize(rows, cols);
+        mt19937 gen(42);
+        uint8_t *data = image.getData();
+        for (size_t i = 0; i < rows * cols; i++)
+            data[i] = static_cast<uint8_t>(gen());
+    }
+
+    // Every rank walks the same list; the others return at once from plans that are not HISTEQ_MPI
+    vector<int> histBefore, histAfter;
+    HisteqPlan best = candidates[0];
+    double bestMs = 1e300;
+    for (const HisteqPlan &candidate : candidates)
+    {
+        histeqEqualize(image, output, histBefore, histAfter, candidate);
+        double ms = 1e300;
+        for (int r = 0; r < HISTEQ_CALIBRATION_REPS; r++)
+        {
+            auto start = chrono::high_resolution_clock::now();
+            histeqEqualize(image, output, histBefore, histAfter, candidate);
+            auto end = chrono::high_resolution_clock::now();
+            ms = min(ms, chrono::duration<double, milli>(end - start).count());
+        }
+        if (ms < bestMs)
+        {
+            bestMs = ms;
+            best = candidate;
+        }
+    }
+
+    long long shared[2] = {best.backend, best.threads};
+    broadcast(shared, 2);
+    return HisteqPlan{static_cast<HisteqBackend>(shared[0]), static_cast<int>(shared[1])};
+}
@@ -0,0 +1,88 @@
+#include "utils.hpp"
+#include "kernels.hpp"
+#include <map>
+
+#ifndef HISTEQ_HPP
+#define HISTEQ_HPP
+
+// libhisteq: 8-bit global grayscale equalization behind one call, dispatched at runtime to one of
+// the backends below. The OpenMP backend needs a build with -fopenmp, the MPI backend one with
+// mpic++ and -DHISTEQ_WITH_MPI.
+enum HisteqBackend
+{
+  HISTEQ_SCALAR, // One thread, scalar remap
+  HISTEQ_SIMD,   // One thread, remap with the widest instruction set of the CPU
+  HISTEQ_OMP,    // OpenMP threads over the whole image
+  HISTEQ_MPI,    // A stripe of rows per rank of MPI_COMM_WORLD
+  HISTEQ_BACKENDS
+};
+
+// Where HisteqTuner keeps the plans it measured, between runs
+#define HISTEQ_DEFAULT_TUNING_CACHE "output/histeq_tuning.txt"
+
+// Timed repetitions of every candidate plan during calibration, after one untimed warm-up
+#define HISTEQ_CALIBRATION_REPS 3
+
+struct HisteqPlan
+{
+  HisteqBackend backend = HISTEQ_SIMD;
+  int threads = 1; // OpenMP threads of HISTEQ_OMP
+};
+
+const char *histeqBackendName(HisteqBackend backend);
+
+// Backend called name; false if there is none
+bool parseHisteqBackend(const string &name, HisteqBackend &backend);
+
+// Whether this build and process can run backend; HISTEQ_MPI also needs MPI initialized with
+// more than one rank
+bool histeqBackendAvailable(HisteqBackend backend);
+
+// Global equalization of input into output with plan; histBefore and histAfter get HIST_SIZE bins.
+// An output already of the input's size is written in place, so it may adopt caller memory (a Mat
+// over a shared buffer); any other is resized. Throws runtime_error if the backend is not
+// available. Once MPI is initialized, every rank of MPI_COMM_WORLD calls it: the image and the
+// results live on rank 0, and the other ranks only take part in HISTEQ_MPI plans.
+void histeqEqualize(const ImageType &input, ImageType &output, vector<int> &histBefore, vector<int> &histAfter, const HisteqPlan &plan);
+
+// Picks the fastest plan per image size. The first image of a size bucket (sizes within a factor
+// of two) runs a short calibration of every available backend, and OpenMP at powers of two up to
+// the maximum thread count, on a synthetic image of its size. The winner is cached in memory and on
+// disk, keyed by the hardware it was measured on, so later runs dispatch without measuring. Under
+// MPI, rank 0 keeps the cache and every rank calls plan(), as with histeqEqualize.
+class HisteqTuner
+{
+private:
+  string cachePath;
+  map<int, HisteqPlan> plans; // By size bucket
+  bool loaded;
+
+  // Reads the cache file, unless it was measured on other hardware
+  void load();
+  void save() const;
+
+public:
+  explicit HisteqTuner(const string &cachePath = HISTEQ_DEFAULT_TUNING_CACHE) : cachePath(cachePath), loaded(false) {}
+
+  // floor(log2(pixels))
+  static int sizeBucket(size_t pixels);
+
+  // SIMD level, OpenMP threads and MPI ranks the plans are valid for
+  static string hardwareSignature();
+
+  // Plan for a rows x cols image, calibrated first when its bucket has none yet or retune is set
+  HisteqPlan plan(size_t rows, size_t cols, bool retune = false);
+
+  // Fastest available plan for a rows x cols image, measured now
+  HisteqPlan calibrate(size_t rows, size_t cols);
+};
+
+// Equalizes with the plan tuner picks for the size of input, and returns that plan
+inline HisteqPlan histeqEqualize(const ImageType &input, ImageType &output, vector<int> &histBefore, vector<int> &histAfter, HisteqTuner &tuner)
+{
+  HisteqPlan plan = tuner.plan(input.rows(), input.cols());
+  histeqEqualize(input, output, histBefore, histAfter, plan);
+  return plan;
+}
+
+#endif
@@ -0,0 +1,262 @@
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "utils.hpp"
+#include "daemon.hpp"
+#include <memory>
+#include <random>
+#include <thread>
+
+using namespace cv;
+using namespace std;
+
+#define AFTER_IMAGE_OUTPUT_PATH "output/daemon/after/image_after_daemon.png"
+
+// Load test defaults: timed requests in total, and untimed ones per client before them
+#define DAEMON_DEFAULT_REQUESTS 1000
+#define DAEMON_DEFAULT_WARMUP 20
+
+namespace
+{
+    // The image at source, or a synthetic one if source is <w>x<h>
+    void loadFrame(const string &source, ImageType &frame)
+    {
+        size_t cols, rows;
+        if (!parseSize(source, cols, rows))
+        {
+            readImage(source, frame);
+            return;
+        }
+        frame.resize(rows, cols);
+        mt19937 gen(7);
+        uniform_int_distribution<int> noise(-24, 24);
+        for (size_t i = 0; i < rows; i++)
+            for (size_t j = 0; j < cols; j++)
+                frame.at(i, j) = static_cast<uint8_t>(min(max(static_cast<int>(32 + 160 * (i + j) / (rows + cols)) + noise(gen), 0), 255));
+    }
+
+    void printPlan(const DaemonReply &reply)
+    {
+        cout << histeqBackendName(static_cast<HisteqBackend>(reply.backend));
+        if (reply.backend == HISTEQ_OMP)
+            cout << " x " << reply.threads << " thread(s)";
+    }
+
+    // clients connections send requests frames between them, as fast as the server answers, after
+    // warmup untimed frames each. Latency is the round trip seen by the client; the frame is written
+    // into the shared segment once, as a producer decoding straight into it would.
+    int runLoad(const string &socketPath, const string &source, size_t requests, int clients, size_t warmup, bool verify)
+    {
+        ImageType frame;
+        loadFrame(source, frame);
+        size_t rows = frame.rows(), cols = frame.cols(), pixels = rows * cols;
+
+        vector<unique_ptr<DaemonClient>> connections;
+        DaemonReply last{};
+        for (int c = 0; c < clients; c++)
+        {
+            connections.emplace_back(new DaemonClient(socketPath));
+            memcpy(connections.back()->input(rows, cols), frame.getData(), pixels);
+            for (size_t w = 0; w < warmup; w++)
+                last = connections.back()->equalize(rows, cols);
+        }
+
+        vector<vector<double>> latencies(clients), serviceTimes(clients);
+        vector<string> errors(clients);
+        auto start = chrono::steady_clock::now();
+        vector<thread> threads;
+        for (int c = 0; c < clients; c++)
+        {
+            threads.emplace_back([&, c]()
+                                 {
+                DaemonClient &client = *connections[c];
+                size_t count = requests / clients + (static_cast<size_t>(c) < requests % clients ? 1 : 0);
+                latencies[c].reserve(count);
+                serviceTimes[c].reserve(count);
+                try
+                {
+                    for (size_t r = 0; r < count; r++)
+                    {
+                        auto begin = chrono::steady_clock::now();
+                        DaemonReply reply = client.equalize(rows, cols);
+                        latencies[c].push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count());
+                        serviceTimes[c].push_back(reply.serviceMs);
+                        if (verify && !histogramMatches(client.output(rows, cols), pixels, client.histAfter(rows, cols)))
+                            throw runtime_error("Histogram after equalization does not match the returned frame");
+                    }
+                }
+                catch (const exception &error)
+                {
+                    errors[c] = error.what();
+                } });
+        }
+        for (thread &t : threads)
+            t.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        for (const string &error : errors)
+        {
+            if (!error.empty())
+            {
+                cerr << "Load failed: " << error << endl;
+                return -1;
+            }
+        }
+
+        vector<double> latency, service;
+        for (int c = 0; c < clients; c++)
+        {
+            latency.insert(latency.end(), latencies[c].begin(), latencies[c].end());
+            service.insert(service.end(), serviceTimes[c].begin(), serviceTimes[c].end());
+        }
+        sort(latency.begin(), latency.end());
+        sort(service.begin(), service.end());
+
+        cout << "\n=== Daemon load: " << cols << "x" << rows << ", " << latency.size() << " request(s) over " << clients << " client(s) ===" << endl;
+        cout << "  Plan: ";
+        printPlan(last);
+        cout << endl;
+        cout << "  Throughput: " << fixed << setprecision(1) << (seconds > 0 ? latency.size() / seconds : 0) << " requests/s sustained, "
+             << (seconds > 0 ? latency.size() * pixels / seconds / 1e6 : 0) << " Mpixel/s" << endl;
+        cout << "  Latency (round trip): " << setprecision(3) << percentile(latency, 50) << " ms p50, " << percentile(latency, 99) << " ms p99, "
+             << (latency.empty() ? 0 : latency.back()) << " ms max" << endl;
+        cout << "  Service (server side): " << percentile(service, 50) << " ms p50, " << percentile(service, 99) << " ms p99" << endl;
+        if (verify)
+            cout << "  Verified every returned histogram against its frame" << endl;
+        return 0;
+    }
+
+    // One frame through the server, written like the engines' equalized image
+    int runEqualize(const string &socketPath, const string &source, const string &outputPath)
+    {
+        ImageType image, equalizedImage;
+        readImage(source, image);
+        vector<int> histBefore, histAfter;
+
+        DaemonClient client(socketPath);
+        auto start = chrono::steady_clock::now();
+        DaemonReply reply = client.equalize(image, equalizedImage, histBefore, histAfter);
+        double roundTrip = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        writeImage(outputPath, equalizedImage);
+        cout << "Saved " << outputPath << endl;
+        cout << "Backend: ";
+        printPlan(reply);
+        cout << endl;
+        cout << "Runtime: " << reply.serviceMs << " ms (server), " << roundTrip << " ms round trip with copies" << endl;
+        return 0;
+    }
+}
+
+// Resident global 8-bit equalization: histeqd.out serves frames over a Unix domain socket and shared
+// memory, so a request pays neither process start-up nor OpenCV, OpenMP or MPI initialization. The
+// same binary is its client: --equalize sends one image, --load measures latency and throughput,
+// --stop ends the server.
+int main(int argc, char **argv)
+{
+    string socketPath = DAEMON_DEFAULT_SOCKET;
+    string backendName = "auto", tuningCache = HISTEQ_DEFAULT_TUNING_CACHE, warmSizes;
+    string equalizeSource, outputPath = AFTER_IMAGE_OUTPUT_PATH, loadSource;
+    size_t requests = DAEMON_DEFAULT_REQUESTS, warmup = DAEMON_DEFAULT_WARMUP;
+    int clients = 1, threads = 0;
+    bool stop = false, verify = false, valid = true;
+    for (int i = 1; i < argc && valid; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--socket" && hasValue)
+            socketPath = argv[++i];
+        else if (arg == "--backend" && hasValue)
+            backendName = argv[++i];
+        else if (arg == "--threads" && hasValue)
+            valid = (threads = atoi(argv[++i])) > 0;
+        else if (arg == "--tuning-cache" && hasValue)
+            tuningCache = argv[++i];
+        else if (arg == "--warm" && hasValue)
+            warmSizes = argv[++i];
+        else if (arg == "--equalize" && hasValue)
+            equalizeSource = argv[++i];
+        else if (arg == "--out" && hasValue)
+            outputPath = argv[++i];
+        else if (arg == "--load" && hasValue)
+            loadSource = argv[++i];
+        else if (arg == "--requests" && hasValue)
+            valid = (requests = strtoull(argv[++i], nullptr, 10)) > 0;
+        else if (arg == "--clients" && hasValue)
+            valid = (clients = atoi(argv[++i])) > 0;
+        else if (arg == "--warmup" && hasValue)
+            warmup = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--verify")
+            verify = true;
+        else if (arg == "--stop")
+            stop = true;
+        else
+            valid = false;
+    }
+    bool autoBackend = backendName == "auto";
+    HisteqPlan plan;
+    if (valid && !autoBackend && !parseHisteqBackend(backendName, plan.backend))
+        valid = false;
+    if (valid && (!equalizeSource.empty() + !loadSource.empty() + stop) > 1)
+        valid = false;
+    if (!valid)
+    {
+        cout << "Usage: " << argv[0] << " [--socket <path>] [--backend <auto|scalar|simd|omp>] [--threads <n>] [--tuning-cache <path>] [--warm <w>x<h>,...]" << endl;
+        cout << "       " << argv[0] << " [--socket <path>] --equalize <image_path> [--out <path>]" << endl;
+        cout << "       " << argv[0] << " [--socket <path>] --load <image_path|<w>x<h>> [--requests <n>] [--clients <n>] [--warmup <n>] [--verify]" << endl;
+        cout << "       " << argv[0] << " [--socket <path>] --stop" << endl;
+        return -1;
+    }
+
+    try
+    {
+        if (!equalizeSource.empty())
+            return runEqualize(socketPath, equalizeSource, outputPath);
+        if (!loadSource.empty())
+            return runLoad(socketPath, loadSource, requests, clients, warmup, verify);
+        if (stop)
+        {
+            DaemonClient(socketPath).shutdownServer();
+            return 0;
+        }
+
+        if (!autoBackend && !histeqBackendAvailable(plan.backend))
+        {
+            cerr << "The " << backendName << " backend is not available in histeqd.out (omp needs -fopenmp; mpi is not served)" << endl;
+            return -1;
+        }
+#ifdef _OPENMP
+        if (threads > 0)
+            omp_set_num_threads(threads);
+        plan.threads = omp_get_max_threads();
+        // Start the thread pool now, not on the first request
+#pragma omp parallel
+        {
+        }
+#endif
+
+        // Calibrating a size takes a few full equalizations, so do it before serving when the
+        // sizes are known
+        HisteqTuner tuner(tuningCache);
+        for (const string &item : splitList(warmSizes))
+        {
+            size_t cols, rows;
+            if (parseSize(item, cols, rows))
+                tuner.plan(rows, cols);
+        }
+
+        DaemonServer server(socketPath, autoBackend ? &tuner : nullptr, plan);
+        cout << "Listening on " << socketPath << " (backend " << backendName;
+        if (!autoBackend && plan.backend == HISTEQ_OMP)
+            cout << " x " << plan.threads << " thread(s)";
+        cout << "); stop with " << argv[0] << " --stop or Ctrl-C" << endl;
+        server.serve();
+        server.printStats();
+    }
+    catch (const exception &error)
+    {
+        cerr << error.what() << endl;
+        return -1;
+    }
+    return 0;
+}
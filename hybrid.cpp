@@ -0,0 +1,287 @@
+#include <mpi.h>
+#include <omp.h>
+#include "utils.hpp"
+#include "kernels.hpp"
+#include "omp_kernels.hpp"
+#include "mpi_types.hpp"
+#include "profile.hpp"
+
+using namespace cv;
+using namespace std;
+
+#define BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH "output/hybrid/before/histogram_before_hybrid.png"
+#define AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH "output/hybrid/after/histogram_after_hybrid.png"
+#define BEFORE_IMAGE_OUTPUT_PATH "output/hybrid/before/image_before_hybrid.png"
+#define AFTER_IMAGE_OUTPUT_PATH "output/hybrid/after/image_after_hybrid.png"
+#define BEFORE_IMAGE_HISTOGRAM_COMBINED_PATH "output/hybrid/before/image_histo_before_hybrid.png"
+#define AFTER_IMAGE_HISTOGRAM_COMBINED_PATH "output/hybrid/after/image_histo_after_hybrid.png"
+#define BEFORE_AFTER_COMBINED_PATH "output/hybrid/result_hybrid.png"
+#define RUNTIME_OUTPUT_PATH "output/hybrid/runtime_hybrid.txt"
+#define PROFILE_OUTPUT_PATH "output/hybrid/profile_hybrid.json"
+
+// Rank 0 scatters one stripe of rows per rank, and every rank equalizes its stripe with the OpenMP
+// phases in a single parallel region. With a rank per node or per socket instead of per core, the
+// scatter makes far fewer intra-node copies. The master thread makes the only MPI call inside the
+// region (MPI_THREAD_FUNNELED): the Allreduce of the stripe histograms, after which every rank
+// builds the LUT itself.
+template <typename Pixel, int Bins>
+void histogramEqualization(const int rank, const int size, const BasicImage<Pixel> &image, vector<int> &histBefore, BasicImage<Pixel> &equalizedImage, vector<int> &histAfter, bool verify)
+{
+    typedef HistogramKernels<Pixel, Bins> Kernels;
+    MPI_Datatype pixelType = MpiPixelType<Pixel>::get();
+    histBefore.assign(Bins, 0);
+    histAfter.assign(Bins, 0);
+
+    int shape[2] = {static_cast<int>(image.rows()), static_cast<int>(image.cols())};
+    MPI_Bcast(shape, 2, MPI_INT, 0, MPI_COMM_WORLD);
+    int rows = shape[0], cols = shape[1];
+
+    // Scatter the rows of the image
+    int localRows = rows / size;
+    int remainder = rows % size;
+    int myRows = (rank < remainder) ? localRows + 1 : localRows;
+    BasicImage<Pixel> localImage(myRows, cols);
+
+    vector<int> sendCounts(size), displs(size);
+    int offset = 0;
+    for (int i = 0; i < size; i++)
+    {
+        sendCounts[i] = (i < remainder) ? (localRows + 1) * cols : localRows * cols;
+        displs[i] = offset;
+        offset += sendCounts[i];
+    }
+
+    {
+        PROFILE_SCOPE(PROFILE_SCATTER);
+        MPI_Scatterv(image.getData(), sendCounts.data(), displs.data(), pixelType,
+                     localImage.getData(), myRows * cols, pixelType, 0, MPI_COMM_WORLD);
+    }
+
+    vector<int> localHist(Bins, 0);
+    vector<Pixel> eqLookupTable(Bins, 0);
+    OmpEqualizationState<Pixel, Bins> state;
+
+#pragma omp parallel
+    {
+        {
+            PROFILE_SCOPE_IF(PROFILE_HISTOGRAM, omp_get_thread_num() == 0);
+            ompCountHistogram(localImage.getData(), static_cast<size_t>(myRows) * cols, state, localHist.data());
+        }
+
+#pragma omp master
+        {
+            PROFILE_SCOPE(PROFILE_REDUCE);
+            MPI_Allreduce(localHist.data(), histBefore.data(), Bins, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+        }
+#pragma omp barrier
+
+        {
+            PROFILE_SCOPE_IF(PROFILE_LUT, omp_get_thread_num() == 0);
+            ompBuildLookupTable(histBefore.data(), static_cast<size_t>(rows) * cols, state, eqLookupTable.data());
+        }
+        {
+            PROFILE_SCOPE_IF(PROFILE_REMAP, omp_get_thread_num() == 0);
+            ompApplyLookupTable<Pixel, Bins>(localImage, localImage, eqLookupTable.data());
+        }
+    }
+
+    // Gather the processed stripes back to rank 0
+    if (rank == 0)
+    {
+        equalizedImage.resize(rows, cols);
+    }
+
+    {
+        PROFILE_SCOPE(PROFILE_GATHER);
+        MPI_Gatherv(localImage.getData(), myRows * cols, pixelType,
+                    equalizedImage.getData(), sendCounts.data(), displs.data(), pixelType,
+                    0, MPI_COMM_WORLD);
+    }
+
+    // Histogram after equalization follows from the LUT, so rank 0 needs no pass over the gathered image
+    if (rank == 0)
+    {
+        {
+            PROFILE_SCOPE(PROFILE_POST_HISTOGRAM);
+            Kernels::remap(histBefore.data(), eqLookupTable.data(), histAfter.data());
+        }
+
+        if (verify)
+        {
+            PROFILE_SCOPE(PROFILE_VERIFY);
+            if (!Kernels::matches(equalizedImage.getData(), equalizedImage.rows() * equalizedImage.cols(), histAfter.data()))
+            {
+                cerr << "Derived histogram after equalization does not match the equalized image" << endl;
+                MPI_Abort(MPI_COMM_WORLD, -1);
+            }
+        }
+    }
+}
+
+// Global equalization of a 10/12/16-bit image with 2^bits bins
+double highBitDepthEqualization(int bits, const int rank, const int size, const ImageType16 &image, vector<int> &histBefore, ImageType16 &equalizedImage, vector<int> &histAfter, bool verify)
+{
+    switch (bits)
+    {
+    case 10:
+        return measureRuntime(RUNTIME_OUTPUT_PATH, histogramEqualization<uint16_t, 1 << 10>, rank, size, image, histBefore, equalizedImage, histAfter, verify);
+    case 12:
+        return measureRuntime(RUNTIME_OUTPUT_PATH, histogramEqualization<uint16_t, 1 << 12>, rank, size, image, histBefore, equalizedImage, histAfter, verify);
+    default:
+        return measureRuntime(RUNTIME_OUTPUT_PATH, histogramEqualization<uint16_t, 1 << 16>, rank, size, image, histBefore, equalizedImage, histAfter, verify);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    // Only the master thread of each rank calls MPI
+    int rank, size, provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    // Global grayscale equalization of every pixel only; colour, CLAHE, batch, streaming, sequences and sampled
+    // histograms live in the other engines
+    ProgramOptions options;
+    if (!parseOptions(argc, argv, options) || options.color || options.clahe || !options.batch.empty() || options.stream || !options.sequence.empty() || hasMpiOnlyOptions(options) || hasAutoOnlyOptions(options) ||
+        options.sampleRate < 1 || options.sampleError > 0)
+    {
+        if (rank == 0)
+        {
+            cout << "Usage: mpirun -np <num_processes> ./hybrid [--quiet|-q] [--verify] [--no-artifacts] [--png-compression <0-9>] [--timings <path>] [--profile|--perf-counters] [--threads <n>] [--bits <n>] <image_path>" << endl;
+        }
+        MPI_Finalize();
+        return -1;
+    }
+    if (provided < MPI_THREAD_FUNNELED)
+    {
+        if (rank == 0)
+            cerr << "The MPI library does not support MPI_THREAD_FUNNELED" << endl;
+        MPI_Finalize();
+        return -1;
+    }
+    if (options.threads > 0)
+        omp_set_num_threads(options.threads);
+    if (options.perfCounters && !enableProfileCounters() && rank == 0)
+        cerr << "Hardware counters are unavailable (see /proc/sys/kernel/perf_event_paranoid); reporting times only" << endl;
+
+    string filename = options.filename;
+    bool quiet = options.quiet;
+    int threads = omp_get_max_threads();
+
+    if (options.bits > 8)
+    {
+        ImageType16 image16, equalized16;
+        if (rank == 0)
+        {
+            try
+            {
+                readImage(filename, image16, options.bits);
+            }
+            catch (const std::exception &e)
+            {
+                MPI_Abort(MPI_COMM_WORLD, -1);
+                throw e;
+            }
+        }
+
+        vector<int> histBefore, histAfter;
+        double duration = highBitDepthEqualization(options.bits, rank, size, image16, histBefore, equalized16, histAfter, options.verify);
+
+        if (rank == 0)
+        {
+            // Full-depth images are written as 16-bit PNGs; the combined previews are scaled to 8 bits
+            ImageWriter writer(options.pngCompression);
+            writer.write(AFTER_IMAGE_OUTPUT_PATH, equalized16);
+            if (!options.noArtifacts)
+            {
+                writer.write(BEFORE_IMAGE_OUTPUT_PATH, image16);
+                Mat plotBefore = outputHistogram(histBefore, BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram BEFORE Equalization", quiet, writer);
+                Mat plotAfter = outputHistogram(histAfter, AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram AFTER Equalization", quiet, writer);
+
+                ImageType displayBefore, displayAfter;
+                toDisplayImage(image16, options.bits, displayBefore);
+                toDisplayImage(equalized16, options.bits, displayAfter);
+                generateCombinedOutputs(
+                    displayBefore,
+                    displayAfter,
+                    plotBefore,
+                    plotAfter,
+                    BEFORE_IMAGE_HISTOGRAM_COMBINED_PATH,
+                    AFTER_IMAGE_HISTOGRAM_COMBINED_PATH,
+                    BEFORE_AFTER_COMBINED_PATH,
+                    writer);
+            }
+            writer.wait();
+
+            cout << "Layout: " << size << " rank(s) x " << threads << " thread(s)" << endl;
+            cout << "Runtime: " << duration << " ms" << endl;
+            if (!options.timingsPath.empty())
+                appendTiming(options.timingsPath, "hybrid", size * threads, image16.rows(), image16.cols(), duration);
+        }
+        if (options.profile)
+            reportProfile(rank, size, MPI_COMM_WORLD, PROFILE_OUTPUT_PATH);
+
+        MPI_Finalize();
+        return 0;
+    }
+
+    ImageType image;
+    if (rank == 0)
+    {
+        try
+        {
+            readImage(filename, image);
+        }
+        catch (const std::exception &e)
+        {
+            MPI_Abort(MPI_COMM_WORLD, -1);
+            throw e;
+        }
+    }
+
+    ImageType equalizedImage;
+    vector<int> histBefore(256, 0);
+    vector<int> histAfter(256, 0);
+
+    double duration = measureRuntime(
+        RUNTIME_OUTPUT_PATH,
+        histogramEqualization<uint8_t, HIST_SIZE>, rank, size, image, histBefore, equalizedImage, histAfter, options.verify);
+
+    if (rank == 0)
+    {
+        // Every output is encoded on its own thread; the histogram plots go to the composites in memory
+        ImageWriter writer(options.pngCompression);
+        writer.write(AFTER_IMAGE_OUTPUT_PATH, equalizedImage);
+        if (!options.noArtifacts)
+        {
+            writer.write(BEFORE_IMAGE_OUTPUT_PATH, image);
+            Mat plotBefore = outputHistogram(histBefore, BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram BEFORE Equalization", quiet, writer);
+            Mat plotAfter = outputHistogram(histAfter, AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram AFTER Equalization", quiet, writer);
+
+            generateCombinedOutputs(
+                image,
+                equalizedImage,
+                plotBefore,
+                plotAfter,
+                BEFORE_IMAGE_HISTOGRAM_COMBINED_PATH,
+                AFTER_IMAGE_HISTOGRAM_COMBINED_PATH,
+                BEFORE_AFTER_COMBINED_PATH,
+                writer);
+        }
+        writer.wait();
+
+        if (!quiet && !options.noArtifacts)
+            cout << "\nSaved " << BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH << " and " << AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH << " successfully." << endl;
+
+        cout << "Layout: " << size << " rank(s) x " << threads << " thread(s)" << endl;
+        cout << "Runtime: " << duration << " ms" << endl;
+        if (!options.timingsPath.empty())
+            appendTiming(options.timingsPath, "hybrid", size * threads, image.rows(), image.cols(), duration);
+    }
+    if (options.profile)
+        reportProfile(rank, size, MPI_COMM_WORLD, PROFILE_OUTPUT_PATH);
+
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,295 @@
+#include "kernels.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    // Below this many pixels the bank setup and merge cost more than the stalls they avoid
+    const size_t HIST_BANKED_MIN_COUNT = 4096;
+
+    // Colour pixels are converted in blocks small enough to stay in L1 between the two steps
+    const size_t LUMA_BLOCK = 1024;
+
+    // Y = 0.299 R + 0.587 G + 0.114 B in 14-bit fixed point, matching OpenCV
+    inline void computeLumaBlock(const uint8_t *bgr, size_t count, uint8_t *luma)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            uint32_t b = bgr[3 * i], g = bgr[3 * i + 1], r = bgr[3 * i + 2];
+            luma[i] = static_cast<uint8_t>((b * 1868 + g * 9617 + r * 4899 + 8192) >> 14);
+        }
+    }
+
+    inline uint8_t saturate(int value)
+    {
+        return static_cast<uint8_t>(value < 0 ? 0 : (value > 255 ? 255 : value));
+    }
+
+    void applyLookupTableScalar(const uint8_t *src, uint8_t *dst, size_t count, const uint8_t *lut)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            dst[i] = lut[src[i]];
+        }
+    }
+
+#ifdef KERNELS_X86
+    // 16-way split: the table is cut into 16 slices of 16 entries, each one small enough for a
+    // single pshufb. For slice k, (v ^ k<<4) is below 16 only for bytes whose high nibble is k;
+    // a saturating add of 0x70 keeps those in 0x70..0x7F and pushes every other byte to >= 0x80,
+    // which pshufb turns into zero. OR-ing the 16 partial results gives the lookup.
+    __attribute__((target("ssse3"))) void applyLookupTableSsse3(const uint8_t *src, uint8_t *dst, size_t count, const uint8_t *lut)
+    {
+        __m128i slices[16];
+        for (int k = 0; k < 16; k++)
+            slices[k] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lut + 16 * k));
+
+        const __m128i bias = _mm_set1_epi8(0x70);
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+            __m128i result = _mm_setzero_si128();
+            for (int k = 0; k < 16; k++)
+            {
+                __m128i idx = _mm_adds_epu8(_mm_xor_si128(v, _mm_set1_epi8(static_cast<char>(k << 4))), bias);
+                result = _mm_or_si128(result, _mm_shuffle_epi8(slices[k], idx));
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), result);
+        }
+        applyLookupTableScalar(src + i, dst + i, count - i, lut);
+    }
+
+    // Same 16-way split as the SSSE3 kernel; vpshufb works per 128-bit lane, so every slice is
+    // broadcast to both lanes.
+    __attribute__((target("avx2"))) void applyLookupTableAvx2(const uint8_t *src, uint8_t *dst, size_t count, const uint8_t *lut)
+    {
+        __m256i slices[16];
+        for (int k = 0; k < 16; k++)
+            slices[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(lut + 16 * k)));
+
+        const __m256i bias = _mm256_set1_epi8(0x70);
+        size_t i = 0;
+        for (; i + 32 <= count; i += 32)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+            __m256i result = _mm256_setzero_si256();
+            for (int k = 0; k < 16; k++)
+            {
+                __m256i idx = _mm256_adds_epu8(_mm256_xor_si256(v, _mm256_set1_epi8(static_cast<char>(k << 4))), bias);
+                result = _mm256_or_si256(result, _mm256_shuffle_epi8(slices[k], idx));
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), result);
+        }
+        applyLookupTableScalar(src + i, dst + i, count - i, lut);
+    }
+
+    // VBMI permute: vpermi2b looks up 7 bits of the index in a 128-entry two-register table, so
+    // the 256-entry table is two such lookups blended on the index's top bit.
+    __attribute__((target("avx512f,avx512bw,avx512vbmi,bmi2"))) void applyLookupTableAvx512(const uint8_t *src, uint8_t *dst, size_t count, const uint8_t *lut)
+    {
+        const __m512i t0 = _mm512_loadu_si512(lut);
+        const __m512i t1 = _mm512_loadu_si512(lut + 64);
+        const __m512i t2 = _mm512_loadu_si512(lut + 128);
+        const __m512i t3 = _mm512_loadu_si512(lut + 192);
+
+        size_t i = 0;
+        for (; i + 64 <= count; i += 64)
+        {
+            __m512i v = _mm512_loadu_si512(src + i);
+            __m512i low = _mm512_permutex2var_epi8(t0, v, t1);
+            __m512i high = _mm512_permutex2var_epi8(t2, v, t3);
+            __m512i result = _mm512_mask_blend_epi8(_mm512_movepi8_mask(v), low, high);
+            _mm512_storeu_si512(dst + i, result);
+        }
+        if (i < count)
+        {
+            // Masked tail so short rows stay in the vector path
+            __mmask64 tail = _bzhi_u64(~0ULL, static_cast<unsigned>(count - i));
+            __m512i v = _mm512_maskz_loadu_epi8(tail, src + i);
+            __m512i low = _mm512_permutex2var_epi8(t0, v, t1);
+            __m512i high = _mm512_permutex2var_epi8(t2, v, t3);
+            __m512i result = _mm512_mask_blend_epi8(_mm512_movepi8_mask(v), low, high);
+            _mm512_mask_storeu_epi8(dst + i, tail, result);
+        }
+    }
+#endif
+
+    SimdLevel querySimdLevel()
+    {
+#ifdef KERNELS_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+            __builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("bmi2"))
+            return SIMD_AVX512;
+        if (__builtin_cpu_supports("avx2"))
+            return SIMD_AVX2;
+        if (__builtin_cpu_supports("ssse3"))
+            return SIMD_SSSE3;
+#endif
+        return SIMD_SCALAR;
+    }
+}
+
+void computeHistogram(const uint8_t *src, size_t count, int *hist)
+{
+    if (count < HIST_BANKED_MIN_COUNT)
+    {
+        for (size_t i = 0; i < count; i++)
+            hist[src[i]]++;
+        return;
+    }
+
+    // Byte k of every 8-byte word goes to bank k, so runs of equal pixels increment
+    // HIST_BANKS different counters instead of waiting on the previous store to the same one.
+    uint32_t banks[HIST_BANKS][HIST_SIZE];
+    memset(banks, 0, sizeof(banks));
+
+    size_t i = 0;
+    for (; i + 64 <= count; i += 64)
+    {
+        uint64_t words[8];
+        memcpy(words, src + i, sizeof(words));
+        for (int w = 0; w < 8; w++)
+        {
+            uint64_t word = words[w];
+            banks[0][word & 0xFF]++;
+            banks[1][(word >> 8) & 0xFF]++;
+            banks[2][(word >> 16) & 0xFF]++;
+            banks[3][(word >> 24) & 0xFF]++;
+            banks[4][(word >> 32) & 0xFF]++;
+            banks[5][(word >> 40) & 0xFF]++;
+            banks[6][(word >> 48) & 0xFF]++;
+            banks[7][word >> 56]++;
+        }
+    }
+    for (; i < count; i++)
+        banks[i % HIST_BANKS][src[i]]++;
+
+    for (int v = 0; v < HIST_SIZE; v++)
+    {
+        uint32_t sum = 0;
+        for (int b = 0; b < HIST_BANKS; b++)
+            sum += banks[b][v];
+        hist[v] += static_cast<int>(sum);
+    }
+}
+
+void buildEqualizationLookupTable(const int *hist, size_t totalPixels, uint8_t *lut)
+{
+    // Same float PDF/CDF accumulation the engines have always used, so LUTs stay bit-identical
+    float cumulativeDistFunc = 0.0f;
+    for (int i = 0; i < HIST_SIZE; i++)
+    {
+        cumulativeDistFunc += (float)hist[i] / totalPixels;
+        lut[i] = static_cast<uint8_t>(std::round(cumulativeDistFunc * 255));
+    }
+}
+
+void computeLumaHistogram(const uint8_t *bgr, size_t count, int *hist)
+{
+    uint8_t luma[LUMA_BLOCK];
+    for (size_t i = 0; i < count; i += LUMA_BLOCK)
+    {
+        size_t n = std::min(LUMA_BLOCK, count - i);
+        computeLumaBlock(bgr + 3 * i, n, luma);
+        computeHistogram(luma, n, hist);
+    }
+}
+
+void applyLumaLookupTable(const uint8_t *src, uint8_t *dst, size_t count, const uint8_t *lut, int *histAfter)
+{
+    uint8_t luma[LUMA_BLOCK], equalized[LUMA_BLOCK];
+    for (size_t i = 0; i < count; i += LUMA_BLOCK)
+    {
+        size_t n = std::min(LUMA_BLOCK, count - i);
+        const uint8_t *in = src + 3 * i;
+        uint8_t *out = dst + 3 * i;
+
+        computeLumaBlock(in, n, luma);
+        applyLookupTable(luma, equalized, n, lut);
+
+        // Holding Cr and Cb fixed, B' = B + (Y' - Y) and likewise for G and R
+        for (size_t k = 0; k < n; k++)
+        {
+            int delta = equalized[k] - luma[k];
+            out[3 * k] = saturate(in[3 * k] + delta);
+            out[3 * k + 1] = saturate(in[3 * k + 1] + delta);
+            out[3 * k + 2] = saturate(in[3 * k + 2] + delta);
+        }
+
+        // Clamping can move a pixel off its target luminance, so the result is counted as written
+        computeLumaBlock(out, n, luma);
+        computeHistogram(luma, n, histAfter);
+    }
+}
+
+void remapHistogram(const int *histBefore, const uint8_t *lut, int *histAfter)
+{
+    memset(histAfter, 0, HIST_SIZE * sizeof(int));
+    for (int i = 0; i < HIST_SIZE; i++)
+        histAfter[lut[i]] += histBefore[i];
+}
+
+bool histogramMatches(const uint8_t *src, size_t count, const int *expected)
+{
+    int actual[HIST_SIZE] = {0};
+    computeHistogram(src, count, actual);
+    return memcmp(actual, expected, sizeof(actual)) == 0;
+}
+
+SimdLevel detectSimdLevel()
+{
+    static const SimdLevel level = querySimdLevel();
+    return level;
+}
+
+const char *simdLevelName(SimdLevel level)
+{
+    switch (level)
+    {
+    case SIMD_SSSE3:
+        return "ssse3";
+    case SIMD_AVX2:
+        return "avx2";
+    case SIMD_AVX512:
+        return "avx512vbmi";
+    default:
+        return "scalar";
+    }
+}
+
+void applyLookupTable(const uint8_t *src, uint8_t *dst, size_t count, const uint8_t *lut, SimdLevel level)
+{
+    if (level > detectSimdLevel())
+        level = SIMD_SCALAR;
+
+    switch (level)
+    {
+#ifdef KERNELS_X86
+    case SIMD_AVX512:
+        applyLookupTableAvx512(src, dst, count, lut);
+        break;
+    case SIMD_AVX2:
+        applyLookupTableAvx2(src, dst, count, lut);
+        break;
+    case SIMD_SSSE3:
+        applyLookupTableSsse3(src, dst, count, lut);
+        break;
+#endif
+    default:
+        applyLookupTableScalar(src, dst, count, lut);
+        break;
+    }
+}
+
+void applyLookupTable(const uint8_t *src, uint8_t *dst, size_t count, const uint8_t *lut)
+{
+    applyLookupTable(src, dst, count, lut, detectSimdLevel());
+}
@@ -0,0 +1,226 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifndef KERNELS_HPP
+#define KERNELS_HPP
+
+#define HIST_SIZE 256
+
+// Interleaved sub-histograms used by computeHistogram
+#define HIST_BANKS 8
+
+// Instruction sets the byte kernels can be dispatched to, from oldest to newest
+enum SimdLevel
+{
+  SIMD_SCALAR = 0,
+  SIMD_SSSE3,
+  SIMD_AVX2,
+  SIMD_AVX512
+};
+
+// Best level supported by the running CPU (detected once, then cached)
+SimdLevel detectSimdLevel();
+
+const char *simdLevelName(SimdLevel level);
+
+// Adds the counts of count bytes into hist (HIST_SIZE entries, not cleared first)
+void computeHistogram(const uint8_t *src, size_t count, int *hist);
+
+// Equalization LUT from a histogram of totalPixels values: round(255 * CDF)
+void buildEqualizationLookupTable(const int *hist, size_t totalPixels, uint8_t *lut);
+
+// histAfter[v] = sum of histBefore[i] over every i with lut[i] == v (histAfter is overwritten)
+void remapHistogram(const int *histBefore, const uint8_t *lut, int *histAfter);
+
+// Rescans count bytes and checks their histogram equals expected
+bool histogramMatches(const uint8_t *src, size_t count, const int *expected);
+
+// dst[i] = lut[src[i]] for count bytes; src and dst may be the same buffer
+void applyLookupTable(const uint8_t *src, uint8_t *dst, size_t count, const uint8_t *lut);
+
+// Adds the luminance histogram of count interleaved BGR pixels into hist; the BGR->Y conversion
+// (ITU-R BT.601, as in OpenCV's BGR2YCrCb) is fused with the counting
+void computeLumaHistogram(const uint8_t *bgr, size_t count, int *hist);
+
+// Replaces the luminance Y of count BGR pixels by lut[Y] with chroma (Cr, Cb) unchanged, which adds
+// lut[Y] - Y to every channel. The luminance histogram of the result is added into histAfter.
+// src and dst may be the same buffer.
+void applyLumaLookupTable(const uint8_t *src, uint8_t *dst, size_t count, const uint8_t *lut, int *histAfter);
+
+// Same as above but forces a specific instruction set (falls back to scalar if unsupported)
+void applyLookupTable(const uint8_t *src, uint8_t *dst, size_t count, const uint8_t *lut, SimdLevel level);
+
+// Global-equalization kernels for Pixel values with Bins histogram bins, used by the templated
+// engines. Every value must be below Bins: readImage and PgmFile reject images with larger values
+// up front, so the kernels index with them directly. The <uint8_t, HIST_SIZE> specialization
+// forwards to the vectorized byte kernels above.
+template <typename Pixel, int Bins>
+struct HistogramKernels
+{
+  static void count(const Pixel *src, size_t n, int *hist)
+  {
+    for (size_t i = 0; i < n; i++)
+      hist[src[i]]++;
+  }
+
+  // For private histograms shared by several threads
+  static void countAtomic(const Pixel *src, size_t n, int *hist)
+  {
+    for (size_t i = 0; i < n; i++)
+      __atomic_fetch_add(&hist[src[i]], 1, __ATOMIC_RELAXED);
+  }
+
+  // LUT entry for a bin whose inclusive CDF is cdf: round((Bins - 1) * CDF)
+  static Pixel lookupValue(long long cdf, size_t totalPixels)
+  {
+    return static_cast<Pixel>(std::llround(static_cast<double>(cdf) * (Bins - 1) / totalPixels));
+  }
+
+  static void buildLookupTable(const int *hist, size_t totalPixels, Pixel *lut)
+  {
+    long long cdf = 0;
+    for (int i = 0; i < Bins; i++)
+    {
+      cdf += hist[i];
+      lut[i] = lookupValue(cdf, totalPixels);
+    }
+  }
+
+  static void remap(const int *histBefore, const Pixel *lut, int *histAfter)
+  {
+    memset(histAfter, 0, Bins * sizeof(int));
+    for (int i = 0; i < Bins; i++)
+      histAfter[lut[i]] += histBefore[i];
+  }
+
+  static bool matches(const Pixel *src, size_t n, const int *expected)
+  {
+    int *actual = new int[Bins]();
+    count(src, n, actual);
+    bool equal = memcmp(actual, expected, Bins * sizeof(int)) == 0;
+    delete[] actual;
+    return equal;
+  }
+
+  static void apply(const Pixel *src, Pixel *dst, size_t n, const Pixel *lut)
+  {
+    for (size_t i = 0; i < n; i++)
+      dst[i] = lut[src[i]];
+  }
+};
+
+template <>
+struct HistogramKernels<uint8_t, HIST_SIZE>
+{
+  static void count(const uint8_t *src, size_t n, int *hist) { computeHistogram(src, n, hist); }
+
+  static void countAtomic(const uint8_t *src, size_t n, int *hist)
+  {
+    int local[HIST_SIZE] = {0};
+    computeHistogram(src, n, local);
+    for (int i = 0; i < HIST_SIZE; i++)
+      __atomic_fetch_add(&hist[i], local[i], __ATOMIC_RELAXED);
+  }
+
+  static uint8_t lookupValue(long long cdf, size_t totalPixels)
+  {
+    return static_cast<uint8_t>(std::llround(static_cast<double>(cdf) * (HIST_SIZE - 1) / totalPixels));
+  }
+
+  static void buildLookupTable(const int *hist, size_t totalPixels, uint8_t *lut)
+  {
+    buildEqualizationLookupTable(hist, totalPixels, lut);
+  }
+
+  static void remap(const int *histBefore, const uint8_t *lut, int *histAfter) { remapHistogram(histBefore, lut, histAfter); }
+
+  static bool matches(const uint8_t *src, size_t n, const int *expected) { return histogramMatches(src, n, expected); }
+
+  static void apply(const uint8_t *src, uint8_t *dst, size_t n, const uint8_t *lut) { applyLookupTable(src, dst, n, lut); }
+};
+
+// Approximate histograms count one block of HIST_SAMPLE_BLOCK pixels out of every few; a block is a
+// cache line of 8-bit pixels, the least a sample can read from memory
+#define HIST_SAMPLE_BLOCK 64
+
+// Probability that a sample sized for an error budget misses it
+#define HIST_SAMPLE_CONFIDENCE 0.05
+
+// How much of an image an approximate (preview) histogram counts. The LUT built from it is
+// approximate, the remap through it is exact.
+struct HistogramSampling
+{
+  double rate = 1;        // Fraction of the pixels counted
+  double errorLevels = 0; // If set, sizes the sample of every image for this LUT error in levels instead
+
+  // Blocks per counted block for an image of count pixels and bins bins; 1 counts every pixel
+  size_t stride(size_t count, int bins) const
+  {
+    double fraction = rate;
+    if (errorLevels > 0)
+    {
+      // Dvoretzky-Kiefer-Wolfowitz: n samples keep the CDF within eps of the image's, and so the
+      // LUT within eps * (bins - 1) levels, with probability 1 - alpha once
+      // n >= ln(2 / alpha) / (2 eps^2). Neighbouring pixels are alike, so a block counts as one
+      // sample, which keeps the bound however uniform the blocks are.
+      double eps = errorLevels / (bins - 1);
+      double blocks = std::log(2 / HIST_SAMPLE_CONFIDENCE) / (2 * eps * eps);
+      fraction = blocks * HIST_SAMPLE_BLOCK / static_cast<double>(count);
+    }
+    return fraction >= 1 ? 1 : static_cast<size_t>(1 / fraction);
+  }
+};
+
+// Calls func(begin, length) for the blocks of n pixels a sample with stride counts: one block in
+// every stride blocks, at a pseudo-random position within them so the sample does not alias with
+// periodic image structure (the sequence is fixed, so every run and every MPI rank samples alike).
+// With stride 1 it is a single call for all n pixels. Returns the pixels sampled.
+template <typename Func>
+size_t forEachSampleBlock(size_t n, size_t stride, Func &&func)
+{
+  if (stride <= 1)
+  {
+    if (n > 0)
+      func(size_t(0), n);
+    return n;
+  }
+  size_t blocks = (n + HIST_SAMPLE_BLOCK - 1) / HIST_SAMPLE_BLOCK, sampled = 0;
+  uint32_t seed = 0x2545F491u;
+  for (size_t first = 0; first < blocks; first += stride)
+  {
+    seed = seed * 1664525u + 1013904223u;
+    size_t block = first + (seed >> 8) % std::min(stride, blocks - first);
+    size_t begin = block * HIST_SAMPLE_BLOCK, length = std::min<size_t>(HIST_SAMPLE_BLOCK, n - begin);
+    func(begin, length);
+    sampled += length;
+  }
+  return sampled;
+}
+
+// Scales a histogram of sampled of total pixels up to an estimate of the full one, for display
+inline void scaleSampledHistogram(int *hist, int bins, size_t sampled, size_t total)
+{
+  if (sampled == 0 || sampled == total)
+    return;
+  double scale = static_cast<double>(total) / sampled;
+  for (int i = 0; i < bins; i++)
+    hist[i] = static_cast<int>(std::llround(hist[i] * scale));
+}
+
+// Largest difference, in levels, between lut and the exact LUT of hist (of totalPixels pixels)
+template <typename Pixel, int Bins>
+int lookupTableDeviation(const int *hist, size_t totalPixels, const Pixel *lut)
+{
+  Pixel *exact = new Pixel[Bins];
+  HistogramKernels<Pixel, Bins>::buildLookupTable(hist, totalPixels, exact);
+  int deviation = 0;
+  for (int i = 0; i < Bins; i++)
+    deviation = std::max(deviation, std::abs(static_cast<int>(lut[i]) - static_cast<int>(exact[i])));
+  delete[] exact;
+  return deviation;
+}
+
+#endif
@@ -1,6 +1,14 @@
 #include <mpi.h>
 #include <cmath>
 #include "utils.hpp"
+#include "kernels.hpp"
+#include "mpi_types.hpp"
+#include "clahe.hpp"
+#include "batch.hpp"
+#include "stream.hpp"
+#include "profile.hpp"
+#include <climits>
+#include <numeric>
 
 using namespace cv;
 using namespace std;
@@ -13,44 +21,63 @@ using namespace std;
 #define AFTER_IMAGE_HISTOGRAM_COMBINED_PATH "output/mpi/after/image_histo_after_mpi.png"
 #define BEFORE_AFTER_COMBINED_PATH "output/mpi/result_mpi.png"
 #define RUNTIME_OUTPUT_PATH "output/mpi/runtime_mpi.txt"
+#define BATCH_OUTPUT_PATH "output/mpi/batch"
+#define STREAM_OUTPUT_PATH "output/mpi/after/image_after_mpi.pgm"
+#define PROFILE_OUTPUT_PATH "output/mpi/profile_mpi.json"
 
-void computeLocalHistogram(const ImageType &input, vector<int> &localHist, int startRow, int endRow)
+// Where a rank's wall time in the last global equalization went: the kernels, and everything else,
+// which is communication the rank had to wait for. Filled by every global path for the reports in main.
+struct CommTimes
 {
-    for (int i = startRow; i < endRow; i++)
-    {
-        for (int j = 0; j < input.cols(); j++)
-        {
-            int pixelValue = input.at(i, j);
-            localHist[pixelValue]++;
-        }
-    }
+    double wallMs = 0;
+    double computeMs = 0;
+    long long rows = 0; // Rows this rank counted and remapped
+};
+static CommTimes commTimes;
+
+// Runs a kernel and adds its wall time to compute (seconds)
+template <typename Func>
+void timeCompute(double &compute, Func &&kernel)
+{
+    double start = MPI_Wtime();
+    kernel();
+    compute += MPI_Wtime() - start;
 }
 
-void applyEqualization(ImageType &partImage, const vector<uchar> &eqLookupTable)
+template <typename Pixel, int Bins = HIST_SIZE>
+void computeLocalHistogram(const BasicImage<Pixel> &input, vector<int> &localHist, int startRow, int endRow)
 {
-    for (int i = 0; i < partImage.rows(); i++)
-    {
-        for (int j = 0; j < partImage.cols(); j++)
-        {
-            partImage.at(i, j) = eqLookupTable[partImage.at(i, j)];
-        }
-    }
+    if (endRow > startRow)
+        HistogramKernels<Pixel, Bins>::count(&input.at(startRow, 0), (endRow - startRow) * input.cols(), localHist.data());
+}
+
+template <typename Pixel, int Bins>
+void applyEqualization(BasicImage<Pixel> &partImage, const vector<Pixel> &eqLookupTable)
+{
+    HistogramKernels<Pixel, Bins>::apply(partImage.getData(), partImage.getData(), partImage.rows() * partImage.cols(), eqLookupTable.data());
 }
 
-void histogramEqualization(const int rank, const int size, const ImageType &image, vector<int> &histBefore, ImageType &equalizedImage, vector<int> &histAfter)
+template <typename Pixel, int Bins>
+void histogramEqualization(const int rank, const int size, const BasicImage<Pixel> &image, vector<int> &histBefore, BasicImage<Pixel> &equalizedImage, vector<int> &histAfter, bool verify, const HistogramSampling &sampling, MPI_Comm comm)
 {
+    typedef HistogramKernels<Pixel, Bins> Kernels;
+    MPI_Datatype pixelType = MpiPixelType<Pixel>::get();
+    double start = MPI_Wtime(), compute = 0;
+    histBefore.assign(Bins, 0);
+    histAfter.assign(Bins, 0);
+
     int rows = image.rows();
     int cols = image.cols();
 
     // Broadcast image size
-    MPI_Bcast(&rows, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&cols, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&rows, 1, MPI_INT, 0, comm);
+    MPI_Bcast(&cols, 1, MPI_INT, 0, comm);
 
     // Scatter the rows of the image
     int localRows = rows / size;
     int remainder = rows % size;
     int myRows = (rank < remainder) ? localRows + 1 : localRows;
-    ImageType localImage(myRows, cols);
+    BasicImage<Pixel> localImage(myRows, cols);
 
     // Scatterv setup
     vector<int> sendCounts(size), displs(size);
@@ -62,110 +89,1158 @@ void histogramEqualization(const int rank, const int size, const ImageType &imag
         offset += sendCounts[i];
     }
 
-    MPI_Scatterv(image.getData(), sendCounts.data(), displs.data(), MPI_UNSIGNED_CHAR,
-                 localImage.getData(), myRows * cols, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+    {
+        PROFILE_SCOPE(PROFILE_SCATTER);
+        MPI_Scatterv(image.getData(), sendCounts.data(), displs.data(), pixelType,
+                     localImage.getData(), myRows * cols, pixelType, 0, comm);
+    }
 
-    // Each process computes its local histogram
-    vector<int> localHist(256, 0);
-    computeLocalHistogram(localImage, localHist, 0, myRows);
+    // Each process computes its local histogram, of a sample of its stripe only for an approximate
+    // LUT; the stride follows from the whole image, so every rank samples at the same rate
+    size_t totalPixels = static_cast<size_t>(rows) * cols;
+    size_t sampleStride = sampling.stride(totalPixels, Bins), sampledPixels = totalPixels;
+    vector<int> localHist(Bins, 0);
+    {
+        PROFILE_SCOPE(PROFILE_HISTOGRAM);
+        timeCompute(compute, [&]()
+                    { forEachSampleBlock(static_cast<size_t>(myRows) * cols, sampleStride, [&](size_t begin, size_t length)
+                                         { Kernels::count(localImage.getData() + begin, length, localHist.data()); }); });
+    }
 
     // Reduce histograms to get the global histogram at rank 0
-    MPI_Reduce(localHist.data(), histBefore.data(), 256, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+    {
+        PROFILE_SCOPE(PROFILE_REDUCE);
+        MPI_Reduce(localHist.data(), histBefore.data(), Bins, MPI_INT, MPI_SUM, 0, comm);
+    }
 
     // Rank 0 computes Cumulative Distribution Function and equalization lookup table
-    vector<uint8_t> eqLookupTable(256, 0);
+    vector<Pixel> eqLookupTable(Bins, 0);
+    if (rank == 0)
+    {
+        PROFILE_SCOPE(PROFILE_LUT);
+        if (sampleStride > 1)
+            sampledPixels = accumulate(histBefore.begin(), histBefore.end(), size_t(0));
+        timeCompute(compute, [&]()
+                    { Kernels::buildLookupTable(histBefore.data(), sampledPixels, eqLookupTable.data()); });
+    }
+
+    // Broadcast the equalization lookup table to all processes
+    {
+        PROFILE_SCOPE(PROFILE_REDUCE);
+        MPI_Bcast(eqLookupTable.data(), Bins, pixelType, 0, comm);
+    }
+
+    // Apply equalization to the local part of the image
+    {
+        PROFILE_SCOPE(PROFILE_REMAP);
+        timeCompute(compute, [&]()
+                    { applyEqualization<Pixel, Bins>(localImage, eqLookupTable); });
+    }
+
+    // Gather the processed parts back to rank 0
+    if (rank == 0)
+    {
+        equalizedImage.resize(rows, cols);
+    }
+
+    {
+        PROFILE_SCOPE(PROFILE_GATHER);
+        MPI_Gatherv(localImage.getData(), myRows * cols, pixelType,
+                    equalizedImage.getData(), sendCounts.data(), displs.data(), pixelType,
+                    0, comm);
+    }
+    commTimes.wallMs = 1000 * (MPI_Wtime() - start);
+    commTimes.computeMs = 1000 * compute;
+    commTimes.rows = myRows;
+
+    // Histogram after equalization follows from the LUT, so rank 0 needs no pass over the gathered image
+    // (a sampled histogram is scaled up to an estimate of the full one first)
     if (rank == 0)
     {
-        int totalPixels = rows * cols;
-        vector<float> probDensityFunc(256, 0.0), cumulativeDistFunc(256, 0.0);
-        for (int i = 0; i < 256; i++)
         {
-            probDensityFunc[i] = (float)histBefore[i] / totalPixels;
+            PROFILE_SCOPE(PROFILE_POST_HISTOGRAM);
+            scaleSampledHistogram(histBefore.data(), Bins, sampledPixels, totalPixels);
+            Kernels::remap(histBefore.data(), eqLookupTable.data(), histAfter.data());
         }
-        cumulativeDistFunc[0] = probDensityFunc[0];
-        for (int i = 1; i < 256; i++)
+
+        if (verify)
         {
-            cumulativeDistFunc[i] = cumulativeDistFunc[i - 1] + probDensityFunc[i];
+            PROFILE_SCOPE(PROFILE_VERIFY);
+            if (sampleStride > 1)
+            {
+                // The exact histogram measures the sampled LUT, and gives the true histograms
+                histBefore.assign(Bins, 0);
+                Kernels::count(image.getData(), totalPixels, histBefore.data());
+                cout << "Sampled LUT (" << 100.0 * sampledPixels / totalPixels << "% of pixels): max deviation "
+                     << lookupTableDeviation<Pixel, Bins>(histBefore.data(), totalPixels, eqLookupTable.data()) << " level(s)" << endl;
+                Kernels::remap(histBefore.data(), eqLookupTable.data(), histAfter.data());
+            }
+            if (!Kernels::matches(equalizedImage.getData(), equalizedImage.rows() * equalizedImage.cols(), histAfter.data()))
+            {
+                cerr << "Derived histogram after equalization does not match the equalized image" << endl;
+                MPI_Abort(MPI_COMM_WORLD, -1);
+            }
         }
-        for (int i = 0; i < 256; i++)
+    }
+}
+
+// Pipelined variant of histogramEqualization: every rank's stripe is cut into blocks of rows that
+// travel as separate non-blocking collectives, so a rank counts block b while later blocks are still
+// arriving and remaps block b while earlier ones are already on their way back. The histogram is
+// Allreduced and every rank builds the LUT itself, which saves the Bcast round trip after the Reduce.
+// How much of the transfer time this hides depends on the MPI library progressing the collectives
+// in the background; the report in main shows what is left exposed.
+template <typename Pixel, int Bins>
+void pipelinedEqualization(const int rank, const int size, const BasicImage<Pixel> &image, vector<int> &histBefore, BasicImage<Pixel> &equalizedImage, vector<int> &histAfter, bool verify, int blocks, MPI_Comm comm)
+{
+    typedef HistogramKernels<Pixel, Bins> Kernels;
+    MPI_Datatype pixelType = MpiPixelType<Pixel>::get();
+    double start = MPI_Wtime(), compute = 0;
+    histBefore.assign(Bins, 0);
+    histAfter.assign(Bins, 0);
+
+    int shape[2] = {static_cast<int>(image.rows()), static_cast<int>(image.cols())};
+    MPI_Bcast(shape, 2, MPI_INT, 0, comm);
+    int rows = shape[0], cols = shape[1];
+
+    // Same stripes as the bulk path; block b of a stripe of n rows is its rows [n*b/blocks, n*(b+1)/blocks)
+    int localRows = rows / size;
+    int remainder = rows % size;
+    auto stripeRows = [&](int r)
+    { return r < remainder ? localRows + 1 : localRows; };
+    auto blockRow = [&](int stripe, int b)
+    { return static_cast<int>(static_cast<long long>(stripe) * b / blocks); };
+    int myRows = stripeRows(rank);
+    blocks = max(1, min(blocks, stripeRows(0)));
+
+    vector<vector<int>> counts(blocks, vector<int>(size)), displs(blocks, vector<int>(size));
+    for (int b = 0; b < blocks; b++)
+    {
+        for (int r = 0; r < size; r++)
         {
-            eqLookupTable[i] = static_cast<uint8_t>(round(cumulativeDistFunc[i] * 255));
+            int first = r * localRows + min(r, remainder);
+            counts[b][r] = (blockRow(stripeRows(r), b + 1) - blockRow(stripeRows(r), b)) * cols;
+            displs[b][r] = (first + blockRow(stripeRows(r), b)) * cols;
         }
     }
 
-    // Broadcast the equalization lookup table to all processes
-    MPI_Bcast(eqLookupTable.data(), 256, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+    // At least one row, so empty stripes still pass a valid buffer
+    BasicImage<Pixel> localImage(max(myRows, 1), cols);
+    auto localBlock = [&](int b)
+    { return localImage.getData() + static_cast<size_t>(blockRow(myRows, b)) * cols; };
 
-    // Apply equalization to the local part of the image
-    applyEqualization(localImage, eqLookupTable);
+    // Every block's scatter is posted up front; all ranks start the collectives in the same order
+    vector<MPI_Request> requests(blocks);
+    for (int b = 0; b < blocks; b++)
+    {
+        MPI_Iscatterv(image.getData(), counts[b].data(), displs[b].data(), pixelType,
+                      localBlock(b), counts[b][rank], pixelType, 0, comm, &requests[b]);
+    }
+
+    // Count each block as soon as it has arrived
+    vector<int> localHist(Bins, 0);
+    for (int b = 0; b < blocks; b++)
+    {
+        MPI_Wait(&requests[b], MPI_STATUS_IGNORE);
+        timeCompute(compute, [&]()
+                    { Kernels::count(localBlock(b), counts[b][rank], localHist.data()); });
+    }
+
+    MPI_Allreduce(localHist.data(), histBefore.data(), Bins, MPI_INT, MPI_SUM, comm);
+
+    vector<Pixel> eqLookupTable(Bins, 0);
+    timeCompute(compute, [&]()
+                { Kernels::buildLookupTable(histBefore.data(), static_cast<size_t>(rows) * cols, eqLookupTable.data()); });
 
-    // Gather the processed parts back to rank 0
     if (rank == 0)
     {
         equalizedImage.resize(rows, cols);
     }
 
-    MPI_Gatherv(localImage.getData(), myRows * cols, MPI_UNSIGNED_CHAR,
-                equalizedImage.getData(), sendCounts.data(), displs.data(), MPI_UNSIGNED_CHAR,
-                0, MPI_COMM_WORLD);
+    // Send each block back as soon as it is remapped
+    for (int b = 0; b < blocks; b++)
+    {
+        timeCompute(compute, [&]()
+                    { Kernels::apply(localBlock(b), localBlock(b), counts[b][rank], eqLookupTable.data()); });
+        MPI_Igatherv(localBlock(b), counts[b][rank], pixelType,
+                     equalizedImage.getData(), counts[b].data(), displs[b].data(), pixelType, 0, comm, &requests[b]);
+    }
+    MPI_Waitall(blocks, requests.data(), MPI_STATUSES_IGNORE);
+    commTimes.wallMs = 1000 * (MPI_Wtime() - start);
+    commTimes.computeMs = 1000 * compute;
+    commTimes.rows = myRows;
+
+    if (rank == 0)
+    {
+        Kernels::remap(histBefore.data(), eqLookupTable.data(), histAfter.data());
+
+        if (verify && !Kernels::matches(equalizedImage.getData(), equalizedImage.rows() * equalizedImage.cols(), histAfter.data()))
+        {
+            cerr << "Derived histogram after equalization does not match the equalized image" << endl;
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+    }
+}
+
+// Node-shared pixel windows of --shared, created once and reused by every equalization. The ranks
+// of a node map an input and an output MPI_Win_allocate_shared window owned by the node leader
+// (node rank 0) and work on their rows of them in place, so inside a node no pixel goes through
+// the MPI transport. Rank 0's windows hold the whole image: it reads the image straight into its
+// input window, and its output window is the equalized image. Other leaders' windows hold their
+// node's stripe. The windows only grow; a larger image reallocates them, collectively per node.
+template <typename Pixel>
+class SharedImageWindows
+{
+private:
+    MPI_Win inputWin;
+    MPI_Win outputWin;
+    size_t capacity; // Pixels of each window, as allocated by the node leader
+    int size;
+    bool isRoot;
+    vector<int> nodeSizes; // Leaders: ranks on every node, in leader order
+
+    void freeWindows()
+    {
+        if (inputWin == MPI_WIN_NULL)
+            return;
+        MPI_Win_unlock_all(inputWin);
+        MPI_Win_unlock_all(outputWin);
+        MPI_Win_free(&inputWin);
+        MPI_Win_free(&outputWin);
+    }
+
+public:
+    MPI_Comm nodeComm;
+    MPI_Comm leaderComm; // Node leaders only (MPI_COMM_NULL on the other ranks)
+    int nodeRank;
+    int nodeSize;
+    Pixel *input; // The node leader's windows, as this rank maps them
+    Pixel *output;
+    int rows; // Image of the next equalization, set by shape
+    int cols;
+    int nodeRows;                   // Rows of this node's stripe
+    vector<int> sendCounts, displs; // Leaders: pixels and first pixel of every node's stripe
+
+    // Groups the ranks of comm by node; collective. Ranks are keyed by their rank, so rank 0 leads
+    // its node and is rank 0 among the leaders.
+    explicit SharedImageWindows(MPI_Comm comm)
+        : inputWin(MPI_WIN_NULL), outputWin(MPI_WIN_NULL), capacity(0), input(nullptr), output(nullptr), rows(0), cols(0), nodeRows(0)
+    {
+        int rank;
+        MPI_Comm_rank(comm, &rank);
+        MPI_Comm_size(comm, &size);
+        isRoot = rank == 0;
+        MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &nodeComm);
+        MPI_Comm_rank(nodeComm, &nodeRank);
+        MPI_Comm_size(nodeComm, &nodeSize);
+        MPI_Comm_split(comm, nodeRank == 0 ? 0 : MPI_UNDEFINED, rank, &leaderComm);
+        if (leaderComm != MPI_COMM_NULL)
+        {
+            int leaders;
+            MPI_Comm_size(leaderComm, &leaders);
+            nodeSizes.resize(leaders);
+            MPI_Allgather(&nodeSize, 1, MPI_INT, nodeSizes.data(), 1, MPI_INT, leaderComm);
+        }
+    }
+
+    // Splits a rows x cols image into node stripes in proportion to the ranks on each node, and
+    // grows the windows if it does not fit; collective. Every rank passes the same shape.
+    void shape(int imageRows, int imageCols)
+    {
+        rows = imageRows;
+        cols = imageCols;
+        nodeRows = 0;
+        if (leaderComm != MPI_COMM_NULL)
+        {
+            int leaderRank;
+            MPI_Comm_rank(leaderComm, &leaderRank);
+            sendCounts.resize(nodeSizes.size());
+            displs.resize(nodeSizes.size());
+            long long ranksBefore = 0;
+            for (size_t l = 0; l < nodeSizes.size(); l++)
+            {
+                int first = static_cast<int>(rows * ranksBefore / size);
+                int last = static_cast<int>(rows * (ranksBefore + nodeSizes[l]) / size);
+                if (static_cast<int>(l) == leaderRank)
+                    nodeRows = last - first;
+                sendCounts[l] = (last - first) * cols;
+                displs[l] = first * cols;
+                ranksBefore += nodeSizes[l];
+            }
+        }
+        MPI_Bcast(&nodeRows, 1, MPI_INT, 0, nodeComm);
 
-    // Calculate histogram after equalization
+        unsigned long long needed = static_cast<unsigned long long>(isRoot ? rows : nodeRows) * cols;
+        MPI_Bcast(&needed, 1, MPI_UNSIGNED_LONG_LONG, 0, nodeComm);
+        if (needed <= capacity && inputWin != MPI_WIN_NULL)
+            return;
+
+        freeWindows();
+        capacity = static_cast<size_t>(needed);
+        MPI_Aint bytes = nodeRank == 0 ? static_cast<MPI_Aint>(max<size_t>(capacity, 1) * sizeof(Pixel)) : 0;
+        int dispUnit;
+        MPI_Win_allocate_shared(bytes, sizeof(Pixel), MPI_INFO_NULL, nodeComm, &input, &inputWin);
+        MPI_Win_allocate_shared(bytes, sizeof(Pixel), MPI_INFO_NULL, nodeComm, &output, &outputWin);
+        MPI_Win_shared_query(inputWin, 0, &bytes, &dispUnit, &input);
+        MPI_Win_shared_query(outputWin, 0, &bytes, &dispUnit, &output);
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, inputWin);
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, outputWin);
+    }
+
+    // Makes what the ranks of the node stored to the windows visible to all of them
+    void sync()
+    {
+        MPI_Win_sync(inputWin);
+        MPI_Win_sync(outputWin);
+        MPI_Barrier(nodeComm);
+        MPI_Win_sync(inputWin);
+        MPI_Win_sync(outputWin);
+    }
+
+    // Frees the windows and communicators, before MPI_Finalize; collective
+    void release()
+    {
+        freeWindows();
+        if (leaderComm != MPI_COMM_NULL)
+            MPI_Comm_free(&leaderComm);
+        MPI_Comm_free(&nodeComm);
+    }
+};
+
+// Reads the image at filename into rank 0's input window and views it as image there; collective.
+// A binary PGM with maxval 255 is read straight into the window. Any other format goes through
+// OpenCV's decoder, which allocates its own buffer, and is copied in once.
+void readSharedImage(const int rank, const string &filename, SharedImageWindows<uint8_t> &windows, ImageType &image, MPI_Comm comm)
+{
+    PgmFile pgm;
+    ImageType decoded;
+    bool direct = false;
+    int shape[2] = {0, 0};
     if (rank == 0)
     {
-        for (int i = 0; i < equalizedImage.rows(); i++)
+        try
+        {
+            pgm.openRead(filename);
+            direct = pgm.maxValue() == 255;
+        }
+        catch (const exception &)
         {
-            for (int j = 0; j < equalizedImage.cols(); j++)
+        }
+        try
+        {
+            if (!direct)
+                readImage(filename, decoded);
+        }
+        catch (const exception &)
+        {
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        shape[0] = static_cast<int>(direct ? pgm.rows() : decoded.rows());
+        shape[1] = static_cast<int>(direct ? pgm.cols() : decoded.cols());
+    }
+    MPI_Bcast(shape, 2, MPI_INT, 0, comm);
+    windows.shape(shape[0], shape[1]);
+
+    if (rank == 0)
+    {
+        size_t pixels = static_cast<size_t>(shape[0]) * shape[1];
+        try
+        {
+            if (direct)
+                pgm.readRows(0, static_cast<size_t>(shape[0]), windows.input);
+            else
+                memcpy(windows.input, decoded.getData(), pixels);
+        }
+        catch (const exception &e)
+        {
+            cerr << e.what() << endl;
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        image.assign(Mat(shape[0], shape[1], CV_8UC1, windows.input));
+    }
+}
+
+// Shared-memory variant of histogramEqualization over the image in windows (see
+// SharedImageWindows). Between nodes the leaders scatter and gather stripes sized by their rank
+// count, rank 0 in place from and into its windows; on a single node nothing is copied at all.
+// The histogram is Allreduced over all ranks and every rank builds the LUT itself. On rank 0,
+// equalizedImage is left viewing the output window.
+template <typename Pixel, int Bins>
+void sharedWindowEqualization(const int rank, const int size, SharedImageWindows<Pixel> &windows, vector<int> &histBefore, BasicImage<Pixel> &equalizedImage, vector<int> &histAfter, bool verify, MPI_Comm comm)
+{
+    typedef HistogramKernels<Pixel, Bins> Kernels;
+    MPI_Datatype pixelType = MpiPixelType<Pixel>::get();
+    double start = MPI_Wtime(), compute = 0;
+    histBefore.assign(Bins, 0);
+    histAfter.assign(Bins, 0);
+    int rows = windows.rows, cols = windows.cols, nodeRows = windows.nodeRows;
+
+    if (windows.leaderComm != MPI_COMM_NULL)
+    {
+        if (rank == 0)
+            MPI_Scatterv(windows.input, windows.sendCounts.data(), windows.displs.data(), pixelType,
+                         MPI_IN_PLACE, 0, pixelType, 0, windows.leaderComm);
+        else
+            MPI_Scatterv(nullptr, nullptr, nullptr, pixelType, windows.input, nodeRows * cols, pixelType, 0, windows.leaderComm);
+    }
+    windows.sync();
+
+    // This rank's rows of the node stripe
+    int myFirstRow = static_cast<int>(static_cast<long long>(nodeRows) * windows.nodeRank / windows.nodeSize);
+    int myRows = static_cast<int>(static_cast<long long>(nodeRows) * (windows.nodeRank + 1) / windows.nodeSize) - myFirstRow;
+    size_t myOffset = static_cast<size_t>(myFirstRow) * cols, myCount = static_cast<size_t>(myRows) * cols;
+
+    vector<int> localHist(Bins, 0);
+    timeCompute(compute, [&]()
+                { Kernels::count(windows.input + myOffset, myCount, localHist.data()); });
+    MPI_Allreduce(localHist.data(), histBefore.data(), Bins, MPI_INT, MPI_SUM, comm);
+
+    vector<Pixel> eqLookupTable(Bins, 0);
+    timeCompute(compute, [&]()
+                {
+                    Kernels::buildLookupTable(histBefore.data(), static_cast<size_t>(rows) * cols, eqLookupTable.data());
+                    Kernels::apply(windows.input + myOffset, windows.output + myOffset, myCount, eqLookupTable.data()); });
+    windows.sync();
+
+    if (windows.leaderComm != MPI_COMM_NULL)
+    {
+        if (rank == 0)
+            MPI_Gatherv(MPI_IN_PLACE, 0, pixelType, windows.output, windows.sendCounts.data(), windows.displs.data(), pixelType, 0, windows.leaderComm);
+        else
+            MPI_Gatherv(windows.output, nodeRows * cols, pixelType, nullptr, nullptr, nullptr, pixelType, 0, windows.leaderComm);
+    }
+    commTimes.wallMs = 1000 * (MPI_Wtime() - start);
+    commTimes.computeMs = 1000 * compute;
+    commTimes.rows = myRows;
+
+    if (rank == 0)
+    {
+        equalizedImage.assign(Mat(rows, cols, CV_MAKETYPE(DataType<Pixel>::depth, 1), windows.output));
+        Kernels::remap(histBefore.data(), eqLookupTable.data(), histAfter.data());
+
+        if (verify && !Kernels::matches(equalizedImage.getData(), equalizedImage.rows() * equalizedImage.cols(), histAfter.data()))
+        {
+            cerr << "Derived histogram after equalization does not match the equalized image" << endl;
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+    }
+}
+
+// Message tags of the dynamic distribution
+enum DynamicTag
+{
+    TAG_REQUEST = 1, // Worker to rank 0: send me a block
+    TAG_BLOCK,       // Rank 0 to worker: a RowBlock, then its pixels (none when the work is done)
+    TAG_RESULT       // Worker to rank 0: the remapped pixels of a block
+};
+
+// Rows [row, row + count) of the image
+struct RowBlock
+{
+    int row;
+    int count;
+};
+
+// Master/worker variant of histogramEqualization for clusters whose ranks run at different speeds.
+// Instead of fixed stripes, workers ask rank 0 for blocks of blockRows rows whenever they are done
+// with the last one (asking for the next before counting the current one, so the reply travels
+// while they count), and rank 0 counts blocks itself whenever no request is waiting. Rank 0 sends
+// the blocks with MPI_Isend, so a large block that the worker will only receive once it is done
+// counting does not hold rank 0 up in a rendezvous send. Every rank keeps its blocks, so after the
+// histogram Allreduce it remaps them and sends them back; rank 0 knows which blocks it gave to whom
+// and receives them straight into place. Output is identical to the static split.
+template <typename Pixel, int Bins>
+void dynamicEqualization(const int rank, const int size, const BasicImage<Pixel> &image, vector<int> &histBefore, BasicImage<Pixel> &equalizedImage, vector<int> &histAfter, bool verify, int blockRows, MPI_Comm comm)
+{
+    typedef HistogramKernels<Pixel, Bins> Kernels;
+    MPI_Datatype pixelType = MpiPixelType<Pixel>::get();
+    double start = MPI_Wtime(), compute = 0;
+    histBefore.assign(Bins, 0);
+    histAfter.assign(Bins, 0);
+
+    int shape[2] = {static_cast<int>(image.rows()), static_cast<int>(image.cols())};
+    MPI_Bcast(shape, 2, MPI_INT, 0, comm);
+    int rows = shape[0], cols = shape[1];
+
+    vector<int> localHist(Bins, 0);
+    long long myRows = 0;
+    int request = 0;
+
+    // Rank 0: blocks handed to every rank (its own included), in the order they were handed out
+    vector<vector<RowBlock>> assigned(rank == 0 ? size : 0);
+    // Workers: their blocks and a copy of their pixels
+    vector<RowBlock> myBlocks;
+    vector<vector<Pixel>> myPixels;
+
+    // Rank 0: the block header and pixel sends in flight to every worker; a worker's next request
+    // means it has received both, so they complete as soon as rank 0 waits on them
+    vector<RowBlock> headers(rank == 0 ? size : 0);
+    vector<MPI_Request> sends(rank == 0 ? 2 * size : 0, MPI_REQUEST_NULL);
+
+    if (rank == 0)
+    {
+        int nextRow = 0, finished = 0;
+        auto takeBlock = [&](RowBlock &block)
+        {
+            if (nextRow >= rows)
+                return false;
+            block = RowBlock{nextRow, min(blockRows, rows - nextRow)};
+            nextRow += block.count;
+            return true;
+        };
+
+        // Every worker has exactly one request outstanding until it is told there is no more work
+        while (nextRow < rows || finished < size - 1)
+        {
+            int pending = 0;
+            MPI_Status status;
+            MPI_Iprobe(MPI_ANY_SOURCE, TAG_REQUEST, comm, &pending, &status);
+            if (!pending)
+            {
+                RowBlock block;
+                if (takeBlock(block))
+                {
+                    assigned[0].push_back(block);
+                    myRows += block.count;
+                    timeCompute(compute, [&]()
+                                { Kernels::count(&image.at(block.row, 0), static_cast<size_t>(block.count) * cols, localHist.data()); });
+                    continue;
+                }
+                MPI_Probe(MPI_ANY_SOURCE, TAG_REQUEST, comm, &status);
+            }
+
+            int worker = status.MPI_SOURCE;
+            MPI_Recv(&request, 1, MPI_INT, worker, TAG_REQUEST, comm, MPI_STATUS_IGNORE);
+            MPI_Waitall(2, &sends[2 * worker], MPI_STATUSES_IGNORE);
+            RowBlock &block = headers[worker];
+            block = RowBlock{-1, 0};
+            if (takeBlock(block))
+                assigned[worker].push_back(block);
+            else
+                finished++;
+            MPI_Isend(&block, 2, MPI_INT, worker, TAG_BLOCK, comm, &sends[2 * worker]);
+            if (block.count > 0)
+                MPI_Isend(&image.at(block.row, 0), block.count * cols, pixelType, worker, TAG_BLOCK, comm, &sends[2 * worker + 1]);
+        }
+        MPI_Waitall(static_cast<int>(sends.size()), sends.data(), MPI_STATUSES_IGNORE);
+    }
+    else
+    {
+        MPI_Send(&request, 1, MPI_INT, 0, TAG_REQUEST, comm);
+        for (;;)
+        {
+            RowBlock block;
+            MPI_Recv(&block, 2, MPI_INT, 0, TAG_BLOCK, comm, MPI_STATUS_IGNORE);
+            if (block.count == 0)
+                break;
+            myBlocks.push_back(block);
+            myPixels.emplace_back(static_cast<size_t>(block.count) * cols);
+            MPI_Recv(myPixels.back().data(), block.count * cols, pixelType, 0, TAG_BLOCK, comm, MPI_STATUS_IGNORE);
+
+            MPI_Send(&request, 1, MPI_INT, 0, TAG_REQUEST, comm);
+            myRows += block.count;
+            timeCompute(compute, [&]()
+                        { Kernels::count(myPixels.back().data(), myPixels.back().size(), localHist.data()); });
+        }
+    }
+
+    MPI_Allreduce(localHist.data(), histBefore.data(), Bins, MPI_INT, MPI_SUM, comm);
+
+    vector<Pixel> eqLookupTable(Bins, 0);
+    timeCompute(compute, [&]()
+                { Kernels::buildLookupTable(histBefore.data(), static_cast<size_t>(rows) * cols, eqLookupTable.data()); });
+
+    vector<MPI_Request> requests;
+    if (rank == 0)
+    {
+        // Messages from one worker arrive in the order it sends them, which is the order it got its blocks
+        equalizedImage.resize(rows, cols);
+        for (int worker = 1; worker < size; worker++)
+        {
+            for (const RowBlock &block : assigned[worker])
             {
-                int pixelValue = equalizedImage.at(i, j);
-                histAfter[pixelValue]++;
+                requests.emplace_back();
+                MPI_Irecv(&equalizedImage.at(block.row, 0), block.count * cols, pixelType, worker, TAG_RESULT, comm, &requests.back());
             }
         }
+        timeCompute(compute, [&]()
+                    {
+                        for (const RowBlock &block : assigned[0])
+                            Kernels::apply(&image.at(block.row, 0), &equalizedImage.at(block.row, 0), static_cast<size_t>(block.count) * cols, eqLookupTable.data()); });
+    }
+    else
+    {
+        requests.resize(myBlocks.size());
+        for (size_t b = 0; b < myBlocks.size(); b++)
+        {
+            timeCompute(compute, [&]()
+                        { Kernels::apply(myPixels[b].data(), myPixels[b].data(), myPixels[b].size(), eqLookupTable.data()); });
+            MPI_Isend(myPixels[b].data(), static_cast<int>(myPixels[b].size()), pixelType, 0, TAG_RESULT, comm, &requests[b]);
+        }
+    }
+    MPI_Waitall(static_cast<int>(requests.size()), requests.data(), MPI_STATUSES_IGNORE);
+    commTimes.wallMs = 1000 * (MPI_Wtime() - start);
+    commTimes.computeMs = 1000 * compute;
+    commTimes.rows = myRows;
+
+    if (rank == 0)
+    {
+        Kernels::remap(histBefore.data(), eqLookupTable.data(), histAfter.data());
+
+        if (verify && !Kernels::matches(equalizedImage.getData(), equalizedImage.rows() * equalizedImage.cols(), histAfter.data()))
+        {
+            cerr << "Derived histogram after equalization does not match the equalized image" << endl;
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+    }
+}
+
+// Rows, kernel time and the rest of the wall time of every rank in the last global equalization
+void printRankStats(const int rank, const int size)
+{
+    double local[3] = {static_cast<double>(commTimes.rows), commTimes.computeMs, commTimes.wallMs - commTimes.computeMs};
+    vector<double> all(rank == 0 ? 3 * size : 0);
+    MPI_Gather(local, 3, MPI_DOUBLE, all.data(), 3, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    if (rank != 0)
+        return;
+
+    double maxBusy = 0, totalBusy = 0;
+    cout << "\n=== Ranks ===" << endl;
+    cout << "  rank      rows   busy ms   idle ms" << endl;
+    for (int r = 0; r < size; r++)
+    {
+        cout << setw(6) << r << setw(10) << static_cast<long long>(all[3 * r])
+             << fixed << setprecision(2) << setw(10) << all[3 * r + 1] << setw(10) << all[3 * r + 2] << endl;
+        maxBusy = max(maxBusy, all[3 * r + 1]);
+        totalBusy += all[3 * r + 1];
+    }
+    // 1.00 is a perfect balance; the slowest rank sets the pace
+    cout << "  Imbalance (max / mean busy): " << setprecision(2) << (totalBusy > 0 ? maxBusy * size / totalBusy : 1.0) << endl;
+}
+
+// MPI-IO equalization of a PGM: every rank reads and writes only its own stripe of rows, by
+// offset and in strips that fit the memory budget, so nothing but the histogram crosses the network
+// (an Allreduce, after which every rank builds the same LUT locally)
+template <typename Pixel, int Bins>
+void streamEqualization(const int rank, const int size, const string &inputPath, const PgmFile &input, const string &outputPath,
+                        size_t budgetBytes, vector<int> &histBefore, vector<int> &histAfter, MPI_Comm comm)
+{
+    typedef HistogramKernels<Pixel, Bins> Kernels;
+    size_t rows = input.rows();
+    size_t cols = input.cols();
+    size_t rowBytes = cols * sizeof(Pixel);
+    size_t firstRow = rows * rank / size;
+    size_t lastRow = rows * (rank + 1) / size;
+
+    // Strips also stay below the int byte count of one MPI-IO call. Collective calls need the same
+    // number of strips on every rank, so ranks that run out pass 0 bytes.
+    size_t chunkRows = min(streamChunkRows(budgetBytes, 1, rowBytes), max<size_t>(1, INT_MAX / max<size_t>(rowBytes, 1)));
+    unsigned long long myChunks = (lastRow - firstRow + chunkRows - 1) / chunkRows, chunks = 0;
+    MPI_Allreduce(&myChunks, &chunks, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, comm);
+    vector<Pixel> chunk(max<size_t>(1, min(chunkRows, lastRow - firstRow)) * cols);
+
+    auto stripRows = [&](unsigned long long c)
+    {
+        size_t row = firstRow + c * chunkRows;
+        return row < lastRow ? min(chunkRows, lastRow - row) : 0;
+    };
+    auto offsetOf = [&](size_t headerBytes, unsigned long long c)
+    { return static_cast<MPI_Offset>(headerBytes + (firstRow + c * chunkRows) * rowBytes); };
+
+    // Files return MPI-IO errors instead of aborting, and a short read is not an error at all, so
+    // every call and byte count is checked. A rank that fails keeps taking part in
+    // the collectives; after each step the ranks agree on failure and throw together, so none is
+    // left waiting in a collective.
+    string failure;
+    MPI_File inFile = MPI_FILE_NULL, outFile = MPI_FILE_NULL;
+    auto check = [&](bool succeeded, const string &what)
+    {
+        if (!succeeded && failure.empty())
+            failure = what;
+    };
+    auto agree = [&]()
+    {
+        int localOk = failure.empty(), allOk = 0;
+        MPI_Allreduce(&localOk, &allOk, 1, MPI_INT, MPI_MIN, comm);
+        if (allOk)
+            return;
+        if (!failure.empty())
+            cerr << "Rank " << rank << ": " << failure << endl;
+        if (inFile != MPI_FILE_NULL)
+            MPI_File_close(&inFile);
+        if (outFile != MPI_FILE_NULL)
+            MPI_File_close(&outFile);
+        throw runtime_error("Streaming equalization of " + inputPath + " failed");
+    };
+    auto transfer = [&](bool write, MPI_File file, MPI_Offset offset, Pixel *buffer, int bytes)
+    {
+        MPI_Status status;
+        int done = 0;
+        int result = write ? MPI_File_write_at_all(file, offset, buffer, bytes, MPI_BYTE, &status)
+                           : MPI_File_read_at_all(file, offset, buffer, bytes, MPI_BYTE, &status);
+        if (result == MPI_SUCCESS)
+            MPI_Get_count(&status, MPI_BYTE, &done);
+        check(result == MPI_SUCCESS && done == bytes, write ? "Could not write " + outputPath : "Could not read " + inputPath + " (truncated PGM?)");
+    };
+
+    check(MPI_File_open(comm, inputPath.c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &inFile) == MPI_SUCCESS, "Could not open " + inputPath);
+    agree();
+    // Collective buffering can report a full count for a read past the end of the file, so the
+    // size is checked up front as well
+    MPI_Offset fileBytes = 0;
+    check(MPI_File_get_size(inFile, &fileBytes) == MPI_SUCCESS && static_cast<size_t>(fileBytes) >= input.headerBytes() + rows * rowBytes,
+          inputPath + " is truncated");
+    agree();
+
+    // Pass 1: local histogram of this rank's stripe, then the global one on every rank
+    vector<int> localHist(Bins, 0);
+    for (unsigned long long c = 0; c < chunks; c++)
+    {
+        size_t count = stripRows(c);
+        transfer(false, inFile, offsetOf(input.headerBytes(), c), chunk.data(), static_cast<int>(count * rowBytes));
+        if (!failure.empty())
+            continue;
+        swapPgmSamples(chunk.data(), count * cols);
+        check(pgmSamplesInRange(chunk.data(), count * cols, input.maxValue()), inputPath + " has a sample above its maxval");
+        if (failure.empty())
+            Kernels::count(chunk.data(), count * cols, localHist.data());
+    }
+    agree();
+
+    histBefore.assign(Bins, 0);
+    MPI_Allreduce(localHist.data(), histBefore.data(), Bins, MPI_INT, MPI_SUM, comm);
+
+    vector<Pixel> eqLookupTable(Bins, 0);
+    Kernels::buildLookupTable(histBefore.data(), rows * cols, eqLookupTable.data());
+
+    // Rank 0 writes the header and sizes the output before anyone writes a stripe
+    size_t outHeaderBytes = pgmHeader(rows, cols, Bins - 1).size();
+    if (rank == 0)
+    {
+        try
+        {
+            PgmFile output;
+            output.create(outputPath, rows, cols, Bins - 1);
+        }
+        catch (const exception &e)
+        {
+            check(false, e.what());
+        }
+    }
+    agree();
+
+    check(MPI_File_open(comm, outputPath.c_str(), MPI_MODE_WRONLY, MPI_INFO_NULL, &outFile) == MPI_SUCCESS, "Could not open " + outputPath);
+    agree();
+
+    // Pass 2: remap this rank's stripe and write it in place
+    for (unsigned long long c = 0; c < chunks; c++)
+    {
+        size_t count = stripRows(c);
+        int bytes = static_cast<int>(count * rowBytes);
+        transfer(false, inFile, offsetOf(input.headerBytes(), c), chunk.data(), bytes);
+        // The input was validated in pass 1; a failed rank writes nothing but stays in the collective
+        if (failure.empty())
+        {
+            swapPgmSamples(chunk.data(), count * cols);
+            Kernels::apply(chunk.data(), chunk.data(), count * cols, eqLookupTable.data());
+            swapPgmSamples(chunk.data(), count * cols);
+        }
+        transfer(true, outFile, offsetOf(outHeaderBytes, c), chunk.data(), failure.empty() ? bytes : 0);
+    }
+    agree();
+
+    check(MPI_File_close(&inFile) == MPI_SUCCESS, "Could not close " + inputPath);
+    check(MPI_File_close(&outFile) == MPI_SUCCESS, "Could not close " + outputPath);
+    agree();
+
+    histAfter.assign(Bins, 0);
+    Kernels::remap(histBefore.data(), eqLookupTable.data(), histAfter.data());
+}
+
+// Streams input with the pixel type and bin count its maxval calls for
+double streamingEqualization(const int rank, const int size, const string &inputPath, const PgmFile &input, const string &outputPath,
+                             size_t budgetBytes, vector<int> &histBefore, vector<int> &histAfter)
+{
+    if (input.maxValue() < 256)
+        return measureRuntime(RUNTIME_OUTPUT_PATH, streamEqualization<uint8_t, HIST_SIZE>, rank, size, inputPath, input, outputPath, budgetBytes, histBefore, histAfter, MPI_COMM_WORLD);
+    if (input.maxValue() < 1 << 10)
+        return measureRuntime(RUNTIME_OUTPUT_PATH, streamEqualization<uint16_t, 1 << 10>, rank, size, inputPath, input, outputPath, budgetBytes, histBefore, histAfter, MPI_COMM_WORLD);
+    if (input.maxValue() < 1 << 12)
+        return measureRuntime(RUNTIME_OUTPUT_PATH, streamEqualization<uint16_t, 1 << 12>, rank, size, inputPath, input, outputPath, budgetBytes, histBefore, histAfter, MPI_COMM_WORLD);
+    return measureRuntime(RUNTIME_OUTPUT_PATH, streamEqualization<uint16_t, 1 << 16>, rank, size, inputPath, input, outputPath, budgetBytes, histBefore, histAfter, MPI_COMM_WORLD);
+}
+
+// Global equalization of a 10/12/16-bit image with 2^bits bins
+double highBitDepthEqualization(int bits, const int rank, const int size, const ImageType16 &image, vector<int> &histBefore, ImageType16 &equalizedImage, vector<int> &histAfter, bool verify, const HistogramSampling &sampling)
+{
+    switch (bits)
+    {
+    case 10:
+        return measureRuntime(RUNTIME_OUTPUT_PATH, histogramEqualization<uint16_t, 1 << 10>, rank, size, image, histBefore, equalizedImage, histAfter, verify, sampling, MPI_COMM_WORLD);
+    case 12:
+        return measureRuntime(RUNTIME_OUTPUT_PATH, histogramEqualization<uint16_t, 1 << 12>, rank, size, image, histBefore, equalizedImage, histAfter, verify, sampling, MPI_COMM_WORLD);
+    default:
+        return measureRuntime(RUNTIME_OUTPUT_PATH, histogramEqualization<uint16_t, 1 << 16>, rank, size, image, histBefore, equalizedImage, histAfter, verify, sampling, MPI_COMM_WORLD);
+    }
+}
+
+void colorEqualization(const int rank, const int size, const ImageType &image, vector<int> &histBefore, ImageType &equalizedImage, vector<int> &histAfter, MPI_Comm comm)
+{
+    int rows = image.rows();
+    int cols = image.cols();
+
+    // Broadcast image size
+    MPI_Bcast(&rows, 1, MPI_INT, 0, comm);
+    MPI_Bcast(&cols, 1, MPI_INT, 0, comm);
+
+    // Scatter rows of interleaved BGR pixels
+    int localRows = rows / size;
+    int remainder = rows % size;
+    int myRows = (rank < remainder) ? localRows + 1 : localRows;
+    ImageType localImage(myRows, cols, 3);
+
+    vector<int> sendCounts(size), displs(size);
+    int offset = 0;
+    for (int i = 0; i < size; i++)
+    {
+        sendCounts[i] = ((i < remainder) ? localRows + 1 : localRows) * cols * 3;
+        displs[i] = offset;
+        offset += sendCounts[i];
+    }
+
+    MPI_Scatterv(image.getData(), sendCounts.data(), displs.data(), MPI_UNSIGNED_CHAR,
+                 localImage.getData(), sendCounts[rank], MPI_UNSIGNED_CHAR, 0, comm);
+
+    // Pass 1: local luminance histogram, converted from BGR on the fly
+    vector<int> localHist(HIST_SIZE, 0);
+    computeLumaHistogram(localImage.getData(), static_cast<size_t>(myRows) * cols, localHist.data());
+    MPI_Reduce(localHist.data(), histBefore.data(), HIST_SIZE, MPI_INT, MPI_SUM, 0, comm);
+
+    vector<uint8_t> eqLookupTable(HIST_SIZE, 0);
+    if (rank == 0)
+    {
+        buildEqualizationLookupTable(histBefore.data(), static_cast<size_t>(rows) * cols, eqLookupTable.data());
+    }
+    MPI_Bcast(eqLookupTable.data(), HIST_SIZE, MPI_UNSIGNED_CHAR, 0, comm);
+
+    // Pass 2: equalize the luminance in place and rebuild BGR with the chroma unchanged
+    vector<int> localHistAfter(HIST_SIZE, 0);
+    applyLumaLookupTable(localImage.getData(), localImage.getData(), static_cast<size_t>(myRows) * cols, eqLookupTable.data(), localHistAfter.data());
+    MPI_Reduce(localHistAfter.data(), histAfter.data(), HIST_SIZE, MPI_INT, MPI_SUM, 0, comm);
+
+    if (rank == 0)
+    {
+        equalizedImage.resize(rows, cols, 3);
+    }
+
+    MPI_Gatherv(localImage.getData(), sendCounts[rank], MPI_UNSIGNED_CHAR,
+                equalizedImage.getData(), sendCounts.data(), displs.data(), MPI_UNSIGNED_CHAR,
+                0, comm);
+}
+
+void claheEqualization(const int rank, const int size, const ImageType &image, vector<int> &histBefore, ImageType &equalizedImage, vector<int> &histAfter, ClaheParams params, MPI_Comm comm)
+{
+    int rows = image.rows();
+    int cols = image.cols();
+
+    // Broadcast image size
+    MPI_Bcast(&rows, 1, MPI_INT, 0, comm);
+    MPI_Bcast(&cols, 1, MPI_INT, 0, comm);
+    fitClaheParams(params, rows, cols);
+
+    // Each rank owns a stripe of whole tile rows; ranks beyond the number of tile rows stay idle
+    int activeRanks = min(size, params.tilesY);
+    auto tileRowBegin = [&](int r)
+    { return r < activeRanks ? params.tilesY * r / activeRanks : params.tilesY; };
+
+    vector<int> sendCounts(size), displs(size);
+    for (int i = 0; i < size; i++)
+    {
+        size_t firstRow = claheTileBegin(rows, params.tilesY, tileRowBegin(i));
+        size_t lastRow = claheTileBegin(rows, params.tilesY, i < activeRanks ? tileRowBegin(i + 1) : params.tilesY);
+        sendCounts[i] = (lastRow - firstRow) * cols;
+        displs[i] = firstRow * cols;
+    }
+
+    int myTileBegin = tileRowBegin(rank);
+    int myTileEnd = rank < activeRanks ? tileRowBegin(rank + 1) : params.tilesY;
+    size_t rowOffset = claheTileBegin(rows, params.tilesY, myTileBegin);
+    int myRows = sendCounts[rank] / max(cols, 1);
+    ImageType localImage(myRows, cols), localOutput(myRows, cols);
+
+    MPI_Scatterv(image.getData(), sendCounts.data(), displs.data(), MPI_UNSIGNED_CHAR,
+                 localImage.getData(), sendCounts[rank], MPI_UNSIGNED_CHAR, 0, comm);
+
+    // LUTs of the tiles in this stripe
+    vector<uint8_t> luts(static_cast<size_t>(params.tilesY) * params.tilesX * HIST_SIZE);
+    for (int ty = myTileBegin; ty < myTileEnd; ty++)
+    {
+        for (int tx = 0; tx < params.tilesX; tx++)
+        {
+            computeClaheTile(localImage, rowOffset, rows, params, ty, tx, luts);
+        }
+    }
+
+    // Halo exchange: rows near a stripe edge blend with the neighbouring stripe's edge tile row
+    int tileRowSize = params.tilesX * HIST_SIZE;
+    bool active = rank < activeRanks;
+    int prev = active && rank > 0 ? rank - 1 : MPI_PROC_NULL;
+    int next = active && rank + 1 < activeRanks ? rank + 1 : MPI_PROC_NULL;
+    int prevCount = prev != MPI_PROC_NULL ? tileRowSize : 0;
+    int nextCount = next != MPI_PROC_NULL ? tileRowSize : 0;
+    uint8_t *firstTileRow = prevCount ? &luts[static_cast<size_t>(myTileBegin) * tileRowSize] : nullptr;
+    uint8_t *lastTileRow = nextCount ? &luts[static_cast<size_t>(myTileEnd - 1) * tileRowSize] : nullptr;
+    uint8_t *prevHalo = prevCount ? &luts[static_cast<size_t>(myTileBegin - 1) * tileRowSize] : nullptr;
+    uint8_t *nextHalo = nextCount ? &luts[static_cast<size_t>(myTileEnd) * tileRowSize] : nullptr;
+
+    MPI_Sendrecv(firstTileRow, prevCount, MPI_UNSIGNED_CHAR, prev, 0,
+                 nextHalo, nextCount, MPI_UNSIGNED_CHAR, next, 0, comm, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(lastTileRow, nextCount, MPI_UNSIGNED_CHAR, next, 1,
+                 prevHalo, prevCount, MPI_UNSIGNED_CHAR, prev, 1, comm, MPI_STATUS_IGNORE);
+
+    ClaheAxis xAxis, yAxis;
+    buildClaheAxis(cols, params.tilesX, xAxis);
+    buildClaheAxis(rows, params.tilesY, yAxis);
+    interpolateClaheRows(localImage, localOutput, 0, myRows, rowOffset, xAxis, yAxis, params, luts);
+
+    // Histograms before and after, reduced together
+    vector<int> localHist(2 * HIST_SIZE, 0), globalHist(2 * HIST_SIZE, 0);
+    computeLocalHistogram(localImage, localHist, 0, myRows);
+    if (myRows > 0)
+        computeHistogram(localOutput.getData(), localOutput.rows() * localOutput.cols(), localHist.data() + HIST_SIZE);
+    MPI_Reduce(localHist.data(), globalHist.data(), 2 * HIST_SIZE, MPI_INT, MPI_SUM, 0, comm);
+
+    if (rank == 0)
+    {
+        equalizedImage.resize(rows, cols);
+        histBefore.assign(globalHist.begin(), globalHist.begin() + HIST_SIZE);
+        histAfter.assign(globalHist.begin() + HIST_SIZE, globalHist.end());
+    }
+
+    MPI_Gatherv(localOutput.getData(), sendCounts[rank], MPI_UNSIGNED_CHAR,
+                equalizedImage.getData(), sendCounts.data(), displs.data(), MPI_UNSIGNED_CHAR,
+                0, comm);
+}
+
+// Totals over all ranks at rank 0: counts, busy times and threads add up, the wall time is the slowest rank's
+void reduceBatchStats(const int rank, BatchStats &stats)
+{
+    double local[8] = {static_cast<double>(stats.images), static_cast<double>(stats.failures),
+                       stats.decodeBusyMs, stats.equalizeBusyMs, stats.encodeBusyMs,
+                       static_cast<double>(stats.decodeThreads), static_cast<double>(stats.equalizeThreads),
+                       static_cast<double>(stats.encodeThreads)};
+    double total[8];
+    double wallMs;
+    MPI_Reduce(local, total, 8, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&stats.wallMs, &wallMs, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+    if (rank == 0)
+    {
+        stats.images = static_cast<size_t>(total[0]);
+        stats.failures = static_cast<size_t>(total[1]);
+        stats.decodeBusyMs = total[2];
+        stats.equalizeBusyMs = total[3];
+        stats.encodeBusyMs = total[4];
+        stats.decodeThreads = static_cast<int>(total[5]);
+        stats.equalizeThreads = static_cast<int>(total[6]);
+        stats.encodeThreads = static_cast<int>(total[7]);
+        stats.wallMs = wallMs;
     }
 }
 
 int main(int argc, char **argv)
 {
-    int rank, size;
-    MPI_Init(&argc, &argv);
+    // Batch mode keeps decode/encode threads next to the thread that makes every MPI call
+    int rank, size, provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
+    if (provided < MPI_THREAD_FUNNELED)
+    {
+        if (rank == 0)
+            cerr << "The MPI library does not support MPI_THREAD_FUNNELED" << endl;
+        MPI_Finalize();
+        return -1;
+    }
 
-    if (argc != 2 && argc != 3)
+    // Sequence mode is left to seq and omp: every frame's LUT depends on the frames before it, and a
+    // single video frame is too small to be worth scattering
+    ProgramOptions options;
+    if (!parseOptions(argc, argv, options) || !options.sequence.empty() || hasAutoOnlyOptions(options))
     {
         if (rank == 0)
         {
-            cout << "Usage: mpirun -np <num_processes> ./mpi [--quiet|-q] <image_path>" << endl;
+            cout << "Usage: mpirun -np <num_processes> ./mpi [--quiet|-q] [--verify] [--no-artifacts] [--png-compression <0-9>] [--timings <path>] [--rank-stats] [--profile|--perf-counters] [--sample <rate> | --sample-error <levels>] [--bits <n> | --pipeline <blocks> | --shared | --dynamic <rows> | --color | --clahe [--tiles <cols>x<rows>] [--clip-limit <value>]] <image_path> | --batch <dir|list> [--batch-out <dir>] [--io-threads <n>] | --stream [--memory-budget <MB>] <pgm_path>" << endl;
         }
         MPI_Finalize();
         return -1;
     }
-    string filename = argv[1];
-    bool quiet = false;
-    if (argc == 3)
+    string filename = options.filename;
+    bool quiet = options.quiet;
+    HistogramSampling sampling{options.sampleRate, options.sampleError};
+    // Every rank counts its own phases; the report reduces them over the ranks
+    if (options.perfCounters && !enableProfileCounters() && rank == 0)
+        cerr << "Hardware counters are unavailable (see /proc/sys/kernel/perf_event_paranoid); reporting times only" << endl;
+
+    if (options.stream)
     {
+        // Every rank parses the header itself (MPI-IO needs the file on a shared filesystem anyway)
+        PgmFile input;
+        try
+        {
+            input.openRead(filename);
+        }
+        catch (const std::exception &e)
+        {
+            cerr << e.what() << endl;
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+
+        // streamEqualization fails on every rank together, so they can all finish cleanly
+        vector<int> histBefore, histAfter;
+        double duration;
+        try
+        {
+            duration = streamingEqualization(rank, size, filename, input, STREAM_OUTPUT_PATH, options.memoryBudgetMB << 20, histBefore, histAfter);
+        }
+        catch (const std::exception &e)
+        {
+            if (rank == 0)
+                cerr << e.what() << endl;
+            MPI_Finalize();
+            return -1;
+        }
+
         if (rank == 0)
         {
-            if (string(argv[1]) == "--quiet" || string(argv[1]) == "-q")
+            if (!options.noArtifacts)
             {
-                quiet = true;
-                filename = argv[2];
+                ImageWriter writer(options.pngCompression);
+                outputHistogram(histBefore, BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram BEFORE Equalization", quiet, writer);
+                outputHistogram(histAfter, AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram AFTER Equalization", quiet, writer);
+                writer.wait();
             }
-            else
+
+            if (!quiet)
+                cout << "\nSaved " << STREAM_OUTPUT_PATH << " successfully." << endl;
+
+            cout << "Runtime: " << duration << " ms" << endl;
+        }
+
+        MPI_Finalize();
+        return 0;
+    }
+
+    if (!options.batch.empty())
+    {
+        vector<string> files, myFiles;
+        if (!listBatchInputs(options.batch, files))
+        {
+            if (rank == 0)
+                cerr << "Could not open batch input: " << options.batch << endl;
+            MPI_Finalize();
+            return -1;
+        }
+
+        // Every rank takes every size-th file and equalizes its images on its own
+        for (size_t i = rank; i < files.size(); i += size)
+            myFiles.push_back(files[i]);
+
+        ClaheParams params{options.tilesX, options.tilesY, options.clipLimit};
+        BatchStats stats = runBatch(
+            myFiles, options.batchOutput.empty() ? BATCH_OUTPUT_PATH : options.batchOutput, options.ioThreads, options.color, options.pngCompression,
+            [&](const ImageType &input, ImageType &output)
+            {
+                vector<int> histBefore(HIST_SIZE, 0), histAfter(HIST_SIZE, 0);
+                if (input.channels() == 3)
+                    colorEqualization(0, 1, input, histBefore, output, histAfter, MPI_COMM_SELF);
+                else if (options.clahe)
+                    claheEqualization(0, 1, input, histBefore, output, histAfter, params, MPI_COMM_SELF);
+                else
+                    histogramEqualization<uint8_t, HIST_SIZE>(0, 1, input, histBefore, output, histAfter, options.verify, sampling, MPI_COMM_SELF);
+            });
+
+        reduceBatchStats(rank, stats);
+        if (rank == 0)
+            printBatchStats(stats);
+        if (options.profile)
+            reportProfile(rank, size, MPI_COMM_WORLD, PROFILE_OUTPUT_PATH);
+
+        MPI_Finalize();
+        return 0;
+    }
+
+    if (options.bits > 8)
+    {
+        ImageType16 image16, equalized16;
+        if (rank == 0)
+        {
+            try
+            {
+                readImage(filename, image16, options.bits);
+            }
+            catch (const std::exception &e)
             {
-                cout << "Usage: mpirun -np <num_processes> ./mpi [--quiet|-q] <image_path>" << endl;
-                MPI_Finalize();
-                return -1;
+                MPI_Abort(MPI_COMM_WORLD, -1);
+                throw e;
             }
         }
+
+        vector<int> histBefore, histAfter;
+        double duration = highBitDepthEqualization(options.bits, rank, size, image16, histBefore, equalized16, histAfter, options.verify, sampling);
+
+        if (rank == 0)
+        {
+            // Full-depth images are written as 16-bit PNGs; the combined previews are scaled to 8 bits
+            ImageWriter writer(options.pngCompression);
+            writer.write(AFTER_IMAGE_OUTPUT_PATH, equalized16);
+            if (!options.noArtifacts)
+            {
+                writer.write(BEFORE_IMAGE_OUTPUT_PATH, image16);
+                Mat plotBefore = outputHistogram(histBefore, BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram BEFORE Equalization", quiet, writer);
+                Mat plotAfter = outputHistogram(histAfter, AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram AFTER Equalization", quiet, writer);
+
+                ImageType displayBefore, displayAfter;
+                toDisplayImage(image16, options.bits, displayBefore);
+                toDisplayImage(equalized16, options.bits, displayAfter);
+                generateCombinedOutputs(
+                    displayBefore,
+                    displayAfter,
+                    plotBefore,
+                    plotAfter,
+                    BEFORE_IMAGE_HISTOGRAM_COMBINED_PATH,
+                    AFTER_IMAGE_HISTOGRAM_COMBINED_PATH,
+                    BEFORE_AFTER_COMBINED_PATH,
+                    writer);
+            }
+            writer.wait();
+
+            cout << "Runtime: " << duration << " ms" << endl;
+            if (!options.timingsPath.empty())
+                appendTiming(options.timingsPath, "mpi", size, image16.rows(), image16.cols(), duration);
+        }
+        if (options.profile)
+            reportProfile(rank, size, MPI_COMM_WORLD, PROFILE_OUTPUT_PATH);
+
+        MPI_Finalize();
+        return 0;
     }
 
+    // --shared reads the image into node-shared windows that later equalizations could reuse
     ImageType image;
-    int rows = 0, cols = 0;
-    if (rank == 0)
+    int channels = 1;
+    unique_ptr<SharedImageWindows<uint8_t>> windows;
+    if (options.sharedWindow)
+    {
+        windows.reset(new SharedImageWindows<uint8_t>(MPI_COMM_WORLD));
+        readSharedImage(rank, filename, *windows, image, MPI_COMM_WORLD);
+    }
+    else if (rank == 0)
     {
         try
         {
-            readImage(filename, image);
+            readImage(filename, image, options.color);
+            channels = image.channels();
         }
         catch (const std::exception &e)
         {
@@ -173,38 +1248,90 @@ int main(int argc, char **argv)
             throw e;
         }
     }
+    MPI_Bcast(&channels, 1, MPI_INT, 0, MPI_COMM_WORLD);
 
     ImageType equalizedImage;
     vector<int> histBefore(256, 0);
     vector<int> histAfter(256, 0);
 
-    double duration = measureRuntime(
-        RUNTIME_OUTPUT_PATH,
-        histogramEqualization, rank, size, image, histBefore, equalizedImage, histAfter);
+    double duration;
+    double exposedComm[2] = {0, 0}; // Slowest rank's exposed communication and wall time, global equalization only
+    if (channels == 3)
+    {
+        duration = measureRuntime(
+            RUNTIME_OUTPUT_PATH,
+            colorEqualization, rank, size, image, histBefore, equalizedImage, histAfter, MPI_COMM_WORLD);
+    }
+    else if (options.clahe)
+    {
+        ClaheParams params{options.tilesX, options.tilesY, options.clipLimit};
+        duration = measureRuntime(
+            RUNTIME_OUTPUT_PATH,
+            claheEqualization, rank, size, image, histBefore, equalizedImage, histAfter, params, MPI_COMM_WORLD);
+    }
+    else
+    {
+        if (options.sharedWindow)
+            duration = measureRuntime(
+                RUNTIME_OUTPUT_PATH,
+                sharedWindowEqualization<uint8_t, HIST_SIZE>, rank, size, *windows, histBefore, equalizedImage, histAfter, options.verify, MPI_COMM_WORLD);
+        else if (options.dynamicRows > 0)
+            duration = measureRuntime(
+                RUNTIME_OUTPUT_PATH,
+                dynamicEqualization<uint8_t, HIST_SIZE>, rank, size, image, histBefore, equalizedImage, histAfter, options.verify, options.dynamicRows, MPI_COMM_WORLD);
+        else if (options.pipelineBlocks > 0)
+            duration = measureRuntime(
+                RUNTIME_OUTPUT_PATH,
+                pipelinedEqualization<uint8_t, HIST_SIZE>, rank, size, image, histBefore, equalizedImage, histAfter, options.verify, options.pipelineBlocks, MPI_COMM_WORLD);
+        else
+            duration = measureRuntime(
+                RUNTIME_OUTPUT_PATH,
+                histogramEqualization<uint8_t, HIST_SIZE>, rank, size, image, histBefore, equalizedImage, histAfter, options.verify, sampling, MPI_COMM_WORLD);
+
+        double local[2] = {commTimes.wallMs - commTimes.computeMs, commTimes.wallMs};
+        MPI_Reduce(local, exposedComm, 2, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+        if (options.rankStats)
+            printRankStats(rank, size);
+    }
 
     if (rank == 0)
     {
-        writeImage(BEFORE_IMAGE_OUTPUT_PATH, image);
-        writeImage(AFTER_IMAGE_OUTPUT_PATH, equalizedImage);
-
-        outputHistogram(histBefore, BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram BEFORE Equalization", quiet);
-        outputHistogram(histAfter, AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram AFTER Equalization", quiet);
+        // Every output is encoded on its own thread; the histogram plots go to the composites in memory
+        ImageWriter writer(options.pngCompression);
+        writer.write(AFTER_IMAGE_OUTPUT_PATH, equalizedImage);
+        if (!options.noArtifacts)
+        {
+            writer.write(BEFORE_IMAGE_OUTPUT_PATH, image);
+            Mat plotBefore = outputHistogram(histBefore, BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram BEFORE Equalization", quiet, writer);
+            Mat plotAfter = outputHistogram(histAfter, AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram AFTER Equalization", quiet, writer);
 
-        generateCombinedOutputs(
-            image,
-            equalizedImage,
-            BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH,
-            AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH,
-            BEFORE_IMAGE_HISTOGRAM_COMBINED_PATH,
-            AFTER_IMAGE_HISTOGRAM_COMBINED_PATH,
-            BEFORE_AFTER_COMBINED_PATH);
+            generateCombinedOutputs(
+                image,
+                equalizedImage,
+                plotBefore,
+                plotAfter,
+                BEFORE_IMAGE_HISTOGRAM_COMBINED_PATH,
+                AFTER_IMAGE_HISTOGRAM_COMBINED_PATH,
+                BEFORE_AFTER_COMBINED_PATH,
+                writer);
+        }
+        writer.wait();
 
-        if (!quiet)
+        if (!quiet && !options.noArtifacts)
             cout << "\nSaved " << BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH << " and " << AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH << " successfully." << endl;
 
         cout << "Runtime: " << duration << " ms" << endl;
+        if (!options.timingsPath.empty())
+            appendTiming(options.timingsPath, "mpi", size, image.rows(), image.cols(), duration);
+        if (channels == 1 && !options.clahe)
+            cout << "Communication: " << exposedComm[0] << " ms exposed of " << exposedComm[1] << " ms (slowest rank)" << endl;
     }
+    if (options.profile)
+        reportProfile(rank, size, MPI_COMM_WORLD, PROFILE_OUTPUT_PATH);
 
+    // The images of rank 0 view the windows, and every output has been written
+    if (windows)
+        windows->release();
     MPI_Finalize();
     return 0;
 }
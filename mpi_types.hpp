@@ -0,0 +1,23 @@
+#include <mpi.h>
+#include <cstdint>
+
+#ifndef MPI_TYPES_HPP
+#define MPI_TYPES_HPP
+
+// MPI datatype of one pixel, shared by the MPI and the hybrid MPI + OpenMP engines
+template <typename Pixel>
+struct MpiPixelType;
+
+template <>
+struct MpiPixelType<uint8_t>
+{
+  static MPI_Datatype get() { return MPI_UNSIGNED_CHAR; }
+};
+
+template <>
+struct MpiPixelType<uint16_t>
+{
+  static MPI_Datatype get() { return MPI_UNSIGNED_SHORT; }
+};
+
+#endif
@@ -1,6 +1,15 @@
 #include <omp.h>
 #include "utils.hpp"
+#include "kernels.hpp"
+#include "omp_kernels.hpp"
+#include "clahe.hpp"
+#include "batch.hpp"
+#include "stream.hpp"
+#include "profile.hpp"
+#include "tiles.hpp"
 #include <cmath>
+#include <exception>
+#include <numeric>
 
 using namespace cv;
 using namespace std;
@@ -13,150 +22,480 @@ using namespace std;
 #define AFTER_IMAGE_HISTOGRAM_COMBINED_PATH "output/omp/after/image_histo_after_omp.png"
 #define BEFORE_AFTER_COMBINED_PATH "output/omp/result_omp.png"
 #define RUNTIME_OUTPUT_PATH "output/omp/runtime_omp.txt"
+#define BATCH_OUTPUT_PATH "output/omp/batch"
+#define SEQUENCE_OUTPUT_PATH "output/omp/sequence"
+#define STREAM_OUTPUT_PATH "output/omp/after/image_after_omp.pgm"
+#define PROFILE_OUTPUT_PATH "output/omp/profile_omp.json"
 
-void histogramEqualization(const ImageType &input, ImageType &output, vector<int> &histBefore, vector<int> &histAfter)
+template <typename Pixel, int Bins>
+void histogramEqualization(const BasicImage<Pixel> &input, BasicImage<Pixel> &output, vector<int> &histBefore, vector<int> &histAfter, bool verify, const HistogramSampling &sampling)
 {
-    int histSize = 256;
-    histBefore.assign(histSize, 0);
-    histAfter.assign(histSize, 0);
+    typedef HistogramKernels<Pixel, Bins> Kernels;
+    histBefore.assign(Bins, 0);
+    histAfter.assign(Bins, 0);
 
-// Parallel histogram calculation using per-thread local histograms + reduction
+    size_t totalPixels = input.rows() * input.cols();
+    size_t sampleStride = sampling.stride(totalPixels, Bins), sampledPixels = totalPixels;
+    output.resize(input.rows(), input.cols());
+
+    vector<Pixel> eqLookupTable(Bins, 0);
+    OmpEqualizationState<Pixel, Bins> state;
+
+    // Remap tiles for every thread, and with verify one histogram per thread of the tiles it remapped
+    int maxThreads = omp_get_max_threads();
+    TileScheduler tiles(totalPixels, defaultTileItems<Pixel>(), maxThreads);
+    vector<int> countedHists(verify ? static_cast<size_t>(maxThreads) * Bins : 0, 0);
+
+// One parallel region for the whole pipeline; the phases are separated by the
+// barriers at the end of each of them
 #pragma omp parallel
     {
-        vector<int> localHist(histSize, 0);
-
-#pragma omp for nowait collapse(2)
-        for (int i = 0; i < input.rows(); i++)
         {
-            for (int j = 0; j < input.cols(); j++)
+            PROFILE_SCOPE_IF(PROFILE_HISTOGRAM, omp_get_thread_num() == 0);
+            // Only a sample of the pixels for an approximate LUT
+            ompCountHistogram(input.getData(), totalPixels, state, histBefore.data(), sampleStride);
+            if (sampleStride > 1)
             {
-                int pixelValue = input.at(i, j);
-                localHist[pixelValue]++;
+#pragma omp single
+                sampledPixels = accumulate(histBefore.begin(), histBefore.end(), size_t(0));
             }
         }
+        {
+            PROFILE_SCOPE_IF(PROFILE_LUT, omp_get_thread_num() == 0);
+            ompBuildLookupTable(histBefore.data(), sampledPixels, state, eqLookupTable.data());
+        }
 
-// Reduce local histograms into the global histogram
-#pragma omp critical
+        // Histogram after equalization follows from the LUT: every pixel of value i became eqLookupTable[i]
+        // (a sampled histogram is scaled up to an estimate of the full one first)
+#pragma omp single nowait
         {
-            for (int i = 0; i < histSize; i++)
-            {
-                histBefore[i] += localHist[i];
-            }
+            PROFILE_SCOPE(PROFILE_POST_HISTOGRAM);
+            scaleSampledHistogram(histBefore.data(), Bins, sampledPixels, totalPixels);
+            Kernels::remap(histBefore.data(), eqLookupTable.data(), histAfter.data());
+        }
+
+        // Use Lookup Table to equalize the image: threads take cache-sized tiles and steal from
+        // each other when they run out, and with verify count each tile while it is still in cache
+        {
+            PROFILE_SCOPE_IF(PROFILE_REMAP, omp_get_thread_num() == 0);
+            int t = omp_get_thread_num();
+            remapTiles<Pixel, Bins>(tiles, t, input.getData(), output.getData(), eqLookupTable.data(),
+                                    verify ? &countedHists[static_cast<size_t>(t) * Bins] : nullptr);
+#pragma omp barrier
         }
     }
 
-    // Probability Density Function
-    vector<float> probDensityFunc(histSize, 0.0);
-    int totalPixels = input.rows() * input.cols();
-#pragma omp parallel for
-    for (int i = 0; i < histSize; i++)
+    if (verify)
     {
-        probDensityFunc[i] = (float)histBefore[i] / totalPixels;
+        PROFILE_SCOPE(PROFILE_VERIFY);
+        for (int t = 1; t < maxThreads; t++)
+            for (int v = 0; v < Bins; v++)
+                countedHists[v] += countedHists[static_cast<size_t>(t) * Bins + v];
+        if (sampleStride > 1)
+        {
+            // The exact histogram measures the sampled LUT, and gives the true histograms
+#pragma omp parallel
+            ompCountHistogram(input.getData(), totalPixels, state, histBefore.data());
+            cout << "Sampled LUT (" << 100.0 * sampledPixels / totalPixels << "% of pixels): max deviation "
+                 << lookupTableDeviation<Pixel, Bins>(histBefore.data(), totalPixels, eqLookupTable.data()) << " level(s)" << endl;
+            Kernels::remap(histBefore.data(), eqLookupTable.data(), histAfter.data());
+        }
+        if (!equal(histAfter.begin(), histAfter.end(), countedHists.begin()))
+            throw runtime_error("Derived histogram after equalization does not match the equalized image");
     }
+}
+
+// Out-of-core global equalization of a PGM: pass 1 builds the histogram strip by strip, pass 2
+// remaps every strip through the LUT and writes it to outputPath. Threads take strips dynamically
+// (read times vary) and each one holds a single strip and a private histogram, so the budget left
+// after the histograms is split between the strips.
+template <typename Pixel, int Bins>
+void streamEqualization(const PgmFile &input, const string &outputPath, size_t budgetBytes, vector<int> &histBefore, vector<int> &histAfter)
+{
+    typedef HistogramKernels<Pixel, Bins> Kernels;
+    size_t rows = input.rows();
+    size_t cols = input.cols();
+    int threads = omp_get_max_threads();
+    size_t histBytes = static_cast<size_t>(threads) * Bins * sizeof(int);
+    size_t chunkRows = streamChunkRows(budgetBytes > histBytes ? budgetBytes - histBytes : 0, threads, cols * sizeof(Pixel));
+    long long chunks = static_cast<long long>((rows + chunkRows - 1) / chunkRows);
+
+    histBefore.assign(Bins, 0);
+    vector<Pixel> eqLookupTable(Bins, 0);
+    PgmFile output;
+    output.create(outputPath, rows, cols, Bins - 1);
+
+    // An exception must not leave a worksharing loop (the runtime would terminate the program), so
+    // the first one is kept, the remaining strips are skipped and it is rethrown after the region
+    exception_ptr error;
+    int failed = 0;
+    auto fail = [&]()
+    {
+#pragma omp critical(streamError)
+        if (!error)
+            error = current_exception();
+#pragma omp atomic write
+        failed = 1;
+    };
+    auto hasFailed = [&]()
+    {
+        int value;
+#pragma omp atomic read
+        value = failed;
+        return value != 0;
+    };
 
-    // Cumulative Distribution Function (serial because each iteration depends on the previous one)
-    vector<float> cumulativeDistFunc(histSize, 0.0);
-    cumulativeDistFunc[0] = probDensityFunc[0];
-    for (int i = 1; i < histSize; i++)
+    int *hist = histBefore.data();
+#pragma omp parallel num_threads(threads)
     {
-        cumulativeDistFunc[i] = cumulativeDistFunc[i - 1] + probDensityFunc[i];
+        vector<Pixel> chunk(min(chunkRows, rows) * cols);
+
+        // Pass 1: global histogram
+#pragma omp for schedule(dynamic) reduction(+ : hist[:Bins])
+        for (long long c = 0; c < chunks; c++)
+        {
+            if (hasFailed())
+                continue;
+            size_t row = c * chunkRows;
+            size_t count = min(chunkRows, rows - row);
+            try
+            {
+                input.readRows(row, count, chunk.data());
+                Kernels::count(chunk.data(), count * cols, hist);
+            }
+            catch (...)
+            {
+                fail();
+            }
+        }
+
+#pragma omp single
+        Kernels::buildLookupTable(histBefore.data(), rows * cols, eqLookupTable.data());
+
+        // Pass 2: remap and write
+#pragma omp for schedule(dynamic)
+        for (long long c = 0; c < chunks; c++)
+        {
+            if (hasFailed())
+                continue;
+            size_t row = c * chunkRows;
+            size_t count = min(chunkRows, rows - row);
+            try
+            {
+                input.readRows(row, count, chunk.data());
+                Kernels::apply(chunk.data(), chunk.data(), count * cols, eqLookupTable.data());
+                output.writeRows(row, count, chunk.data());
+            }
+            catch (...)
+            {
+                fail();
+            }
+        }
     }
+    if (error)
+        rethrow_exception(error);
+
+    histAfter.assign(Bins, 0);
+    Kernels::remap(histBefore.data(), eqLookupTable.data(), histAfter.data());
+}
+
+// Streams input with the pixel type and bin count its maxval calls for
+double streamingEqualization(const PgmFile &input, const string &outputPath, size_t budgetBytes, vector<int> &histBefore, vector<int> &histAfter)
+{
+    if (input.maxValue() < 256)
+        return measureRuntime(RUNTIME_OUTPUT_PATH, streamEqualization<uint8_t, HIST_SIZE>, input, outputPath, budgetBytes, histBefore, histAfter);
+    if (input.maxValue() < 1 << 10)
+        return measureRuntime(RUNTIME_OUTPUT_PATH, streamEqualization<uint16_t, 1 << 10>, input, outputPath, budgetBytes, histBefore, histAfter);
+    if (input.maxValue() < 1 << 12)
+        return measureRuntime(RUNTIME_OUTPUT_PATH, streamEqualization<uint16_t, 1 << 12>, input, outputPath, budgetBytes, histBefore, histAfter);
+    return measureRuntime(RUNTIME_OUTPUT_PATH, streamEqualization<uint16_t, 1 << 16>, input, outputPath, budgetBytes, histBefore, histAfter);
+}
 
-    // Prepare Lookup Table
-    vector<uint8_t> eqLookupTable(histSize, 0);
-#pragma omp parallel for
-    for (int i = 0; i < histSize; i++)
+// Global equalization of a 10/12/16-bit image with 2^bits bins
+double highBitDepthEqualization(int bits, const ImageType16 &input, ImageType16 &output, vector<int> &histBefore, vector<int> &histAfter, bool verify, const HistogramSampling &sampling)
+{
+    switch (bits)
     {
-        eqLookupTable[i] = static_cast<uint8_t>(round(cumulativeDistFunc[i] * 255));
+    case 10:
+        return measureRuntime(RUNTIME_OUTPUT_PATH, histogramEqualization<uint16_t, 1 << 10>, input, output, histBefore, histAfter, verify, sampling);
+    case 12:
+        return measureRuntime(RUNTIME_OUTPUT_PATH, histogramEqualization<uint16_t, 1 << 12>, input, output, histBefore, histAfter, verify, sampling);
+    default:
+        return measureRuntime(RUNTIME_OUTPUT_PATH, histogramEqualization<uint16_t, 1 << 16>, input, output, histBefore, histAfter, verify, sampling);
     }
+}
 
-    // Use Lookup Table to equalize the image
-    output = input;
-#pragma omp parallel for collapse(2)
-    for (int i = 0; i < input.rows(); i++)
+void colorEqualization(const ImageType &input, ImageType &output, vector<int> &histBefore, vector<int> &histAfter)
+{
+    size_t totalPixels = input.rows() * input.cols();
+    histBefore.assign(HIST_SIZE, 0);
+    histAfter.assign(HIST_SIZE, 0);
+    output.resize(input.rows(), input.cols(), 3);
+
+    vector<uint8_t> eqLookupTable(HIST_SIZE, 0);
+    int *hist = histBefore.data();
+    int *histOut = histAfter.data();
+
+#pragma omp parallel
     {
-        for (int j = 0; j < input.cols(); j++)
+        int numThreads = omp_get_num_threads();
+
+        // Pass 1: luminance histogram, converted from BGR on the fly
+#pragma omp for schedule(static) reduction(+ : hist[:HIST_SIZE])
+        for (int t = 0; t < numThreads; t++)
+        {
+            size_t begin = totalPixels * t / numThreads;
+            size_t end = totalPixels * (t + 1) / numThreads;
+            computeLumaHistogram(input.getData() + 3 * begin, end - begin, hist);
+        }
+
+#pragma omp single
+        buildEqualizationLookupTable(histBefore.data(), totalPixels, eqLookupTable.data());
+
+        // Pass 2: equalize the luminance and rebuild BGR with the chroma unchanged
+#pragma omp for schedule(static) reduction(+ : histOut[:HIST_SIZE])
+        for (int t = 0; t < numThreads; t++)
         {
-            output.at(i, j) = eqLookupTable[input.at(i, j)];
+            size_t begin = totalPixels * t / numThreads;
+            size_t end = totalPixels * (t + 1) / numThreads;
+            applyLumaLookupTable(input.getData() + 3 * begin, output.getData() + 3 * begin, end - begin, eqLookupTable.data(), histOut);
         }
     }
+}
+
+void claheEqualization(const ImageType &input, ImageType &output, vector<int> &histBefore, vector<int> &histAfter, ClaheParams params)
+{
+    int rows = input.rows();
+    int cols = input.cols();
+    size_t totalPixels = input.rows() * input.cols();
+    fitClaheParams(params, rows, cols);
+
+    histBefore.assign(HIST_SIZE, 0);
+    histAfter.assign(HIST_SIZE, 0);
+    output.resize(rows, cols);
+
+    ClaheAxis xAxis, yAxis;
+    buildClaheAxis(cols, params.tilesX, xAxis);
+    buildClaheAxis(rows, params.tilesY, yAxis);
+
+    vector<uint8_t> luts(static_cast<size_t>(params.tilesY) * params.tilesX * HIST_SIZE);
+    int *hist = histBefore.data();
+    int *histOut = histAfter.data();
 
-// Histogram after equalization using per-thread local histograms + reduction
 #pragma omp parallel
     {
-        vector<int> localHist(histSize, 0);
+        int numThreads = omp_get_num_threads();
 
-#pragma omp for nowait collapse(2)
-        for (int i = 0; i < output.rows(); i++)
+#pragma omp for schedule(static) reduction(+ : hist[:HIST_SIZE])
+        for (int t = 0; t < numThreads; t++)
         {
-            for (int j = 0; j < output.cols(); j++)
-            {
-                int pixelValue = output.at(i, j);
-                localHist[pixelValue]++;
-            }
+            size_t begin = totalPixels * t / numThreads;
+            size_t end = totalPixels * (t + 1) / numThreads;
+            computeHistogram(input.getData() + begin, end - begin, hist);
         }
 
-// Reduce local histograms into the global histogram
-#pragma omp critical
+        // One task per tile; the barrier closing the single waits for all of them
+#pragma omp single
         {
-            for (int i = 0; i < histSize; i++)
+            for (int ty = 0; ty < params.tilesY; ty++)
             {
-                histAfter[i] += localHist[i];
+                for (int tx = 0; tx < params.tilesX; tx++)
+                {
+#pragma omp task firstprivate(ty, tx)
+                    computeClaheTile(input, 0, rows, params, ty, tx, luts);
+                }
             }
         }
+
+        // Each thread interpolates one band of rows and counts it while it is still in cache
+#pragma omp for schedule(static) reduction(+ : histOut[:HIST_SIZE])
+        for (int t = 0; t < numThreads; t++)
+        {
+            size_t rowBegin = static_cast<size_t>(rows) * t / numThreads;
+            size_t rowEnd = static_cast<size_t>(rows) * (t + 1) / numThreads;
+            interpolateClaheRows(input, output, rowBegin, rowEnd, 0, xAxis, yAxis, params, luts);
+            if (rowEnd > rowBegin)
+                computeHistogram(&output.at(rowBegin, 0), (rowEnd - rowBegin) * cols, histOut);
+        }
     }
 }
 
 int main(int argc, char **argv)
 {
-    if (argc != 2 && argc != 3)
+    ProgramOptions options;
+    if (!parseOptions(argc, argv, options) || hasMpiOnlyOptions(options) || hasAutoOnlyOptions(options))
     {
-        cout << "Usage: " << argv[0] << " [--quiet|-q] <image_path>" << endl;
+        cout << "Usage: " << argv[0] << " [--quiet|-q] [--verify] [--no-artifacts] [--png-compression <0-9>] [--timings <path>] [--profile|--perf-counters] [--threads <n>] [--sample <rate> | --sample-error <levels>] [--bits <n> | --color | --clahe [--tiles <cols>x<rows>] [--clip-limit <value>]] <image_path> | --batch <dir|list> [--batch-out <dir>] [--io-threads <n>] | --stream [--memory-budget <MB>] <pgm_path> | --sequence <video|dir> [--smoothing <alpha>]" << endl;
         return -1;
     }
-    string filename = argv[1];
-    bool quiet = false;
-    if (argc == 3)
+    bool quiet = options.quiet;
+    HistogramSampling sampling{options.sampleRate, options.sampleError};
+    if (options.perfCounters && !enableProfileCounters())
+        cerr << "Hardware counters are unavailable (see /proc/sys/kernel/perf_event_paranoid); reporting times only" << endl;
+    if (options.threads > 0)
+        omp_set_num_threads(options.threads);
+
+    if (options.stream)
     {
-        if (string(argv[1]) == "--quiet" || string(argv[1]) == "-q")
+        PgmFile input;
+        input.openRead(options.filename);
+
+        vector<int> histBefore, histAfter;
+        double duration = streamingEqualization(input, STREAM_OUTPUT_PATH, options.memoryBudgetMB << 20, histBefore, histAfter);
+
+        if (!options.noArtifacts)
         {
-            quiet = true;
-            filename = argv[2];
+            ImageWriter writer(options.pngCompression);
+            outputHistogram(histBefore, BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram BEFORE Equalization", quiet, writer);
+            outputHistogram(histAfter, AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram AFTER Equalization", quiet, writer);
+            writer.wait();
         }
-        else
+
+        if (!quiet)
+            cout << "\nSaved " << STREAM_OUTPUT_PATH << " successfully." << endl;
+
+        cout << "Runtime: " << duration << " ms" << endl;
+        return 0;
+    }
+
+    if (!options.batch.empty())
+    {
+        vector<string> files;
+        if (!listBatchInputs(options.batch, files))
         {
-            cout << "Usage: " << argv[0] << " [--quiet|-q] <image_path>" << endl;
+            cerr << "Could not open batch input: " << options.batch << endl;
             return -1;
         }
+
+        ClaheParams params{options.tilesX, options.tilesY, options.clipLimit};
+        BatchStats stats = runBatch(
+            files, options.batchOutput.empty() ? BATCH_OUTPUT_PATH : options.batchOutput, options.ioThreads, options.color, options.pngCompression,
+            [&](const ImageType &input, ImageType &output)
+            {
+                vector<int> histBefore, histAfter;
+                if (input.channels() == 3)
+                    colorEqualization(input, output, histBefore, histAfter);
+                else if (options.clahe)
+                    claheEqualization(input, output, histBefore, histAfter, params);
+                else
+                    histogramEqualization<uint8_t, HIST_SIZE>(input, output, histBefore, histAfter, options.verify, sampling);
+            });
+        printBatchStats(stats);
+        if (options.profile)
+            reportProfile(PROFILE_OUTPUT_PATH);
+        return 0;
+    }
+
+    if (!options.sequence.empty())
+    {
+        // One scratch state for the whole sequence, so frames allocate nothing
+        OmpEqualizationState<uint8_t, HIST_SIZE> state;
+        SequenceStats stats = runSequence(
+            options.sequence, SEQUENCE_OUTPUT_PATH, options.smoothing, options.pngCompression,
+            [&](const ImageType &frame, int *hist)
+            {
+#pragma omp parallel
+                ompCountHistogram(frame.getData(), frame.rows() * frame.cols(), state, hist);
+            },
+            [](const ImageType &frame, ImageType &output, const uint8_t *lut)
+            {
+#pragma omp parallel
+                ompApplyLookupTable<uint8_t, HIST_SIZE>(frame, output, lut);
+            });
+        printSequenceStats(stats);
+        return 0;
+    }
+
+    if (options.bits > 8)
+    {
+        ImageType16 image16, equalized16;
+        readImage(options.filename, image16, options.bits);
+
+        vector<int> histBefore, histAfter;
+        double duration = highBitDepthEqualization(options.bits, image16, equalized16, histBefore, histAfter, options.verify, sampling);
+
+        // Full-depth images are written as 16-bit PNGs; the combined previews are scaled to 8 bits
+        ImageWriter writer(options.pngCompression);
+        writer.write(AFTER_IMAGE_OUTPUT_PATH, equalized16);
+        if (!options.noArtifacts)
+        {
+            writer.write(BEFORE_IMAGE_OUTPUT_PATH, image16);
+            Mat plotBefore = outputHistogram(histBefore, BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram BEFORE Equalization", quiet, writer);
+            Mat plotAfter = outputHistogram(histAfter, AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram AFTER Equalization", quiet, writer);
+
+            ImageType displayBefore, displayAfter;
+            toDisplayImage(image16, options.bits, displayBefore);
+            toDisplayImage(equalized16, options.bits, displayAfter);
+            generateCombinedOutputs(
+                displayBefore,
+                displayAfter,
+                plotBefore,
+                plotAfter,
+                BEFORE_IMAGE_HISTOGRAM_COMBINED_PATH,
+                AFTER_IMAGE_HISTOGRAM_COMBINED_PATH,
+                BEFORE_AFTER_COMBINED_PATH,
+                writer);
+        }
+        writer.wait();
+
+        cout << "Runtime: " << duration << " ms" << endl;
+        if (!options.timingsPath.empty())
+            appendTiming(options.timingsPath, "omp", omp_get_max_threads(), image16.rows(), image16.cols(), duration);
+        if (options.profile)
+            reportProfile(PROFILE_OUTPUT_PATH);
+        return 0;
     }
 
     ImageType image;
-    readImage(filename, image);
+    readImage(options.filename, image, options.color);
 
     ImageType equalizedImage;
     vector<int> histBefore, histAfter;
 
-    double duration = measureRuntime(RUNTIME_OUTPUT_PATH, histogramEqualization, image, equalizedImage, histBefore, histAfter);
-
-    writeImage(BEFORE_IMAGE_OUTPUT_PATH, image);
-    writeImage(AFTER_IMAGE_OUTPUT_PATH, equalizedImage);
+    double duration;
+    if (image.channels() == 3)
+    {
+        duration = measureRuntime(RUNTIME_OUTPUT_PATH, colorEqualization, image, equalizedImage, histBefore, histAfter);
+    }
+    else if (options.clahe)
+    {
+        ClaheParams params{options.tilesX, options.tilesY, options.clipLimit};
+        duration = measureRuntime(RUNTIME_OUTPUT_PATH, claheEqualization, image, equalizedImage, histBefore, histAfter, params);
+    }
+    else
+    {
+        duration = measureRuntime(RUNTIME_OUTPUT_PATH, histogramEqualization<uint8_t, HIST_SIZE>, image, equalizedImage, histBefore, histAfter, options.verify, sampling);
+    }
 
-    outputHistogram(histBefore, BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram BEFORE Equalization", quiet);
-    outputHistogram(histAfter, AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram AFTER Equalization", quiet);
+    // Every output is encoded on its own thread; the histogram plots go to the composites in memory
+    ImageWriter writer(options.pngCompression);
+    writer.write(AFTER_IMAGE_OUTPUT_PATH, equalizedImage);
+    if (!options.noArtifacts)
+    {
+        writer.write(BEFORE_IMAGE_OUTPUT_PATH, image);
+        Mat plotBefore = outputHistogram(histBefore, BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram BEFORE Equalization", quiet, writer);
+        Mat plotAfter = outputHistogram(histAfter, AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram AFTER Equalization", quiet, writer);
 
-    generateCombinedOutputs(
-        image,
-        equalizedImage,
-        BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH,
-        AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH,
-        BEFORE_IMAGE_HISTOGRAM_COMBINED_PATH,
-        AFTER_IMAGE_HISTOGRAM_COMBINED_PATH,
-        BEFORE_AFTER_COMBINED_PATH);
+        generateCombinedOutputs(
+            image,
+            equalizedImage,
+            plotBefore,
+            plotAfter,
+            BEFORE_IMAGE_HISTOGRAM_COMBINED_PATH,
+            AFTER_IMAGE_HISTOGRAM_COMBINED_PATH,
+            BEFORE_AFTER_COMBINED_PATH,
+            writer);
+    }
+    writer.wait();
 
-    if (!quiet)
+    if (!quiet && !options.noArtifacts)
         cout << "\nSaved " << BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH << " and " << AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH << " successfully." << endl;
 
     cout << "Runtime: " << duration << " ms" << endl;
+    if (!options.timingsPath.empty())
+        appendTiming(options.timingsPath, "omp", omp_get_max_threads(), image.rows(), image.cols(), duration);
+    if (options.profile)
+        reportProfile(PROFILE_OUTPUT_PATH);
 
     return 0;
 }
@@ -0,0 +1,122 @@
+#include "utils.hpp"
+#include "kernels.hpp"
+#include <omp.h>
+
+#ifndef OMP_KERNELS_HPP
+#define OMP_KERNELS_HPP
+
+// Upper bound on the memory of the per-thread private histograms, in bytes
+#define HIST_PRIVATE_BUDGET (4 << 20)
+
+// Phases of the OpenMP global equalization, shared by the OpenMP and the hybrid MPI + OpenMP
+// engines. Every thread of an enclosing parallel region calls them (orphaned worksharing), so an
+// engine keeps a single region for its whole pipeline and can put its own steps in between.
+
+// Scratch space of the phases for up to omp_get_max_threads() threads
+template <typename Pixel, int Bins>
+struct OmpEqualizationState
+{
+  // Private histograms: one per thread while they fit the budget; past it (65536 bins on many
+  // threads) threads share copies round-robin and count into them atomically
+  int copies;
+  vector<int> privateHists;
+  vector<long long> threadSums; // Bin range totals of the parallel CDF, then their prefix sums
+
+  OmpEqualizationState()
+  {
+    int maxThreads = omp_get_max_threads();
+    copies = static_cast<int>(max<size_t>(1, min<size_t>(maxThreads, HIST_PRIVATE_BUDGET / (Bins * sizeof(int)))));
+    privateHists.assign(static_cast<size_t>(copies) * Bins, 0);
+    threadSums.assign(maxThreads + 1, 0);
+  }
+};
+
+// Histogram of count pixels into hist (Bins entries, overwritten); ends on a barrier. With a
+// sampleStride above 1 only the blocks of a sample are counted (see forEachSampleBlock).
+template <typename Pixel, int Bins>
+void ompCountHistogram(const Pixel *src, size_t count, OmpEqualizationState<Pixel, Bins> &state, int *hist, size_t sampleStride = 1)
+{
+  typedef HistogramKernels<Pixel, Bins> Kernels;
+  int numThreads = omp_get_num_threads();
+  int t = omp_get_thread_num();
+
+  // Each thread counts one contiguous slice, or the sample of it, into its private copy
+  size_t begin = count * t / numThreads;
+  size_t end = count * (t + 1) / numThreads;
+  int *privateHist = &state.privateHists[static_cast<size_t>(t % state.copies) * Bins];
+  bool shared = numThreads > state.copies;
+  forEachSampleBlock(end - begin, sampleStride, [&](size_t first, size_t length)
+                     {
+    if (shared)
+      Kernels::countAtomic(src + begin + first, length, privateHist);
+    else
+      Kernels::count(src + begin + first, length, privateHist); });
+#pragma omp barrier
+
+  // Merge the copies, split over the bins, and leave them zeroed so the state can be reused
+#pragma omp for schedule(static)
+  for (int v = 0; v < Bins; v++)
+  {
+    int sum = 0;
+    for (int c = 0; c < state.copies; c++)
+    {
+      sum += state.privateHists[static_cast<size_t>(c) * Bins + v];
+      state.privateHists[static_cast<size_t>(c) * Bins + v] = 0;
+    }
+    hist[v] = sum;
+  }
+}
+
+// Equalization lookup table of hist over totalPixels pixels; ends on a barrier
+template <typename Pixel, int Bins>
+void ompBuildLookupTable(const int *hist, size_t totalPixels, OmpEqualizationState<Pixel, Bins> &state, Pixel *lut)
+{
+  typedef HistogramKernels<Pixel, Bins> Kernels;
+  if (Bins <= HIST_SIZE)
+  {
+    // PDF, CDF and Lookup Table are 256 entries each, cheaper on one thread than split up
+#pragma omp single
+    Kernels::buildLookupTable(hist, totalPixels, lut);
+  }
+  else
+  {
+    // Parallel prefix sum for the wide CDF: per-thread bin range totals, an exclusive scan
+    // of the totals, then every thread finishes its own range from its offset
+    int numThreads = omp_get_num_threads();
+    int t = omp_get_thread_num();
+    size_t binBegin = static_cast<size_t>(Bins) * t / numThreads;
+    size_t binEnd = static_cast<size_t>(Bins) * (t + 1) / numThreads;
+    long long rangeSum = 0;
+    for (size_t v = binBegin; v < binEnd; v++)
+      rangeSum += hist[v];
+    state.threadSums[t + 1] = rangeSum;
+#pragma omp barrier
+
+#pragma omp single
+    for (int k = 1; k <= numThreads; k++)
+      state.threadSums[k] += state.threadSums[k - 1];
+
+    long long cdf = state.threadSums[t];
+    for (size_t v = binBegin; v < binEnd; v++)
+    {
+      cdf += hist[v];
+      lut[v] = Kernels::lookupValue(cdf, totalPixels);
+    }
+#pragma omp barrier
+  }
+}
+
+// Remaps input into output (same size), one row per iteration; ends on a barrier
+template <typename Pixel, int Bins>
+void ompApplyLookupTable(const BasicImage<Pixel> &input, BasicImage<Pixel> &output, const Pixel *lut)
+{
+  int rows = input.rows();
+  int cols = input.cols();
+#pragma omp for schedule(static)
+  for (int i = 0; i < rows; i++)
+  {
+    HistogramKernels<Pixel, Bins>::apply(&input.at(i, 0), &output.at(i, 0), cols, lut);
+  }
+}
+
+#endif
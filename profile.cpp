@@ -0,0 +1,175 @@
+#include "profile.hpp"
+#include <cstring>
+#include <thread>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    const char *PHASE_NAMES[PROFILE_PHASES] = {"scatter", "histogram", "reduce", "lut", "remap", "post-histogram", "gather", "verify"};
+    const char *VALUE_NAMES[PROFILE_VALUES] = {"calls", "ms", "cycles", "instructions", "llc_misses", "branch_misses"};
+
+    double totals[PROFILE_PHASES][PROFILE_VALUES];
+    int counterFds[PROFILE_COUNTERS] = {-1, -1, -1, -1};
+    thread::id counterThread; // The thread that opened the counters and reads them
+
+#ifdef __linux__
+    // Counts the calling thread and every thread it starts afterwards (inherit): the kernel sums the
+    // children into each read, so the counters of a phase cover the whole OpenMP team, not just the
+    // master thread that reads them
+    int openCounter(uint32_t type, uint64_t config)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.inherit = 1;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+#endif
+
+    void readCounters(long long *values)
+    {
+        bool counted = this_thread::get_id() == counterThread;
+        for (int c = 0; c < PROFILE_COUNTERS; c++)
+        {
+            values[c] = 0;
+#ifdef __linux__
+            if (counted && counterFds[c] >= 0 && read(counterFds[c], &values[c], sizeof(values[c])) != sizeof(values[c]))
+                values[c] = 0;
+#endif
+        }
+    }
+}
+
+bool enableProfileCounters()
+{
+#ifdef __linux__
+    if (counterFds[COUNTER_CYCLES] < 0)
+    {
+        counterFds[COUNTER_CYCLES] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        counterFds[COUNTER_INSTRUCTIONS] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        counterFds[COUNTER_LLC_MISSES] = openCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        // Not every PMU exposes the last-level cache event; the generic cache-miss event usually maps to it
+        if (counterFds[COUNTER_LLC_MISSES] < 0)
+            counterFds[COUNTER_LLC_MISSES] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        counterFds[COUNTER_BRANCH_MISSES] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+        counterThread = this_thread::get_id();
+    }
+#endif
+    for (int c = 0; c < PROFILE_COUNTERS; c++)
+    {
+        if (counterFds[c] >= 0)
+            return true;
+    }
+    return false;
+}
+
+ProfileScope::ProfileScope(ProfilePhase phase, bool active) : phase(phase), active(active)
+{
+    if (active)
+    {
+        readCounters(counters);
+        start = chrono::high_resolution_clock::now();
+    }
+}
+
+ProfileScope::~ProfileScope()
+{
+    if (!active)
+        return;
+    auto end = chrono::high_resolution_clock::now();
+    long long after[PROFILE_COUNTERS];
+    readCounters(after);
+
+    double *values = totals[phase];
+    values[0] += 1;
+    values[1] += chrono::duration<double, milli>(end - start).count();
+    for (int c = 0; c < PROFILE_COUNTERS; c++)
+        values[2 + c] += after[c] - counters[c];
+}
+
+vector<double> profileValues()
+{
+    vector<double> values(PROFILE_PHASES * PROFILE_VALUES);
+    for (int p = 0; p < PROFILE_PHASES; p++)
+    {
+        for (int v = 0; v < PROFILE_VALUES; v++)
+            values[p * PROFILE_VALUES + v] = (v >= 2 && counterFds[v - 2] < 0) ? -1 : totals[p][v];
+    }
+    return values;
+}
+
+void reportProfile(const vector<double> &minimum, const vector<double> &maximum, const vector<double> &average,
+                   int ranks, const string &jsonPath)
+{
+    if (ranks > 1)
+        cout << "\n=== Phases (min / avg / max over " << ranks << " ranks; counters are rank averages of all-thread sums) ===" << endl;
+    else
+        cout << "\n=== Phases ===" << endl;
+    cout << "  " << left << setw(16) << "phase" << right << setw(6) << "calls" << setw(11) << "min ms" << setw(11) << "avg ms" << setw(11) << "max ms"
+         << setw(15) << "cycles" << setw(15) << "instructions" << setw(7) << "IPC" << setw(13) << "LLC misses" << setw(15) << "branch misses" << endl;
+
+    auto counter = [](double value)
+    {
+        ostringstream text;
+        if (value < 0)
+            text << "n/a";
+        else
+            text << fixed << setprecision(0) << value;
+        return text.str();
+    };
+
+    for (int p = 0; p < PROFILE_PHASES; p++)
+    {
+        const double *avg = &average[p * PROFILE_VALUES];
+        if (maximum[p * PROFILE_VALUES] == 0)
+            continue;
+        cout << "  " << left << setw(16) << PHASE_NAMES[p] << right << setw(6) << fixed << setprecision(0) << avg[0]
+             << setprecision(3) << setw(11) << minimum[p * PROFILE_VALUES + 1] << setw(11) << avg[1] << setw(11) << maximum[p * PROFILE_VALUES + 1]
+             << setw(15) << counter(avg[2 + COUNTER_CYCLES]) << setw(15) << counter(avg[2 + COUNTER_INSTRUCTIONS])
+             << setw(7) << setprecision(2);
+        if (avg[2 + COUNTER_CYCLES] > 0 && avg[2 + COUNTER_INSTRUCTIONS] >= 0)
+            cout << avg[2 + COUNTER_INSTRUCTIONS] / avg[2 + COUNTER_CYCLES];
+        else
+            cout << "n/a";
+        cout << setw(13) << counter(avg[2 + COUNTER_LLC_MISSES]) << setw(15) << counter(avg[2 + COUNTER_BRANCH_MISSES]) << endl;
+    }
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+
+    if (jsonPath.empty())
+        return;
+    ofstream json(jsonPath, ios::trunc);
+    if (!json)
+    {
+        cerr << "Unable to open file: " << jsonPath << endl;
+        return;
+    }
+    json << "{\n  \"ranks\": " << ranks << ",\n  \"phases\": [";
+    bool first = true;
+    for (int p = 0; p < PROFILE_PHASES; p++)
+    {
+        if (maximum[p * PROFILE_VALUES] == 0)
+            continue;
+        json << (first ? "" : ",") << "\n    {\"phase\": \"" << PHASE_NAMES[p] << "\"";
+        first = false;
+        for (int v = 0; v < PROFILE_VALUES; v++)
+        {
+            size_t i = p * PROFILE_VALUES + v;
+            json << ", \"" << VALUE_NAMES[v] << "\": ";
+            if (average[i] < 0)
+                json << "null";
+            else
+                json << "{\"min\": " << minimum[i] << ", \"avg\": " << average[i] << ", \"max\": " << maximum[i] << "}";
+        }
+        json << "}";
+    }
+    json << "\n  ]\n}" << endl;
+}
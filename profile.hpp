@@ -0,0 +1,122 @@
+#include "utils.hpp"
+
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+// Phases of a global equalization that the profiling scopes time, in pipeline order. Builds
+// without HISTEQ_PROFILE (make PROFILE=1) compile the scopes away, so the engines pay nothing.
+enum ProfilePhase
+{
+  PROFILE_SCATTER,
+  PROFILE_HISTOGRAM,
+  PROFILE_REDUCE, // Histogram reduction and LUT broadcast (MPI)
+  PROFILE_LUT,
+  PROFILE_REMAP,
+  PROFILE_POST_HISTOGRAM,
+  PROFILE_GATHER,
+  PROFILE_VERIFY,
+  PROFILE_PHASES
+};
+
+// Hardware counters read around every phase with perf_event_open (Linux only)
+enum ProfileCounter
+{
+  COUNTER_CYCLES,
+  COUNTER_INSTRUCTIONS,
+  COUNTER_LLC_MISSES,
+  COUNTER_BRANCH_MISSES,
+  PROFILE_COUNTERS
+};
+
+// Values kept per phase: calls, wall time in ms, then the counters
+#define PROFILE_VALUES (2 + PROFILE_COUNTERS)
+
+#ifdef HISTEQ_PROFILE
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+// Times the rest of the enclosing block as phase
+#define PROFILE_SCOPE(phase) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(phase)
+// Same, on the threads for which active holds: inside an OpenMP region, the master thread, whose
+// time is the phase's because every phase ends on a barrier
+#define PROFILE_SCOPE_IF(phase, active) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(phase, active)
+#define PROFILE_COMPILED_IN true
+#else
+#define PROFILE_SCOPE(phase)
+#define PROFILE_SCOPE_IF(phase, active)
+#define PROFILE_COMPILED_IN false
+#endif
+
+// Opens hardware counters on the calling thread that also count every thread it starts afterwards,
+// so call it before the first OpenMP region: a phase's counts then cover the whole team. Scopes on
+// other threads (an OpenMP single) record their time only. Counters the kernel refuses
+// (perf_event_paranoid, no PMU in a VM) are reported as unavailable; false if none opened.
+bool enableProfileCounters();
+
+// Wall time, and the counters if enabled, of one execution of a phase, added to the phase's totals
+class ProfileScope
+{
+private:
+  int phase;
+  bool active;
+  chrono::high_resolution_clock::time_point start;
+  long long counters[PROFILE_COUNTERS];
+
+public:
+  explicit ProfileScope(ProfilePhase phase, bool active = true);
+  ~ProfileScope();
+
+  ProfileScope(const ProfileScope &) = delete;
+  ProfileScope &operator=(const ProfileScope &) = delete;
+};
+
+// Totals of this process so far: PROFILE_PHASES rows of PROFILE_VALUES values, -1 for counters
+// that are not available (printed as n/a)
+vector<double> profileValues();
+
+// Structured report of every phase that ran at least once. minimum, maximum and average are
+// profileValues() reduced over ranks (all three the same for a single process). Printed to the
+// console, and written as JSON to jsonPath unless it is empty.
+void reportProfile(const vector<double> &minimum, const vector<double> &maximum, const vector<double> &average,
+                   int ranks, const string &jsonPath);
+
+// Report of this process
+inline void reportProfile(const string &jsonPath)
+{
+  if (!PROFILE_COMPILED_IN)
+    cout << "Phase timers are compiled out; rebuild with PROFILE=1" << endl;
+  vector<double> values = profileValues();
+  reportProfile(values, values, values, 1, jsonPath);
+}
+
+#ifdef MPI_VERSION
+// Report of every rank of comm, printed by rank 0; collective. A counter is reported only if every
+// rank has it: which ranks do is reduced on its own, so the -1 of a missing counter is never
+// averaged with real counts.
+inline void reportProfile(int rank, int size, MPI_Comm comm, const string &jsonPath)
+{
+  vector<double> values = profileValues(), minimum(values.size()), maximum(values.size()), average(values.size());
+  vector<int> available(values.size()), everywhere(values.size());
+  for (size_t i = 0; i < values.size(); i++)
+  {
+    available[i] = values[i] >= 0;
+    values[i] = max(values[i], 0.0);
+  }
+  MPI_Reduce(available.data(), everywhere.data(), static_cast<int>(values.size()), MPI_INT, MPI_MIN, 0, comm);
+  MPI_Reduce(values.data(), minimum.data(), static_cast<int>(values.size()), MPI_DOUBLE, MPI_MIN, 0, comm);
+  MPI_Reduce(values.data(), maximum.data(), static_cast<int>(values.size()), MPI_DOUBLE, MPI_MAX, 0, comm);
+  MPI_Reduce(values.data(), average.data(), static_cast<int>(values.size()), MPI_DOUBLE, MPI_SUM, 0, comm);
+  if (rank != 0)
+    return;
+  if (!PROFILE_COMPILED_IN)
+    cout << "Phase timers are compiled out; rebuild with PROFILE=1" << endl;
+  for (size_t i = 0; i < values.size(); i++)
+  {
+    average[i] /= size;
+    if (!everywhere[i])
+      minimum[i] = maximum[i] = average[i] = -1;
+  }
+  reportProfile(minimum, maximum, average, size, jsonPath);
+}
+#endif
+
+#endif
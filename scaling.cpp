@@ -0,0 +1,464 @@
+#include "utils.hpp"
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <sstream>
+
+using namespace std;
+using namespace cv;
+
+// Where the inputs, raw runs, summary and charts go
+#define SCALING_OUTPUT_DIR "output/scaling"
+#define SCALING_DEFAULT_SIZES "1024x1024,2048x2048,4096x4096"
+#define SCALING_DEFAULT_WORKERS "1,2,4,8"
+#define SCALING_DEFAULT_REPS 5
+// Image per worker of the weak-scaling study; p workers get p times as many rows
+#define SCALING_DEFAULT_WEAK_SIZE "1024x1024"
+
+// Chart settings
+#define CHART_WIDTH 640
+#define CHART_HEIGHT 440
+#define CHART_MARGIN 60
+#define CHART_FONT FONT_HERSHEY_SIMPLEX
+#define CHART_IDEAL_COLOR Scalar(160, 160, 160) // Grey
+
+namespace
+{
+    struct ScalingConfig
+    {
+        vector<string> engines;
+        vector<pair<size_t, size_t>> sizes; // cols x rows of the strong-scaling study
+        size_t weakCols = 0, weakRows = 0;
+        string image; // Strong scaling on this image instead of synthetic sizes
+        vector<int> threads;
+        vector<int> ranks;
+        int reps = SCALING_DEFAULT_REPS;
+        bool strong = true;
+        bool weak = true;
+        string mpirun = "mpirun";
+        string outputDir = SCALING_OUTPUT_DIR;
+    };
+
+    // Runtimes of the repetitions of one configuration
+    struct RunStats
+    {
+        int runs = 0;
+        double minMs = 0;
+        double medianMs = 0;
+        double meanMs = 0;
+        double stddevMs = 0;
+    };
+
+    // One row of the summary: a configuration, its runtimes and how it compares with seq.out
+    struct ScalingPoint
+    {
+        string study;
+        string engine;
+        int workers;
+        size_t rows, cols;
+        RunStats stats;
+        double speedup;
+        double efficiency;
+    };
+
+    struct Series
+    {
+        string name;
+        vector<double> values; // One per worker count, NaN where there was no run
+        Scalar color;
+    };
+
+    typedef map<string, vector<double>> RunTimes; // By runKey
+
+    bool parseCounts(const string &text, vector<int> &counts)
+    {
+        counts.clear();
+        for (const string &item : splitList(text))
+        {
+            counts.push_back(atoi(item.c_str()));
+            if (counts.back() < 1)
+                return false;
+        }
+        return !counts.empty();
+    }
+
+    string sizeName(size_t cols, size_t rows)
+    {
+        return to_string(cols) + "x" + to_string(rows);
+    }
+
+    string runKey(const string &engine, int workers, size_t rows, size_t cols)
+    {
+        return engine + "," + to_string(workers) + "," + to_string(rows) + "," + to_string(cols);
+    }
+
+    // A photo-like synthetic input: a diagonal gradient over most of the range plus noise, so
+    // every engine sees a realistic histogram and the PNG does not compress to nothing
+    string writeInput(const string &dir, size_t cols, size_t rows)
+    {
+        string path = dir + "/" + sizeName(cols, rows) + ".png";
+        ImageType image(rows, cols);
+        mt19937 gen(static_cast<unsigned>(rows * 31 + cols));
+        uniform_int_distribution<int> noise(-24, 24);
+        for (size_t i = 0; i < rows; i++)
+            for (size_t j = 0; j < cols; j++)
+            {
+                int value = static_cast<int>(32 + 160 * (i + j) / (rows + cols)) + noise(gen);
+                image.at(i, j) = static_cast<uint8_t>(min(max(value, 0), 255));
+            }
+        writeImage(path, image);
+        return path;
+    }
+
+    // Runs engine on input config.reps times with workers threads (omp) or ranks (mpi); every run
+    // appends its runtime to timingsPath. Console output of the engine is dropped, errors are not.
+    bool runEngine(const ScalingConfig &config, const string &engine, int workers, const string &input, const string &timingsPath)
+    {
+        string flags = " --quiet --no-artifacts --timings '" + timingsPath + "' '" + input + "' > /dev/null";
+        string command;
+        if (engine == "seq")
+            command = "./seq.out" + flags;
+        else if (engine == "omp")
+            command = "./omp.out --threads " + to_string(workers) + flags;
+        else
+            command = config.mpirun + " -np " + to_string(workers) + " ./mpi.out" + flags;
+
+        cout << "  " << left << setw(4) << engine << right << setw(4) << workers << " x " << config.reps << "  " << input << endl;
+        for (int r = 0; r < config.reps; r++)
+        {
+            if (system(command.c_str()) != 0)
+            {
+                cerr << "Failed: " << command << endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Rows of the CSV the engines append to (see appendTiming), by configuration
+    RunTimes readTimings(const string &path)
+    {
+        RunTimes times;
+        ifstream file(path);
+        string line;
+        getline(file, line); // Header
+        while (getline(file, line))
+        {
+            vector<string> fields;
+            stringstream stream(line);
+            string field;
+            while (getline(stream, field, ','))
+                fields.push_back(field);
+            if (fields.size() != 5)
+                continue;
+            times[runKey(fields[0], atoi(fields[1].c_str()), stoul(fields[2]), stoul(fields[3]))].push_back(atof(fields[4].c_str()));
+        }
+        return times;
+    }
+
+    RunStats summarize(vector<double> times)
+    {
+        RunStats stats;
+        stats.runs = static_cast<int>(times.size());
+        if (times.empty())
+            return stats;
+        sort(times.begin(), times.end());
+        size_t n = times.size();
+        stats.minMs = times[0];
+        stats.medianMs = n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+        for (double t : times)
+            stats.meanMs += t / n;
+        for (double t : times)
+            stats.stddevMs += (t - stats.meanMs) * (t - stats.meanMs);
+        stats.stddevMs = n > 1 ? sqrt(stats.stddevMs / (n - 1)) : 0;
+        return stats;
+    }
+
+    void printTable(const string &title, const vector<ScalingPoint> &points)
+    {
+        cout << "\n=== " << title << " ===" << endl;
+        cout << "  " << left << setw(7) << "engine" << setw(12) << "size" << right << setw(8) << "workers"
+             << setw(12) << "median ms" << setw(11) << "stddev" << setw(11) << "min ms" << setw(10) << "speedup" << setw(12) << "efficiency" << endl;
+        for (const ScalingPoint &point : points)
+            cout << "  " << left << setw(7) << point.engine << setw(12) << sizeName(point.cols, point.rows) << right << setw(8) << point.workers
+                 << fixed << setprecision(3) << setw(12) << point.stats.medianMs << setw(11) << point.stats.stddevMs << setw(11) << point.stats.minMs
+                 << setprecision(2) << setw(9) << point.speedup << "x" << setw(11) << 100 * point.efficiency << "%" << endl;
+    }
+
+    void writeSummary(const string &path, const vector<ScalingPoint> &points)
+    {
+        ofstream file(path, ios::trunc);
+        file << "study,engine,workers,rows,cols,runs,min_ms,median_ms,mean_ms,stddev_ms,speedup,efficiency" << endl;
+        for (const ScalingPoint &point : points)
+            file << point.study << ',' << point.engine << ',' << point.workers << ',' << point.rows << ',' << point.cols << ','
+                 << point.stats.runs << ',' << point.stats.minMs << ',' << point.stats.medianMs << ',' << point.stats.meanMs << ','
+                 << point.stats.stddevMs << ',' << point.speedup << ',' << point.efficiency << endl;
+    }
+
+    Scalar seriesColor(size_t index)
+    {
+        // Blue, orange, green, red, purple, brown (BGR)
+        const Scalar palette[] = {Scalar(180, 119, 31), Scalar(14, 127, 255), Scalar(44, 160, 44), Scalar(40, 39, 214), Scalar(189, 103, 148), Scalar(75, 86, 140)};
+        return palette[index % (sizeof(palette) / sizeof(palette[0]))];
+    }
+
+    // Line chart of series over the worker counts, which are spaced evenly on the x axis
+    Mat drawChart(const string &title, const string &yLabel, const vector<int> &workers, const vector<Series> &series)
+    {
+        Mat chart(CHART_HEIGHT, CHART_WIDTH, CV_8UC3, Scalar(255, 255, 255));
+        int left = CHART_MARGIN, right = CHART_WIDTH - CHART_MARGIN / 2, top = CHART_MARGIN, bottom = CHART_HEIGHT - CHART_MARGIN;
+
+        double maxValue = 0;
+        for (const Series &s : series)
+            for (double v : s.values)
+                if (!std::isnan(v))
+                    maxValue = max(maxValue, v);
+        maxValue = maxValue > 0 ? maxValue * 1.1 : 1;
+
+        auto xAt = [&](size_t i)
+        { return workers.size() > 1 ? left + static_cast<int>((right - left) * i / (workers.size() - 1)) : (left + right) / 2; };
+        auto yAt = [&](double v)
+        { return bottom - static_cast<int>((bottom - top) * v / maxValue); };
+
+        putText(chart, title, Point(left, top / 2), CHART_FONT, 0.6, Scalar(0, 0, 0), 1, LINE_AA);
+        line(chart, Point(left, bottom), Point(right, bottom), Scalar(0, 0, 0), 1);
+        line(chart, Point(left, top), Point(left, bottom), Scalar(0, 0, 0), 1);
+
+        // Five grid lines on y, one tick per worker count on x
+        for (int g = 0; g <= 4; g++)
+        {
+            double v = maxValue * g / 4;
+            int y = yAt(v);
+            line(chart, Point(left, y), Point(right, y), Scalar(230, 230, 230), 1);
+            ostringstream label;
+            label << fixed << setprecision(v < 10 ? 2 : 0) << v;
+            putText(chart, label.str(), Point(4, y + 4), CHART_FONT, 0.4, Scalar(0, 0, 0), 1, LINE_AA);
+        }
+        for (size_t i = 0; i < workers.size(); i++)
+            putText(chart, to_string(workers[i]), Point(xAt(i) - 6, bottom + 18), CHART_FONT, 0.45, Scalar(0, 0, 0), 1, LINE_AA);
+        putText(chart, "workers", Point((left + right) / 2 - 25, bottom + 40), CHART_FONT, 0.45, Scalar(0, 0, 0), 1, LINE_AA);
+        putText(chart, yLabel, Point(4, top - 8), CHART_FONT, 0.45, Scalar(0, 0, 0), 1, LINE_AA);
+
+        for (size_t s = 0; s < series.size(); s++)
+        {
+            const Series &current = series[s];
+            bool havePrevious = false;
+            Point previous;
+            for (size_t i = 0; i < current.values.size() && i < workers.size(); i++)
+            {
+                if (std::isnan(current.values[i]))
+                {
+                    havePrevious = false;
+                    continue;
+                }
+                Point p(xAt(i), yAt(current.values[i]));
+                if (havePrevious)
+                    line(chart, previous, p, current.color, 2, LINE_AA);
+                circle(chart, p, 3, current.color, FILLED, LINE_AA);
+                previous = p;
+                havePrevious = true;
+            }
+            // Legend, top right
+            int y = top + 16 * static_cast<int>(s);
+            line(chart, Point(right - 150, y), Point(right - 130, y), current.color, 2);
+            putText(chart, current.name, Point(right - 124, y + 4), CHART_FONT, 0.4, Scalar(0, 0, 0), 1, LINE_AA);
+        }
+        return chart;
+    }
+
+    // Values of the points of one engine and size, in the order of workers
+    vector<double> seriesValues(const vector<ScalingPoint> &points, const string &engine, size_t rows, size_t cols, const vector<int> &workers, bool efficiency)
+    {
+        vector<double> values(workers.size(), NAN);
+        for (const ScalingPoint &point : points)
+            for (size_t i = 0; i < workers.size(); i++)
+                if (point.engine == engine && point.workers == workers[i] && (rows == 0 || (point.rows == rows && point.cols == cols)))
+                    values[i] = efficiency ? point.efficiency : point.speedup;
+        return values;
+    }
+
+    void writeCharts(const ScalingConfig &config, const vector<ScalingPoint> &strong, const vector<ScalingPoint> &weak,
+                     const vector<pair<size_t, size_t>> &strongSizes)
+    {
+        for (const string &engine : config.engines)
+        {
+            const vector<int> &workers = engine == "omp" ? config.threads : config.ranks;
+            vector<double> ideal(workers.begin(), workers.end());
+            if (!strong.empty())
+            {
+                vector<Series> speedup{{"ideal", ideal, CHART_IDEAL_COLOR}}, efficiency{{"ideal", vector<double>(workers.size(), 1), CHART_IDEAL_COLOR}};
+                for (size_t s = 0; s < strongSizes.size(); s++)
+                {
+                    string name = sizeName(strongSizes[s].first, strongSizes[s].second);
+                    speedup.push_back({name, seriesValues(strong, engine, strongSizes[s].second, strongSizes[s].first, workers, false), seriesColor(s)});
+                    efficiency.push_back({name, seriesValues(strong, engine, strongSizes[s].second, strongSizes[s].first, workers, true), seriesColor(s)});
+                }
+                Mat chart;
+                hconcat(vector<Mat>{drawChart(engine + " strong scaling: speedup over seq", "speedup", workers, speedup),
+                                    drawChart(engine + " strong scaling: efficiency", "efficiency", workers, efficiency)},
+                        chart);
+                string path = config.outputDir + "/strong_" + engine + ".png";
+                imwrite(path, chart);
+                cout << "Saved " << path << endl;
+            }
+            if (!weak.empty())
+            {
+                vector<Series> efficiency{{"ideal", vector<double>(workers.size(), 1), CHART_IDEAL_COLOR},
+                                          {sizeName(config.weakCols, config.weakRows) + " per worker", seriesValues(weak, engine, 0, 0, workers, true), seriesColor(0)}};
+                string path = config.outputDir + "/weak_" + engine + ".png";
+                imwrite(path, drawChart(engine + " weak scaling: efficiency", "efficiency", workers, efficiency));
+                cout << "Saved " << path << endl;
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    ScalingConfig config;
+    config.engines = {"omp", "mpi"};
+    bool valid = parseCounts(SCALING_DEFAULT_WORKERS, config.threads) && parseCounts(SCALING_DEFAULT_WORKERS, config.ranks) &&
+                 parseSize(SCALING_DEFAULT_WEAK_SIZE, config.weakCols, config.weakRows);
+    string sizes = SCALING_DEFAULT_SIZES;
+    for (int i = 1; i < argc && valid; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--engines" && i + 1 < argc)
+        {
+            config.engines = splitList(argv[++i]);
+            for (const string &engine : config.engines)
+                valid = valid && (engine == "omp" || engine == "mpi");
+        }
+        else if (arg == "--sizes" && i + 1 < argc)
+            sizes = argv[++i];
+        else if (arg == "--image" && i + 1 < argc)
+            config.image = argv[++i];
+        else if (arg == "--weak-size" && i + 1 < argc)
+            valid = parseSize(argv[++i], config.weakCols, config.weakRows);
+        else if (arg == "--threads" && i + 1 < argc)
+            valid = parseCounts(argv[++i], config.threads);
+        else if (arg == "--ranks" && i + 1 < argc)
+            valid = parseCounts(argv[++i], config.ranks);
+        else if (arg == "--reps" && i + 1 < argc)
+        {
+            config.reps = atoi(argv[++i]);
+            valid = config.reps >= 1;
+        }
+        else if (arg == "--mode" && i + 1 < argc)
+        {
+            string mode = argv[++i];
+            config.strong = mode == "strong" || mode == "both";
+            config.weak = mode == "weak" || mode == "both";
+            valid = config.strong || config.weak;
+        }
+        else if (arg == "--mpirun" && i + 1 < argc)
+            config.mpirun = argv[++i];
+        else if (arg == "--out" && i + 1 < argc)
+            config.outputDir = argv[++i];
+        else
+            valid = false;
+    }
+    for (const string &item : splitList(sizes))
+    {
+        size_t cols, rows;
+        valid = valid && parseSize(item, cols, rows);
+        config.sizes.push_back({cols, rows});
+    }
+    // A real image only has its own size, so it can only be scaled strongly
+    if (!config.image.empty())
+        config.weak = false;
+    if (!valid || config.engines.empty() || !(config.strong || config.weak))
+    {
+        cout << "Usage: " << argv[0] << " [--engines omp,mpi] [--mode strong|weak|both] [--sizes <w>x<h>,... | --image <path>] [--weak-size <w>x<h>] [--threads <n>,...] [--ranks <n>,...] [--reps <n>] [--mpirun <command>] [--out <dir>]" << endl;
+        return -1;
+    }
+
+    string inputDir = config.outputDir + "/inputs";
+    string timingsPath = config.outputDir + "/runs.csv";
+    makeDirectories(inputDir);
+    remove(timingsPath.c_str());
+
+    // Inputs: the strong-scaling sizes (or the image), and the base size times every worker count
+    vector<pair<size_t, size_t>> strongSizes;
+    map<pair<size_t, size_t>, string> inputs; // By cols x rows
+    if (config.strong)
+    {
+        if (!config.image.empty())
+        {
+            ImageType image;
+            readImage(config.image, image);
+            strongSizes.push_back({image.cols(), image.rows()});
+            inputs[strongSizes.back()] = config.image;
+        }
+        else
+            strongSizes = config.sizes;
+    }
+    if (config.weak)
+    {
+        for (const string &engine : config.engines)
+            for (int workers : engine == "omp" ? config.threads : config.ranks)
+                inputs[{config.weakCols, config.weakRows * workers}];
+        inputs[{config.weakCols, config.weakRows}];
+    }
+    for (const auto &size : strongSizes)
+        inputs[size];
+    for (auto &input : inputs)
+        if (input.second.empty())
+            input.second = writeInput(inputDir, input.first.first, input.first.second);
+
+    // seq.out on every input is the baseline of speedup and efficiency
+    cout << "Running (" << config.reps << " repetitions each):" << endl;
+    bool ok = true;
+    for (const auto &input : inputs)
+        ok = ok && runEngine(config, "seq", 1, input.second, timingsPath);
+    if (config.strong)
+        for (const string &engine : config.engines)
+            for (int workers : engine == "omp" ? config.threads : config.ranks)
+                for (const auto &size : strongSizes)
+                    ok = ok && runEngine(config, engine, workers, inputs[size], timingsPath);
+    if (config.weak)
+        for (const string &engine : config.engines)
+            for (int workers : engine == "omp" ? config.threads : config.ranks)
+                ok = ok && runEngine(config, engine, workers, inputs[{config.weakCols, config.weakRows * workers}], timingsPath);
+    if (!ok)
+        return -1;
+
+    // Medians of the runs, against the seq.out median on the same input (strong) or on the base
+    // input (weak, where p workers should take as long on p times the pixels)
+    RunTimes times = readTimings(timingsPath);
+    auto seqMedian = [&](size_t cols, size_t rows)
+    { return summarize(times[runKey("seq", 1, rows, cols)]).medianMs; };
+    vector<ScalingPoint> strong, weak;
+    if (config.strong)
+        for (const string &engine : config.engines)
+            for (const auto &size : strongSizes)
+                for (int workers : engine == "omp" ? config.threads : config.ranks)
+                {
+                    ScalingPoint point{"strong", engine, workers, size.second, size.first, summarize(times[runKey(engine, workers, size.second, size.first)]), 0, 0};
+                    point.speedup = point.stats.medianMs > 0 ? seqMedian(size.first, size.second) / point.stats.medianMs : 0;
+                    point.efficiency = point.speedup / workers;
+                    strong.push_back(point);
+                }
+    if (config.weak)
+        for (const string &engine : config.engines)
+            for (int workers : engine == "omp" ? config.threads : config.ranks)
+            {
+                size_t rows = config.weakRows * workers;
+                ScalingPoint point{"weak", engine, workers, rows, config.weakCols, summarize(times[runKey(engine, workers, rows, config.weakCols)]), 0, 0};
+                point.efficiency = point.stats.medianMs > 0 ? seqMedian(config.weakCols, config.weakRows) / point.stats.medianMs : 0;
+                point.speedup = point.efficiency * workers;
+                weak.push_back(point);
+            }
+
+    if (!strong.empty())
+        printTable("Strong scaling (speedup over seq.out on the same image)", strong);
+    if (!weak.empty())
+        printTable("Weak scaling (" + sizeName(config.weakCols, config.weakRows) + " per worker; efficiency = seq.out on one share / runtime)", weak);
+
+    vector<ScalingPoint> all(strong);
+    all.insert(all.end(), weak.begin(), weak.end());
+    writeSummary(config.outputDir + "/scaling.csv", all);
+    cout << "\nSaved " << config.outputDir << "/scaling.csv and " << timingsPath << endl;
+    writeCharts(config, strong, weak, strongSizes);
+    return 0;
+}
@@ -1,4 +1,10 @@
 #include "utils.hpp"
+#include "kernels.hpp"
+#include "clahe.hpp"
+#include "batch.hpp"
+#include "stream.hpp"
+#include "profile.hpp"
+#include "tiles.hpp"
 #include <cmath>
 
 using namespace cv;
@@ -12,119 +18,357 @@ using namespace std;
 #define AFTER_IMAGE_HISTOGRAM_COMBINED_PATH "output/seq/after/image_histo_after_seq.png"
 #define BEFORE_AFTER_COMBINED_PATH "output/seq/result_seq.png"
 #define RUNTIME_OUTPUT_PATH "output/seq/runtime_seq.txt"
+#define BATCH_OUTPUT_PATH "output/seq/batch"
+#define SEQUENCE_OUTPUT_PATH "output/seq/sequence"
+#define STREAM_OUTPUT_PATH "output/seq/after/image_after_seq.pgm"
+#define PROFILE_OUTPUT_PATH "output/seq/profile_seq.json"
 
-void histogramEqualization(const ImageType &input, ImageType &output, vector<int> &histBefore, vector<int> &histAfter)
+template <typename Pixel, int Bins>
+void histogramEqualization(const BasicImage<Pixel> &input, BasicImage<Pixel> &output, vector<int> &histBefore, vector<int> &histAfter, bool verify, const HistogramSampling &sampling)
 {
-    int histSize = 256;
-    histBefore.assign(histSize, 0);
+    typedef HistogramKernels<Pixel, Bins> Kernels;
+    size_t totalPixels = input.rows() * input.cols();
+    histBefore.assign(Bins, 0);
 
-    // Calculate histogram
-    for (int i = 0; i < input.rows(); i++)
+    // Calculate histogram, of a sample of the pixels only for an approximate LUT
+    size_t sampleStride = sampling.stride(totalPixels, Bins), sampledPixels;
     {
-        for (int j = 0; j < input.cols(); j++)
-        {
-            int pixelValue = input.at(i, j);
-            histBefore[pixelValue]++;
-        }
+        PROFILE_SCOPE(PROFILE_HISTOGRAM);
+        sampledPixels = forEachSampleBlock(totalPixels, sampleStride, [&](size_t begin, size_t length)
+                                           { Kernels::count(input.getData() + begin, length, histBefore.data()); });
     }
 
-    // Probability Density Function
-    vector<float> probDensityFunc(histSize, 0.0);
-    int totalPixels = input.rows() * input.cols();
-    for (int i = 0; i < histSize; i++)
+    // Lookup Table from the Cumulative Distribution Function
+    vector<Pixel> eqLookupTable(Bins, 0);
     {
-        probDensityFunc[i] = (float)histBefore[i] / totalPixels;
+        PROFILE_SCOPE(PROFILE_LUT);
+        Kernels::buildLookupTable(histBefore.data(), sampledPixels, eqLookupTable.data());
     }
 
-    // Cumulative Distribution Function
-    vector<float> cumulativeDistFunc(histSize, 0.0);
-    cumulativeDistFunc[0] = probDensityFunc[0];
-    for (int i = 1; i < histSize; i++)
+    // Use Lookup Table to equalize the image, one cache-sized tile at a time; with verify, each
+    // tile is counted while it is still in cache instead of in a second pass over the output
+    output.resize(input.rows(), input.cols());
+    vector<int> histCounted(verify ? Bins : 0, 0);
     {
-        cumulativeDistFunc[i] = cumulativeDistFunc[i - 1] + probDensityFunc[i];
+        PROFILE_SCOPE(PROFILE_REMAP);
+        TileScheduler tiles(totalPixels, defaultTileItems<Pixel>(), 1);
+        remapTiles<Pixel, Bins>(tiles, 0, input.getData(), output.getData(), eqLookupTable.data(), verify ? histCounted.data() : nullptr);
     }
 
-    // Prepare Lookup Table
-    vector<uint8_t> eqLookupTable(histSize, 0);
-    for (int i = 0; i < histSize; i++)
+    // Histogram after equalization follows from the LUT: every pixel of value i became eqLookupTable[i]
+    // (a sampled histogram is scaled up to an estimate of the full one first)
+    histAfter.assign(Bins, 0);
     {
-        eqLookupTable[i] = static_cast<uint8_t>(round(cumulativeDistFunc[i] * 255));
+        PROFILE_SCOPE(PROFILE_POST_HISTOGRAM);
+        scaleSampledHistogram(histBefore.data(), Bins, sampledPixels, totalPixels);
+        Kernels::remap(histBefore.data(), eqLookupTable.data(), histAfter.data());
     }
 
-    // Use Lookup Table to equalize the image
-    output = input;
-    for (int i = 0; i < input.rows(); i++)
+    if (verify)
     {
-        for (int j = 0; j < input.cols(); j++)
+        PROFILE_SCOPE(PROFILE_VERIFY);
+        if (sampleStride > 1)
         {
-            output.at(i, j) = eqLookupTable[input.at(i, j)];
+            // The exact histogram measures the sampled LUT, and gives the true histograms
+            histBefore.assign(Bins, 0);
+            Kernels::count(input.getData(), totalPixels, histBefore.data());
+            cout << "Sampled LUT (" << 100.0 * sampledPixels / totalPixels << "% of pixels): max deviation "
+                 << lookupTableDeviation<Pixel, Bins>(histBefore.data(), totalPixels, eqLookupTable.data()) << " level(s)" << endl;
+            Kernels::remap(histBefore.data(), eqLookupTable.data(), histAfter.data());
         }
+        if (histCounted != histAfter)
+            throw runtime_error("Derived histogram after equalization does not match the equalized image");
+    }
+}
+
+// Out-of-core global equalization of a PGM: pass 1 builds the histogram strip by strip, pass 2
+// remaps every strip through the LUT and writes it to outputPath. One strip is resident at a time.
+template <typename Pixel, int Bins>
+void streamEqualization(const PgmFile &input, const string &outputPath, size_t budgetBytes, vector<int> &histBefore, vector<int> &histAfter)
+{
+    typedef HistogramKernels<Pixel, Bins> Kernels;
+    size_t rows = input.rows();
+    size_t cols = input.cols();
+    size_t chunkRows = streamChunkRows(budgetBytes, 1, cols * sizeof(Pixel));
+    vector<Pixel> chunk(min(chunkRows, rows) * cols);
+
+    // Pass 1: global histogram
+    histBefore.assign(Bins, 0);
+    for (size_t row = 0; row < rows; row += chunkRows)
+    {
+        size_t count = min(chunkRows, rows - row);
+        input.readRows(row, count, chunk.data());
+        Kernels::count(chunk.data(), count * cols, histBefore.data());
+    }
+
+    vector<Pixel> eqLookupTable(Bins, 0);
+    Kernels::buildLookupTable(histBefore.data(), rows * cols, eqLookupTable.data());
+
+    // Pass 2: remap and write
+    PgmFile output;
+    output.create(outputPath, rows, cols, Bins - 1);
+    for (size_t row = 0; row < rows; row += chunkRows)
+    {
+        size_t count = min(chunkRows, rows - row);
+        input.readRows(row, count, chunk.data());
+        Kernels::apply(chunk.data(), chunk.data(), count * cols, eqLookupTable.data());
+        output.writeRows(row, count, chunk.data());
+    }
+
+    histAfter.assign(Bins, 0);
+    Kernels::remap(histBefore.data(), eqLookupTable.data(), histAfter.data());
+}
+
+// Streams input with the pixel type and bin count its maxval calls for
+double streamingEqualization(const PgmFile &input, const string &outputPath, size_t budgetBytes, vector<int> &histBefore, vector<int> &histAfter)
+{
+    if (input.maxValue() < 256)
+        return measureRuntime(RUNTIME_OUTPUT_PATH, streamEqualization<uint8_t, HIST_SIZE>, input, outputPath, budgetBytes, histBefore, histAfter);
+    if (input.maxValue() < 1 << 10)
+        return measureRuntime(RUNTIME_OUTPUT_PATH, streamEqualization<uint16_t, 1 << 10>, input, outputPath, budgetBytes, histBefore, histAfter);
+    if (input.maxValue() < 1 << 12)
+        return measureRuntime(RUNTIME_OUTPUT_PATH, streamEqualization<uint16_t, 1 << 12>, input, outputPath, budgetBytes, histBefore, histAfter);
+    return measureRuntime(RUNTIME_OUTPUT_PATH, streamEqualization<uint16_t, 1 << 16>, input, outputPath, budgetBytes, histBefore, histAfter);
+}
+
+// Global equalization of a 10/12/16-bit image with 2^bits bins
+double highBitDepthEqualization(int bits, const ImageType16 &input, ImageType16 &output, vector<int> &histBefore, vector<int> &histAfter, bool verify, const HistogramSampling &sampling)
+{
+    switch (bits)
+    {
+    case 10:
+        return measureRuntime(RUNTIME_OUTPUT_PATH, histogramEqualization<uint16_t, 1 << 10>, input, output, histBefore, histAfter, verify, sampling);
+    case 12:
+        return measureRuntime(RUNTIME_OUTPUT_PATH, histogramEqualization<uint16_t, 1 << 12>, input, output, histBefore, histAfter, verify, sampling);
+    default:
+        return measureRuntime(RUNTIME_OUTPUT_PATH, histogramEqualization<uint16_t, 1 << 16>, input, output, histBefore, histAfter, verify, sampling);
     }
+}
+
+void colorEqualization(const ImageType &input, ImageType &output, vector<int> &histBefore, vector<int> &histAfter)
+{
+    size_t totalPixels = input.rows() * input.cols();
 
-    // Calculate histogram after equalization
-    histAfter.assign(histSize, 0);
-    for (int i = 0; i < output.rows(); i++)
+    // Pass 1: luminance histogram, converted from BGR on the fly
+    histBefore.assign(HIST_SIZE, 0);
+    computeLumaHistogram(input.getData(), totalPixels, histBefore.data());
+
+    vector<uint8_t> eqLookupTable(HIST_SIZE, 0);
+    buildEqualizationLookupTable(histBefore.data(), totalPixels, eqLookupTable.data());
+
+    // Pass 2: equalize the luminance and rebuild BGR with the chroma unchanged
+    output.resize(input.rows(), input.cols(), 3);
+    histAfter.assign(HIST_SIZE, 0);
+    applyLumaLookupTable(input.getData(), output.getData(), totalPixels, eqLookupTable.data(), histAfter.data());
+}
+
+void claheEqualization(const ImageType &input, ImageType &output, vector<int> &histBefore, vector<int> &histAfter, ClaheParams params)
+{
+    int rows = input.rows();
+    int cols = input.cols();
+    fitClaheParams(params, rows, cols);
+
+    histBefore.assign(HIST_SIZE, 0);
+    computeHistogram(input.getData(), input.rows() * input.cols(), histBefore.data());
+
+    // Clipped-histogram Lookup Table of every tile
+    vector<uint8_t> luts(static_cast<size_t>(params.tilesY) * params.tilesX * HIST_SIZE);
+    for (int ty = 0; ty < params.tilesY; ty++)
     {
-        for (int j = 0; j < output.cols(); j++)
+        for (int tx = 0; tx < params.tilesX; tx++)
         {
-            int pixelValue = output.at(i, j);
-            histAfter[pixelValue]++;
+            computeClaheTile(input, 0, rows, params, ty, tx, luts);
         }
     }
+
+    // Bilinear interpolation between the LUTs of the four nearest tile centers
+    ClaheAxis xAxis, yAxis;
+    buildClaheAxis(cols, params.tilesX, xAxis);
+    buildClaheAxis(rows, params.tilesY, yAxis);
+    output.resize(rows, cols);
+    interpolateClaheRows(input, output, 0, rows, 0, xAxis, yAxis, params, luts);
+
+    // The mapping varies per pixel, so the histogram after equalization needs a pass over the output
+    histAfter.assign(HIST_SIZE, 0);
+    computeHistogram(output.getData(), output.rows() * output.cols(), histAfter.data());
 }
 
 int main(int argc, char **argv)
 {
-    if (argc != 2 && argc != 3)
+    ProgramOptions options;
+    if (!parseOptions(argc, argv, options) || hasMpiOnlyOptions(options) || hasAutoOnlyOptions(options))
     {
-        cout << "Usage: " << argv[0] << " [--quiet|-q] <image_path>" << endl;
+        cout << "Usage: " << argv[0] << " [--quiet|-q] [--verify] [--no-artifacts] [--png-compression <0-9>] [--timings <path>] [--profile|--perf-counters] [--sample <rate> | --sample-error <levels>] [--bits <n> | --color | --clahe [--tiles <cols>x<rows>] [--clip-limit <value>]] <image_path> | --batch <dir|list> [--batch-out <dir>] [--io-threads <n>] | --stream [--memory-budget <MB>] <pgm_path> | --sequence <video|dir> [--smoothing <alpha>]" << endl;
         return -1;
     }
-    string filename = argv[1];
-    bool quiet = false;
-    if (argc == 3)
+    bool quiet = options.quiet;
+    HistogramSampling sampling{options.sampleRate, options.sampleError};
+    if (options.perfCounters && !enableProfileCounters())
+        cerr << "Hardware counters are unavailable (see /proc/sys/kernel/perf_event_paranoid); reporting times only" << endl;
+
+    if (options.stream)
     {
-        if (string(argv[1]) == "--quiet" || string(argv[1]) == "-q")
+        PgmFile input;
+        input.openRead(options.filename);
+
+        vector<int> histBefore, histAfter;
+        double duration = streamingEqualization(input, STREAM_OUTPUT_PATH, options.memoryBudgetMB << 20, histBefore, histAfter);
+
+        if (!options.noArtifacts)
         {
-            quiet = true;
-            filename = argv[2];
+            ImageWriter writer(options.pngCompression);
+            outputHistogram(histBefore, BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram BEFORE Equalization", quiet, writer);
+            outputHistogram(histAfter, AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram AFTER Equalization", quiet, writer);
+            writer.wait();
         }
-        else
+
+        if (!quiet)
+            cout << "\nSaved " << STREAM_OUTPUT_PATH << " successfully." << endl;
+
+        cout << "Runtime: " << duration << " ms" << endl;
+        return 0;
+    }
+
+    if (!options.batch.empty())
+    {
+        vector<string> files;
+        if (!listBatchInputs(options.batch, files))
         {
-            cout << "Usage: " << argv[0] << " [--quiet|-q] <image_path>" << endl;
+            cerr << "Could not open batch input: " << options.batch << endl;
             return -1;
         }
+
+        ClaheParams params{options.tilesX, options.tilesY, options.clipLimit};
+        BatchStats stats = runBatch(
+            files, options.batchOutput.empty() ? BATCH_OUTPUT_PATH : options.batchOutput, options.ioThreads, options.color, options.pngCompression,
+            [&](const ImageType &input, ImageType &output)
+            {
+                vector<int> histBefore, histAfter;
+                if (input.channels() == 3)
+                    colorEqualization(input, output, histBefore, histAfter);
+                else if (options.clahe)
+                    claheEqualization(input, output, histBefore, histAfter, params);
+                else
+                    histogramEqualization<uint8_t, HIST_SIZE>(input, output, histBefore, histAfter, options.verify, sampling);
+            });
+        printBatchStats(stats);
+        if (options.profile)
+            reportProfile(PROFILE_OUTPUT_PATH);
+        return 0;
+    }
+
+    if (!options.sequence.empty())
+    {
+        typedef HistogramKernels<uint8_t, HIST_SIZE> Kernels;
+        SequenceStats stats = runSequence(
+            options.sequence, SEQUENCE_OUTPUT_PATH, options.smoothing, options.pngCompression,
+            [](const ImageType &frame, int *hist)
+            {
+                memset(hist, 0, HIST_SIZE * sizeof(int));
+                Kernels::count(frame.getData(), frame.rows() * frame.cols(), hist);
+            },
+            [](const ImageType &frame, ImageType &output, const uint8_t *lut)
+            { Kernels::apply(frame.getData(), output.getData(), frame.rows() * frame.cols(), lut); });
+        printSequenceStats(stats);
+        return 0;
+    }
+
+    if (options.bits > 8)
+    {
+        ImageType16 image16, equalized16;
+        readImage(options.filename, image16, options.bits);
+
+        vector<int> histBefore, histAfter;
+        double duration = highBitDepthEqualization(options.bits, image16, equalized16, histBefore, histAfter, options.verify, sampling);
+
+        // Full-depth images are written as 16-bit PNGs; the combined previews are scaled to 8 bits
+        ImageWriter writer(options.pngCompression);
+        writer.write(AFTER_IMAGE_OUTPUT_PATH, equalized16);
+        if (!options.noArtifacts)
+        {
+            writer.write(BEFORE_IMAGE_OUTPUT_PATH, image16);
+            Mat plotBefore = outputHistogram(histBefore, BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram BEFORE Equalization", quiet, writer);
+            Mat plotAfter = outputHistogram(histAfter, AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram AFTER Equalization", quiet, writer);
+
+            ImageType displayBefore, displayAfter;
+            toDisplayImage(image16, options.bits, displayBefore);
+            toDisplayImage(equalized16, options.bits, displayAfter);
+            generateCombinedOutputs(
+                displayBefore,
+                displayAfter,
+                plotBefore,
+                plotAfter,
+                BEFORE_IMAGE_HISTOGRAM_COMBINED_PATH,
+                AFTER_IMAGE_HISTOGRAM_COMBINED_PATH,
+                BEFORE_AFTER_COMBINED_PATH,
+                writer);
+        }
+        writer.wait();
+
+        cout << "Runtime: " << duration << " ms" << endl;
+        if (!options.timingsPath.empty())
+            appendTiming(options.timingsPath, "seq", 1, image16.rows(), image16.cols(), duration);
+        if (options.profile)
+            reportProfile(PROFILE_OUTPUT_PATH);
+        return 0;
     }
 
     ImageType image;
-    readImage(filename, image);
+    readImage(options.filename, image, options.color);
 
     ImageType equalizedImage;
     vector<int> histBefore, histAfter;
 
-    double duration = measureRuntime(
-        RUNTIME_OUTPUT_PATH,
-        histogramEqualization, image, equalizedImage, histBefore, histAfter);
-
-    writeImage(BEFORE_IMAGE_OUTPUT_PATH, image);
-    writeImage(AFTER_IMAGE_OUTPUT_PATH, equalizedImage);
+    double duration;
+    if (image.channels() == 3)
+    {
+        duration = measureRuntime(
+            RUNTIME_OUTPUT_PATH,
+            colorEqualization, image, equalizedImage, histBefore, histAfter);
+    }
+    else if (options.clahe)
+    {
+        ClaheParams params{options.tilesX, options.tilesY, options.clipLimit};
+        duration = measureRuntime(
+            RUNTIME_OUTPUT_PATH,
+            claheEqualization, image, equalizedImage, histBefore, histAfter, params);
+    }
+    else
+    {
+        duration = measureRuntime(
+            RUNTIME_OUTPUT_PATH,
+            histogramEqualization<uint8_t, HIST_SIZE>, image, equalizedImage, histBefore, histAfter, options.verify, sampling);
+    }
 
-    outputHistogram(histBefore, BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram BEFORE Equalization", quiet);
-    outputHistogram(histAfter, AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram AFTER Equalization", quiet);
+    // Every output is encoded on its own thread; the histogram plots go to the composites in memory
+    ImageWriter writer(options.pngCompression);
+    writer.write(AFTER_IMAGE_OUTPUT_PATH, equalizedImage);
+    if (!options.noArtifacts)
+    {
+        writer.write(BEFORE_IMAGE_OUTPUT_PATH, image);
+        Mat plotBefore = outputHistogram(histBefore, BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram BEFORE Equalization", quiet, writer);
+        Mat plotAfter = outputHistogram(histAfter, AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH, "Histogram AFTER Equalization", quiet, writer);
 
-    generateCombinedOutputs(
-        image,
-        equalizedImage,
-        BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH,
-        AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH,
-        BEFORE_IMAGE_HISTOGRAM_COMBINED_PATH,
-        AFTER_IMAGE_HISTOGRAM_COMBINED_PATH,
-        BEFORE_AFTER_COMBINED_PATH);
+        generateCombinedOutputs(
+            image,
+            equalizedImage,
+            plotBefore,
+            plotAfter,
+            BEFORE_IMAGE_HISTOGRAM_COMBINED_PATH,
+            AFTER_IMAGE_HISTOGRAM_COMBINED_PATH,
+            BEFORE_AFTER_COMBINED_PATH,
+            writer);
+    }
+    writer.wait();
 
-    if (!quiet)
+    if (!quiet && !options.noArtifacts)
         cout << "\nSaved " << BEFORE_HISTOGRAM_OUTPUT_IMAGE_PATH << " and " << AFTER_HISTOGRAM_OUTPUT_IMAGE_PATH << " successfully." << endl;
 
     cout << "Runtime: " << duration << " ms" << endl;
+    if (!options.timingsPath.empty())
+        appendTiming(options.timingsPath, "seq", 1, image.rows(), image.cols(), duration);
+    if (options.profile)
+        reportProfile(PROFILE_OUTPUT_PATH);
 
     return 0;
 }
@@ -0,0 +1,122 @@
+#include "stream.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace
+{
+    // Next header token, skipping whitespace and # comments; false at end of file
+    bool nextToken(FILE *file, string &token)
+    {
+        token.clear();
+        int c = fgetc(file);
+        while (c != EOF && (isspace(c) || c == '#'))
+        {
+            if (c == '#')
+                while (c != EOF && c != '\n')
+                    c = fgetc(file);
+            c = fgetc(file);
+        }
+        while (c != EOF && !isspace(c))
+        {
+            token += static_cast<char>(c);
+            c = fgetc(file);
+        }
+        // The single whitespace after maxval ends the header, so it is consumed with the token
+        return !token.empty();
+    }
+
+    runtime_error ioError(const string &what)
+    {
+        return runtime_error(what + ": " + strerror(errno));
+    }
+}
+
+string pgmHeader(size_t rows, size_t cols, int maxValue)
+{
+    return "P5\n" + to_string(cols) + " " + to_string(rows) + "\n" + to_string(maxValue) + "\n";
+}
+
+PgmFile::~PgmFile()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+void PgmFile::openRead(const string &path)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == nullptr)
+        throw ioError("Could not open " + path);
+
+    string magic, width, height, maxValue;
+    bool parsed = nextToken(file, magic) && magic == "P5" && nextToken(file, width) &&
+                  nextToken(file, height) && nextToken(file, maxValue);
+    long offset = ftell(file);
+    fclose(file);
+    if (!parsed)
+        throw runtime_error(path + " is not a binary (P5) PGM image");
+
+    _cols = stoul(width);
+    _rows = stoul(height);
+    _maxValue = stoi(maxValue);
+    dataOffset = static_cast<size_t>(offset);
+    if (_maxValue < 1 || _maxValue > 65535)
+        throw runtime_error(path + " has an invalid PGM maxval");
+
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw ioError("Could not open " + path);
+}
+
+void PgmFile::create(const string &path, size_t rows, size_t cols, int maxValue)
+{
+    _rows = rows;
+    _cols = cols;
+    _maxValue = maxValue;
+
+    string header = pgmHeader(rows, cols, maxValue);
+    dataOffset = header.size();
+
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw ioError("Could not create " + path);
+    writeBytes(0, header.size(), header.data());
+
+    // Full size up front, so strips can be written in any order
+    if (ftruncate(fd, dataOffset + rows * cols * bytesPerPixel()) != 0)
+        throw ioError("Could not size " + path);
+}
+
+void PgmFile::readBytes(size_t offset, size_t count, void *dst) const
+{
+    char *out = static_cast<char *>(dst);
+    while (count > 0)
+    {
+        ssize_t n = pread(fd, out, count, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            throw n == 0 ? runtime_error("Unexpected end of PGM data") : ioError("PGM read failed");
+        out += n;
+        offset += n;
+        count -= n;
+    }
+}
+
+void PgmFile::writeBytes(size_t offset, size_t count, const void *src) const
+{
+    const char *in = static_cast<const char *>(src);
+    while (count > 0)
+    {
+        ssize_t n = pwrite(fd, in, count, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw ioError("PGM write failed");
+        in += n;
+        offset += n;
+        count -= n;
+    }
+}
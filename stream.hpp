@@ -0,0 +1,98 @@
+#include "utils.hpp"
+
+#ifndef STREAM_HPP
+#define STREAM_HPP
+
+// PGM stores 16-bit samples big-endian: swaps count pixels between that and native order in place
+// (a no-op for 8-bit pixels)
+template <typename Pixel>
+inline void swapPgmSamples(Pixel *pixels, size_t count)
+{
+  if (sizeof(Pixel) == 2)
+  {
+    uint16_t *words = reinterpret_cast<uint16_t *>(pixels);
+    for (size_t i = 0; i < count; i++)
+      words[i] = __builtin_bswap16(words[i]);
+  }
+}
+
+// Whether none of count native-order samples is above maxValue. The engines size their histograms
+// from maxval, so a larger sample would index past them; 8-bit samples always fit their 256 bins.
+template <typename Pixel>
+inline bool pgmSamplesInRange(const Pixel *pixels, size_t count, int maxValue)
+{
+  if (sizeof(Pixel) == 1 || maxValue >= 65535)
+    return true;
+  Pixel largest = 0;
+  for (size_t i = 0; i < count; i++)
+    largest = std::max(largest, pixels[i]);
+  return largest <= maxValue;
+}
+
+// Header of a binary PGM; the pixel data starts right after it
+string pgmHeader(size_t rows, size_t cols, int maxValue);
+
+// Binary PGM (P5) image accessed in strips of rows with positional reads and writes, so several
+// threads can work on different strips of the same file at once and no more than one strip per
+// thread is ever resident. Pixels are 1 byte (maxval < 256) or 2 bytes big-endian; the row
+// functions convert the latter to native uint16_t.
+class PgmFile
+{
+private:
+  int fd;
+  size_t _rows;
+  size_t _cols;
+  int _maxValue;
+  size_t dataOffset; // Bytes before the first pixel (the header)
+
+  void readBytes(size_t offset, size_t count, void *dst) const;
+  void writeBytes(size_t offset, size_t count, const void *src) const;
+
+public:
+  PgmFile() : fd(-1), _rows(0), _cols(0), _maxValue(0), dataOffset(0) {}
+  ~PgmFile();
+
+  PgmFile(const PgmFile &) = delete;
+  PgmFile &operator=(const PgmFile &) = delete;
+
+  // Opens an existing file and parses its header; throws runtime_error if it is not a P5 PGM
+  void openRead(const string &path);
+
+  // Creates (or truncates) a file of the given size and writes its header
+  void create(const string &path, size_t rows, size_t cols, int maxValue);
+
+  size_t rows() const { return _rows; }
+  size_t cols() const { return _cols; }
+  int maxValue() const { return _maxValue; }
+  size_t bytesPerPixel() const { return _maxValue < 256 ? 1 : 2; }
+  size_t headerBytes() const { return dataOffset; }
+
+  // Rows [row, row + count) into dst (count * cols pixels); Pixel must match bytesPerPixel()
+  template <typename Pixel>
+  void readRows(size_t row, size_t count, Pixel *dst) const
+  {
+    size_t pixels = count * _cols;
+    readBytes(dataOffset + row * _cols * sizeof(Pixel), pixels * sizeof(Pixel), dst);
+    swapPgmSamples(dst, pixels);
+    if (!pgmSamplesInRange(dst, pixels, _maxValue))
+      throw runtime_error("PGM sample above maxval " + to_string(_maxValue));
+  }
+
+  // Writes count rows from src starting at row. 16-bit pixels are byte-swapped in place, so src
+  // holds big-endian words afterwards (streaming writes a strip once, then reuses the buffer).
+  template <typename Pixel>
+  void writeRows(size_t row, size_t count, Pixel *src) const
+  {
+    size_t pixels = count * _cols;
+    swapPgmSamples(src, pixels);
+    writeBytes(dataOffset + row * _cols * sizeof(Pixel), pixels * sizeof(Pixel), src);
+  }
+};
+
+// Rows per strip so that workers strips of rowBytes-wide rows fit the budget (at least one row)
+inline size_t streamChunkRows(size_t budgetBytes, int workers, size_t rowBytes)
+{
+  return max<size_t>(1, budgetBytes / (max(workers, 1) * max<size_t>(rowBytes, 1)));
+}
+
+#endif
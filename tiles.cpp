@@ -0,0 +1,66 @@
+#include "tiles.hpp"
+
+namespace
+{
+    uint64_t packRange(uint64_t begin, uint64_t end)
+    {
+        return (begin << 32) | end;
+    }
+}
+
+TileScheduler::TileScheduler(size_t count, size_t tileItems, int workers)
+    : items(count), tileItems(std::max<size_t>(tileItems, 1)), workers(std::max(workers, 1)),
+      ranges(new Range[std::max(workers, 1)]), stealCount(0)
+{
+    uint64_t tiles = (items + this->tileItems - 1) / this->tileItems;
+    for (int w = 0; w < this->workers; w++)
+        ranges[w].bounds.store(packRange(tiles * w / this->workers, tiles * (w + 1) / this->workers), std::memory_order_relaxed);
+}
+
+bool TileScheduler::steal(int worker)
+{
+    // Victims in order from the next worker on; the back half of a range is the part its owner
+    // would reach last
+    for (int k = 1; k < workers; k++)
+    {
+        Range &victim = ranges[(worker + k) % workers];
+        uint64_t bounds = victim.bounds.load(std::memory_order_acquire);
+        while (true)
+        {
+            uint64_t begin = bounds >> 32, end = bounds & 0xFFFFFFFFu;
+            if (begin >= end)
+                break;
+            uint64_t middle = end - (end - begin + 1) / 2;
+            if (victim.bounds.compare_exchange_weak(bounds, packRange(begin, middle), std::memory_order_acq_rel))
+            {
+                // Our own range is empty, and nobody steals from an empty range, so a plain store is safe
+                ranges[worker].bounds.store(packRange(middle, end), std::memory_order_release);
+                stealCount.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool TileScheduler::next(int worker, size_t &begin, size_t &end)
+{
+    Range &own = ranges[worker % workers];
+    do
+    {
+        uint64_t bounds = own.bounds.load(std::memory_order_acquire);
+        while (true)
+        {
+            uint64_t first = bounds >> 32, last = bounds & 0xFFFFFFFFu;
+            if (first >= last)
+                break;
+            if (own.bounds.compare_exchange_weak(bounds, packRange(first + 1, last), std::memory_order_acq_rel))
+            {
+                begin = first * tileItems;
+                end = std::min(items, (first + 1) * tileItems);
+                return true;
+            }
+        }
+    } while (steal(worker % workers));
+    return false;
+}
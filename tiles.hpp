@@ -0,0 +1,70 @@
+#include "kernels.hpp"
+#include <atomic>
+#include <memory>
+
+#ifndef TILES_HPP
+#define TILES_HPP
+
+// Bytes of input per tile: the input and output of a tile (twice this) stay in L2 while a worker
+// remaps it and counts the result
+#define TILE_DEFAULT_BYTES (64 << 10)
+
+// Hands out the tiles of a contiguous buffer to workers. Each worker starts with an equal,
+// contiguous range of tiles and takes them from its front; a worker whose range is empty steals
+// the back half of another worker's range. Workers that never show up (an OpenMP team smaller
+// than planned) simply have their ranges stolen. Ranges are packed into one atomic word, so both
+// ends move with compare-and-swap and nothing blocks.
+class TileScheduler
+{
+private:
+  struct alignas(64) Range
+  {
+    std::atomic<uint64_t> bounds; // First tile in the high 32 bits, end in the low 32
+  };
+
+  size_t items;
+  size_t tileItems;
+  int workers;
+  std::unique_ptr<Range[]> ranges;
+  std::atomic<size_t> stealCount;
+
+  bool steal(int worker);
+
+public:
+  // count items in tiles of tileItems, for workers workers
+  TileScheduler(size_t count, size_t tileItems, int workers);
+
+  TileScheduler(const TileScheduler &) = delete;
+  TileScheduler &operator=(const TileScheduler &) = delete;
+
+  // Items [begin, end) of the next tile of worker; false once every tile has been taken
+  bool next(int worker, size_t &begin, size_t &end);
+
+  // Ranges stolen so far
+  size_t steals() const { return stealCount.load(std::memory_order_relaxed); }
+};
+
+// Tile of TILE_DEFAULT_BYTES worth of Pixel values
+template <typename Pixel>
+size_t defaultTileItems()
+{
+  return TILE_DEFAULT_BYTES / sizeof(Pixel);
+}
+
+// Remaps the tiles of src into dst through lut as worker, until the scheduler runs dry. When
+// hist is set, the remapped tile is counted into it (not cleared first) right after, while it is
+// still in cache, so a histogram of the output costs no second pass over memory.
+template <typename Pixel, int Bins>
+void remapTiles(TileScheduler &scheduler, int worker, const Pixel *src, Pixel *dst, const Pixel *lut, int *hist)
+{
+  typedef HistogramKernels<Pixel, Bins> Kernels;
+  size_t begin, end;
+  while (scheduler.next(worker, begin, end))
+  {
+    Kernels::apply(src + begin, dst + begin, end - begin, lut);
+    if (hist)
+      Kernels::count(dst + begin, end - begin, hist);
+  }
+}
+
+#endif
@@ -1,4 +1,9 @@
 #include "utils.hpp"
+#include <cstdlib>
+#include <sys/stat.h>
+#ifdef IMAGE_HUGE_PAGES
+#include <sys/mman.h>
+#endif
 
 namespace
 {
@@ -24,7 +29,7 @@ namespace
         }
     }
 
-    void plotHistogramImage(const vector<int> &histogram, const string &filename, const bool quiet = false)
+    Mat plotHistogramImage(const vector<int> &histogram)
     {
         int histSize = histogram.size();
         int bin_w = cvRound((double)HIST_IMG_W / histSize);
@@ -45,17 +50,19 @@ namespace
                       Point((i + 1) * bin_w, HIST_IMG_H - normHist[i]),
                       Scalar(0), FILLED);
         }
+        return histImage;
+    }
 
-        imwrite(filename, histImage);
-        if (!quiet)
-            cout << "Saved histogram image: " << filename << endl;
+    vector<int> pngParams(int pngCompression)
+    {
+        return {IMWRITE_PNG_COMPRESSION, pngCompression};
     }
 
     void grayScaleImage(const Mat &image, Mat &grayImage)
     {
         if (image.channels() == 1)
         {
-            grayImage = image.clone();
+            grayImage = image;
         }
         else
         {
@@ -64,33 +71,218 @@ namespace
         }
     }
 
-    void MatToImageType(const Mat &mat, ImageType &image)
+    void colorImage(const Mat &image, Mat &bgrImage)
     {
-        image.resize(mat.rows, mat.cols);
-        for (int i = 0; i < mat.rows; i++)
-        {
-            for (int j = 0; j < mat.cols; j++)
-                image.at(i, j) = mat.at<uchar>(i, j);
-        }
+        if (image.channels() == 4)
+            cvtColor(image, bgrImage, COLOR_BGRA2BGR);
+        else
+            bgrImage = image;
     }
 
-    void ImageTypeToMat(const ImageType &image, Mat &mat)
+    // Sums adjacent bins so wide (10-16 bit) histograms print and plot at HIST_DISPLAY_BINS bins
+    vector<int> foldHistogram(const vector<int> &histogram)
     {
-        mat = Mat(static_cast<int>(image.rows()), static_cast<int>(image.cols()), CV_8UC1);
-        for (int i = 0; i < image.rows(); i++)
-            for (int j = 0; j < image.cols(); j++)
-                mat.at<uchar>(i, j) = image.at(i, j);
+        if (histogram.size() <= HIST_DISPLAY_BINS)
+            return histogram;
+        vector<int> folded(HIST_DISPLAY_BINS, 0);
+        for (size_t i = 0; i < histogram.size(); i++)
+            folded[i * HIST_DISPLAY_BINS / histogram.size()] += histogram[i];
+        return folded;
     }
 }
 
-void outputHistogram(const vector<int> &histogram, const string &filename, const string &title, const bool quiet = false)
+void *allocateImageBuffer(size_t bytes)
 {
+    size_t alignment = IMAGE_ALIGNMENT;
+#ifdef IMAGE_HUGE_PAGES
+    if (bytes >= IMAGE_HUGE_PAGE_SIZE)
+    {
+        alignment = IMAGE_HUGE_PAGE_SIZE;
+        bytes = (bytes + IMAGE_HUGE_PAGE_SIZE - 1) / IMAGE_HUGE_PAGE_SIZE * IMAGE_HUGE_PAGE_SIZE;
+    }
+#endif
+    void *buffer = nullptr;
+    if (posix_memalign(&buffer, alignment, bytes) != 0)
+        throw bad_alloc();
+#ifdef IMAGE_HUGE_PAGES
+    // Only a hint: the kernel may still back the buffer with 4 KB pages
+    if (alignment == IMAGE_HUGE_PAGE_SIZE)
+        madvise(buffer, bytes, MADV_HUGEPAGE);
+#endif
+    return buffer;
+}
+
+void freeImageBuffer(void *buffer)
+{
+    free(buffer);
+}
+
+bool parseOptions(int argc, char **argv, ProgramOptions &options)
+{
+    options = ProgramOptions();
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--quiet" || arg == "-q")
+            options.quiet = true;
+        else if (arg == "--verify")
+            options.verify = true;
+        else if (arg == "--bits" && i + 1 < argc)
+        {
+            options.bits = atoi(argv[++i]);
+            if (options.bits != 8 && options.bits != 10 && options.bits != 12 && options.bits != 16)
+                return false;
+        }
+        else if (arg == "--color")
+            options.color = true;
+        else if (arg == "--clahe")
+            options.clahe = true;
+        else if (arg == "--tiles" && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%dx%d", &options.tilesX, &options.tilesY) != 2 || options.tilesX < 1 || options.tilesY < 1)
+                return false;
+        }
+        else if (arg == "--clip-limit" && i + 1 < argc)
+        {
+            char *end = nullptr;
+            options.clipLimit = strtod(argv[++i], &end);
+            if (*end != '\0' || options.clipLimit < 0)
+                return false;
+        }
+        else if (arg == "--batch" && i + 1 < argc)
+            options.batch = argv[++i];
+        else if (arg == "--batch-out" && i + 1 < argc)
+            options.batchOutput = argv[++i];
+        else if (arg == "--io-threads" && i + 1 < argc)
+        {
+            options.ioThreads = atoi(argv[++i]);
+            if (options.ioThreads < 1)
+                return false;
+        }
+        else if (arg == "--stream")
+            options.stream = true;
+        else if (arg == "--sequence" && i + 1 < argc)
+            options.sequence = argv[++i];
+        else if (arg == "--smoothing" && i + 1 < argc)
+        {
+            char *end = nullptr;
+            options.smoothing = strtod(argv[++i], &end);
+            if (*end != '\0' || options.smoothing <= 0 || options.smoothing > 1)
+                return false;
+        }
+        else if (arg == "--sample" && i + 1 < argc)
+        {
+            char *end = nullptr;
+            options.sampleRate = strtod(argv[++i], &end);
+            if (*end != '\0' || options.sampleRate <= 0 || options.sampleRate > 1)
+                return false;
+        }
+        else if (arg == "--sample-error" && i + 1 < argc)
+        {
+            char *end = nullptr;
+            options.sampleError = strtod(argv[++i], &end);
+            if (*end != '\0' || options.sampleError <= 0)
+                return false;
+        }
+        else if (arg == "--png-compression" && i + 1 < argc)
+        {
+            char *end = nullptr;
+            options.pngCompression = static_cast<int>(strtol(argv[++i], &end, 10));
+            if (*end != '\0' || options.pngCompression < 0 || options.pngCompression > 9)
+                return false;
+        }
+        else if (arg == "--no-artifacts")
+            options.noArtifacts = true;
+        else if (arg == "--timings" && i + 1 < argc)
+            options.timingsPath = argv[++i];
+        else if (arg == "--memory-budget" && i + 1 < argc)
+        {
+            long long megabytes = atoll(argv[++i]);
+            if (megabytes < 1)
+                return false;
+            options.memoryBudgetMB = static_cast<size_t>(megabytes);
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+        {
+            options.threads = atoi(argv[++i]);
+            if (options.threads < 1)
+                return false;
+        }
+        else if (arg == "--shared")
+            options.sharedWindow = true;
+        else if (arg == "--dynamic" && i + 1 < argc)
+        {
+            options.dynamicRows = atoi(argv[++i]);
+            if (options.dynamicRows < 1)
+                return false;
+        }
+        else if (arg == "--rank-stats")
+            options.rankStats = true;
+        else if (arg == "--profile")
+            options.profile = true;
+        else if (arg == "--perf-counters")
+            options.profile = options.perfCounters = true;
+        else if (arg == "--backend" && i + 1 < argc)
+            options.backend = argv[++i];
+        else if (arg == "--retune")
+            options.retune = true;
+        else if (arg == "--tuning-cache" && i + 1 < argc)
+            options.tuningCache = argv[++i];
+        else if (arg == "--pipeline" && i + 1 < argc)
+        {
+            options.pipelineBlocks = atoi(argv[++i]);
+            if (options.pipelineBlocks < 1)
+                return false;
+        }
+        else if (!arg.empty() && arg[0] != '-' && options.filename.empty())
+            options.filename = arg;
+        else
+            return false;
+    }
+    // Exactly one of <image_path>, --batch and --sequence; high bit depth is global grayscale
+    // equalization only, and not available in batch mode. Streaming is global grayscale
+    // equalization of one PGM whose header gives the bit depth, and sequence mode 8-bit global
+    // grayscale equalization of frames. The pipelined transfers, the shared window and the
+    // dynamic distribution are alternative ways to run 8-bit global equalization of one image.
+    // Sampling approximates the histogram of global grayscale equalization with the bulk
+    // transfers, by a rate or by an error budget.
+    bool highBitDepth = options.bits > 8;
+    bool batch = !options.batch.empty();
+    bool sequence = !options.sequence.empty();
+    bool sampled = options.sampleRate < 1 || options.sampleError > 0;
+    return batch + sequence + !options.filename.empty() == 1 && !(options.color && options.clahe) &&
+           !(sequence && (highBitDepth || options.color || options.clahe || options.stream)) &&
+           !(highBitDepth && (options.color || options.clahe || batch)) &&
+           !(options.stream && (highBitDepth || options.color || options.clahe || batch)) &&
+           (options.pipelineBlocks > 0) + options.sharedWindow + (options.dynamicRows > 0) <= 1 &&
+           !((options.pipelineBlocks > 0 || options.sharedWindow || options.dynamicRows > 0) && (highBitDepth || options.color || options.clahe || batch || sequence || options.stream)) &&
+           !(sampled && ((options.sampleRate < 1 && options.sampleError > 0) || options.color || options.clahe || sequence || options.stream ||
+                         options.pipelineBlocks > 0 || options.sharedWindow || options.dynamicRows > 0));
+}
+
+bool hasMpiOnlyOptions(const ProgramOptions &options)
+{
+    return options.pipelineBlocks > 0 || options.sharedWindow || options.dynamicRows > 0 || options.rankStats;
+}
+
+bool hasAutoOnlyOptions(const ProgramOptions &options)
+{
+    return options.backend != "auto" || options.retune || !options.tuningCache.empty();
+}
+
+Mat outputHistogram(const vector<int> &histogram, const string &filename, const string &title, const bool quiet, ImageWriter &writer)
+{
+    vector<int> displayed = foldHistogram(histogram);
+    if (!quiet)
+        printHistogram(displayed, title);
+    Mat histImage = plotHistogramImage(displayed);
+    writer.write(filename, histImage);
     if (!quiet)
-        printHistogram(histogram, title);
-    plotHistogramImage(histogram, filename, quiet);
+        cout << "Saved histogram image: " << filename << endl;
+    return histImage;
 }
 
-void readImage(const string &filename, ImageType &image)
+void readImage(const string &filename, ImageType &image, bool keepColor)
 {
     Mat input_image;
     input_image = imread(filename, IMREAD_UNCHANGED);
@@ -100,15 +292,151 @@ void readImage(const string &filename, ImageType &image)
         throw runtime_error("Image not found");
     }
     Mat opened_image;
+    if (keepColor && input_image.channels() >= 3)
+        colorImage(input_image, opened_image);
+    else
+        grayScaleImage(input_image, opened_image);
+    if (opened_image.depth() != CV_8U)
+        opened_image.convertTo(opened_image, CV_8U, 255.0 / 65535);
+    // The decoded buffer is adopted rather than copied
+    image.assign(opened_image);
+}
+
+void writeImage(const string &filename, const ImageType &image, int pngCompression)
+{
+    imwrite(filename, image.asMat(), pngParams(pngCompression));
+}
+
+void readImage(const string &filename, ImageType16 &image, int bits)
+{
+    Mat input_image = imread(filename, IMREAD_ANYDEPTH | IMREAD_ANYCOLOR);
+    if (input_image.empty())
+    {
+        cerr << "Could not open or find the image: " << filename << endl;
+        throw runtime_error("Image not found");
+    }
+    Mat opened_image;
     grayScaleImage(input_image, opened_image);
-    MatToImageType(opened_image, image);
+    if (opened_image.depth() != CV_16U)
+        opened_image.convertTo(opened_image, CV_16U);
+
+    double maxValue = 0;
+    minMaxLoc(opened_image, nullptr, &maxValue);
+    if (maxValue >= (1 << bits))
+    {
+        cerr << filename << " has values up to " << maxValue << ", more than " << bits << " bits hold (" << (1 << bits) - 1 << "); pass a larger --bits" << endl;
+        throw runtime_error("Image exceeds --bits");
+    }
+    image.assign(opened_image);
+}
+
+void writeImage(const string &filename, const ImageType16 &image, int pngCompression)
+{
+    // PNG and TIFF keep all 16 bits
+    imwrite(filename, image.asMat(), pngParams(pngCompression));
+}
+
+ImageWriter::~ImageWriter()
+{
+    for (future<void> &task : pending)
+        if (task.valid())
+            task.wait();
+}
+
+void ImageWriter::write(const string &filename, const Mat &image)
+{
+    pending.push_back(async(launch::async, [filename, image, this]()
+                            {
+        if (!imwrite(filename, image, pngParams(pngCompression)))
+            throw runtime_error("Could not write image: " + filename); }));
+}
+
+void ImageWriter::wait()
+{
+    // Every task is waited for before the first error is rethrown
+    exception_ptr error;
+    for (future<void> &task : pending)
+    {
+        try
+        {
+            task.get();
+        }
+        catch (...)
+        {
+            if (!error)
+                error = current_exception();
+        }
+    }
+    pending.clear();
+    if (error)
+        rethrow_exception(error);
+}
+
+void appendTiming(const string &path, const string &engine, int workers, size_t rows, size_t cols, double ms)
+{
+    bool created = !ifstream(path).good();
+    ofstream file(path, ios::app);
+    if (!file.is_open())
+    {
+        cerr << "Unable to open file: " << path << endl;
+        return;
+    }
+    if (created)
+        file << "engine,workers,rows,cols,ms" << endl;
+    file << engine << ',' << workers << ',' << rows << ',' << cols << ',' << setprecision(9) << ms << endl;
+}
+
+double percentile(const vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t rank = static_cast<size_t>(ceil(p / 100 * sorted.size()));
+    return sorted[min(sorted.size(), max<size_t>(rank, 1)) - 1];
+}
+
+vector<string> splitList(const string &text)
+{
+    vector<string> items;
+    string item;
+    for (char c : text + ",")
+    {
+        if (c == ',' || c == ' ')
+        {
+            if (!item.empty())
+                items.push_back(item);
+            item.clear();
+        }
+        else
+            item += c;
+    }
+    return items;
+}
+
+bool parseSize(const string &text, size_t &cols, size_t &rows)
+{
+    int end = 0;
+    if (text.find('-') != string::npos || sscanf(text.c_str(), "%zux%zu%n", &cols, &rows, &end) != 2)
+        return false;
+    return static_cast<size_t>(end) == text.size() && cols > 0 && rows > 0;
+}
+
+void makeDirectories(const string &path)
+{
+    for (size_t i = 1; i <= path.size(); i++)
+    {
+        if (i == path.size() || path[i] == '/')
+            mkdir(path.substr(0, i).c_str(), 0755);
+    }
 }
 
-void writeImage(const string &filename, const ImageType &image)
+void toDisplayImage(const ImageType16 &image, int bits, ImageType &display)
 {
-    Mat mat;
-    ImageTypeToMat(image, mat);
-    imwrite(filename, mat);
+    display.resize(image.rows(), image.cols());
+    const uint16_t *src = image.getData();
+    uint8_t *dst = display.getData();
+    uint32_t maxValue = (1u << bits) - 1;
+    for (size_t i = 0; i < image.rows() * image.cols(); i++)
+        dst[i] = static_cast<uint8_t>((min<uint32_t>(src[i], maxValue) * 255 + maxValue / 2) / maxValue);
 }
 
 void stackImages(const cv::Mat &img1,
@@ -198,43 +526,42 @@ void resizeIfTooLarge(cv::Mat &image, int maxDim = 1024)
 void generateCombinedOutputs(
     const ImageType &beforeImage,
     const ImageType &afterImage,
-    const std::string &beforeHistPath,
-    const std::string &afterHistPath,
+    const Mat &histBeforeImg,
+    const Mat &histAfterImg,
     const std::string &beforeCombinedPath,
     const std::string &afterCombinedPath,
-    const std::string &resultCombinedPath)
+    const std::string &resultCombinedPath,
+    ImageWriter &writer)
 {
-    Mat histBeforeImg = imread(beforeHistPath, IMREAD_GRAYSCALE);
-    Mat histAfterImg = imread(afterHistPath, IMREAD_GRAYSCALE);
-
-    if (histBeforeImg.empty())
+    // Colour results need 3-channel histogram plots to be stacked next to them; the plots
+    // themselves may still be queued for writing, so they are converted into new Mats
+    Mat histBefore, histAfter;
+    if (beforeImage.channels() == 3)
     {
-        cerr << "Failed to load histogram image: " << beforeHistPath << endl;
-        return;
+        cvtColor(histBeforeImg, histBefore, COLOR_GRAY2BGR);
+        cvtColor(histAfterImg, histAfter, COLOR_GRAY2BGR);
     }
-    if (histAfterImg.empty())
+    else
     {
-        cerr << "Failed to load histogram image: " << afterHistPath << endl;
-        return;
+        histBefore = histBeforeImg;
+        histAfter = histAfterImg;
     }
 
     // First combined: before image + histogram
-    Mat combinedBefore, beforeImageMat;
-    ImageTypeToMat(beforeImage, beforeImageMat);
-    stackImages(beforeImageMat, histBeforeImg, combinedBefore, true);
+    Mat combinedBefore;
+    stackImages(beforeImage.asMat(), histBefore, combinedBefore, true);
     resizeIfTooLarge(combinedBefore);
-    imwrite(beforeCombinedPath, combinedBefore);
+    writer.write(beforeCombinedPath, combinedBefore);
 
     // Second combined: after image + histogram
-    Mat combinedAfter, afterImageMat;
-    ImageTypeToMat(afterImage, afterImageMat);
-    stackImages(afterImageMat, histAfterImg, combinedAfter, true);
+    Mat combinedAfter;
+    stackImages(afterImage.asMat(), histAfter, combinedAfter, true);
     resizeIfTooLarge(combinedAfter);
-    imwrite(afterCombinedPath, combinedAfter);
+    writer.write(afterCombinedPath, combinedAfter);
 
     // Final combined: stack the two above vertically
     Mat resultCombined;
     stackImages(combinedBefore, combinedAfter, resultCombined, false);
     resizeIfTooLarge(resultCombined);
-    imwrite(resultCombinedPath, resultCombined);
+    writer.write(resultCombinedPath, resultCombined);
 }
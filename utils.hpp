@@ -3,6 +3,7 @@
 #include <utility>
 #include <fstream>
 #include <cmath>
+#include <future>
 
 using namespace std;
 using namespace cv;
@@ -11,75 +12,308 @@ using namespace cv;
 #define UTILS_HPP
 
 #define HIST_WIDTH 50
+// Wider histograms are folded down to this many bins for printing and plotting
+#define HIST_DISPLAY_BINS 256
 #define HIST_IMG_W 512
 #define HIST_IMG_H 400
 
-class ImageType
+#define CLAHE_DEFAULT_TILES 8
+#define CLAHE_DEFAULT_CLIP_LIMIT 2.0
+
+// Decode and encode threads of batch mode, each
+#define BATCH_DEFAULT_IO_THREADS 2
+
+// Weight of the newest frame in the running histogram of sequence mode
+#define SEQUENCE_DEFAULT_SMOOTHING 0.1
+
+// Memory for pixel strips in streaming mode, in MB
+#define STREAM_DEFAULT_MEMORY_BUDGET_MB 256
+
+// zlib level of the PNGs written, 0-9 (OpenCV's own default, its fastest setting)
+#define PNG_DEFAULT_COMPRESSION 1
+
+// Pixel buffers start on a cache line, so vector kernels can use aligned loads
+#define IMAGE_ALIGNMENT 64
+
+// Buffers of at least this many bytes are 2 MB aligned and advised to use transparent huge pages
+// when built with -DIMAGE_HUGE_PAGES (make HUGE_PAGES=1)
+#define IMAGE_HUGE_PAGE_SIZE (2 << 20)
+
+// IMAGE_ALIGNMENT-aligned storage for image pixels; throws bad_alloc on failure
+void *allocateImageBuffer(size_t bytes);
+void freeImageBuffer(void *buffer);
+
+template <typename Pixel>
+class BasicImage
 {
 private:
-  uint8_t *data;
+  Pixel *data;
   size_t _rows;
   size_t _cols;
+  size_t _channels;
+  size_t _capacity; // Pixels in the owned buffer (0 when data belongs to mat)
+  Mat mat;          // Adopted cv::Mat whose reference keeps data alive
+
+  void release()
+  {
+    if (_capacity > 0)
+      freeImageBuffer(data);
+    data = nullptr;
+    _capacity = 0;
+    mat.release();
+  }
+
+  // Makes data an owned buffer of at least count pixels, reusing the current one if it is large enough
+  void reserve(size_t count)
+  {
+    if (count <= _capacity)
+      return;
+    release();
+    if (count > 0)
+    {
+      data = static_cast<Pixel *>(allocateImageBuffer(count * sizeof(Pixel)));
+      _capacity = count;
+    }
+  }
+
+  void steal(BasicImage &other)
+  {
+    data = other.data;
+    _rows = other._rows;
+    _cols = other._cols;
+    _channels = other._channels;
+    _capacity = other._capacity;
+    mat = other.mat;
+    other.data = nullptr;
+    other._rows = other._cols = other._capacity = 0;
+    other.mat.release();
+  }
 
 public:
-  // Constructor
-  ImageType(size_t rows = 0, size_t cols = 0) : _rows(rows), _cols(cols)
+  // Constructor (channels > 1 stores interleaved pixels, e.g. BGR)
+  BasicImage(size_t rows = 0, size_t cols = 0, size_t channels = 1) : data(nullptr), _rows(rows), _cols(cols), _channels(channels), _capacity(0)
+  {
+    reserve(rows * cols * channels);
+  }
+
+  // Adopts the buffer of a continuous Mat of the same depth without copying (the Mat's reference
+  // count keeps it alive); any other Mat is copied row by row
+  explicit BasicImage(const Mat &source) : data(nullptr), _rows(0), _cols(0), _channels(1), _capacity(0)
   {
-    data = rows > 0 && cols > 0 ? new uint8_t[rows * cols] : nullptr;
+    assign(source);
+  }
+
+  // Copy constructor (deep copy)
+  BasicImage(const BasicImage &other) : data(nullptr), _rows(0), _cols(0), _channels(1), _capacity(0)
+  {
+    *this = other;
+  }
+
+  BasicImage(BasicImage &&other) noexcept
+  {
+    steal(other);
   }
 
   // Destructor
-  ~ImageType()
+  ~BasicImage()
   {
-    delete[] data;
+    release();
   }
 
   // Assignment operator (for deep copy)
-  ImageType &operator=(const ImageType &other)
+  BasicImage &operator=(const BasicImage &other)
   {
     if (this != &other)
     {
-      delete[] data;
-      _rows = other._rows;
-      _cols = other._cols;
-      data = new uint8_t[_rows * _cols];
-      memcpy(data, other.data, _rows * _cols);
+      resize(other._rows, other._cols, other._channels);
+      if (data != nullptr)
+        memcpy(data, other.data, _rows * _cols * _channels * sizeof(Pixel));
     }
     return *this;
   }
 
+  BasicImage &operator=(BasicImage &&other) noexcept
+  {
+    if (this != &other)
+    {
+      release();
+      steal(other);
+    }
+    return *this;
+  }
+
+  void assign(const Mat &source)
+  {
+    if (source.depth() == DataType<Pixel>::depth && source.isContinuous())
+    {
+      release();
+      mat = source;
+      data = reinterpret_cast<Pixel *>(mat.data);
+      _rows = source.rows;
+      _cols = source.cols;
+      _channels = source.channels();
+      return;
+    }
+
+    Mat converted;
+    if (source.depth() != DataType<Pixel>::depth)
+      source.convertTo(converted, DataType<Pixel>::depth);
+    else
+      converted = source;
+    resize(converted.rows, converted.cols, converted.channels());
+    size_t rowBytes = _cols * _channels * sizeof(Pixel);
+    for (size_t i = 0; i < _rows; i++)
+      memcpy(&at(i, 0), converted.ptr(static_cast<int>(i)), rowBytes);
+  }
+
+  // Mat header over the pixels (no copy); only valid while this image is alive and not resized
+  Mat asMat() const
+  {
+    return Mat(static_cast<int>(_rows), static_cast<int>(_cols),
+               CV_MAKETYPE(DataType<Pixel>::depth, static_cast<int>(_channels)), const_cast<Pixel *>(data));
+  }
+
   // Size and data access
   size_t rows() const { return _rows; }
   size_t cols() const { return _cols; }
-  uint8_t *getData() { return data; }
-  const uint8_t *getData() const { return data; }
+  size_t channels() const { return _channels; }
+  Pixel *getData() { return data; }
+  const Pixel *getData() const { return data; }
 
-  // Element access
-  uint8_t &at(size_t row, size_t col)
+  // Element access (first channel of the pixel)
+  Pixel &at(size_t row, size_t col)
   {
-    return data[row * _cols + col];
+    return data[(row * _cols + col) * _channels];
   }
 
-  const uint8_t &at(size_t row, size_t col) const
+  const Pixel &at(size_t row, size_t col) const
   {
-    return data[row * _cols + col];
+    return data[(row * _cols + col) * _channels];
   }
 
-  // Resize
-  void resize(size_t rows, size_t cols)
+  // Resize (contents are undefined afterwards); an owned buffer that is large enough is reused,
+  // an adopted Mat buffer never is since other Mats may share it
+  void resize(size_t rows, size_t cols, size_t channels = 1)
   {
-    delete[] data;
+    reserve(rows * cols * channels);
     _rows = rows;
     _cols = cols;
-    data = new uint8_t[rows * cols];
+    _channels = channels;
   }
 };
 
-void outputHistogram(const vector<int> &histogram, const string &filename, const string &title, const bool quiet);
+// 8-bit images, used by every engine mode
+typedef BasicImage<uint8_t> ImageType;
+
+// 10/12/16-bit grayscale images (values in the low bits of each 16-bit word)
+typedef BasicImage<uint16_t> ImageType16;
+
+// Command-line flags shared by every engine binary
+struct ProgramOptions
+{
+  bool quiet = false;  // --quiet|-q: don't print histograms to the console
+  bool verify = false; // --verify: rescan the equalized image and check histAfter against it
+  int bits = 8;        // --bits <8|10|12|16>: significant bits per pixel, histograms get 2^bits bins
+  bool color = false;  // --color: equalize the luminance of colour images and keep their colour
+  bool clahe = false;  // --clahe: tiled contrast-limited adaptive equalization instead of global
+  int tilesX = CLAHE_DEFAULT_TILES;           // --tiles <cols>x<rows>
+  int tilesY = CLAHE_DEFAULT_TILES;
+  double clipLimit = CLAHE_DEFAULT_CLIP_LIMIT; // --clip-limit <value> (0 disables clipping)
+  string batch;                                // --batch <dir|list>: equalize every file instead of <image_path>
+  string batchOutput;                          // --batch-out <dir>: where batch results go
+  int ioThreads = BATCH_DEFAULT_IO_THREADS;    // --io-threads <n>: decode and encode threads each
+  bool stream = false;                         // --stream: equalize a PGM strip by strip, without loading it
+  size_t memoryBudgetMB = STREAM_DEFAULT_MEMORY_BUDGET_MB; // --memory-budget <MB>: strip memory of --stream
+  string sequence;                             // --sequence <video|dir>: equalize the frames as one sequence instead of <image_path>
+  double smoothing = SEQUENCE_DEFAULT_SMOOTHING; // --smoothing <alpha>: weight of the newest frame's histogram in --sequence
+  int pipelineBlocks = 0;                      // --pipeline <blocks>: MPI only, overlap transfers and kernels per row block
+  bool sharedWindow = false;                   // --shared: MPI only, node ranks share one window instead of scattering
+  int dynamicRows = 0;                         // --dynamic <rows>: MPI only, hand out blocks of rows on demand
+  bool rankStats = false;                      // --rank-stats: MPI only, print rows, busy and idle time per rank
+  int threads = 0;                             // --threads <n>: OpenMP threads per process (0: OMP_NUM_THREADS)
+  bool profile = false;                        // --profile: report the time of every phase (builds with PROFILE=1)
+  bool perfCounters = false;                   // --perf-counters: --profile plus hardware counters per phase
+  string backend = "auto";                     // --backend <auto|scalar|simd|omp|mpi>: libhisteq backend of auto.out
+  bool retune = false;                         // --retune: auto.out measures the plan again instead of using the cached one
+  string tuningCache;                          // --tuning-cache <path>: where auto.out keeps its plans
+  double sampleRate = 1;                       // --sample <rate>: approximate LUT from this fraction of the pixels
+  double sampleError = 0;                      // --sample-error <levels>: approximate LUT from a sample sized for this error
+  int pngCompression = PNG_DEFAULT_COMPRESSION; // --png-compression <0-9>: zlib level of the PNGs written
+  bool noArtifacts = false;                    // --no-artifacts: write the equalized image only, no histograms or composites
+  string timingsPath;                          // --timings <path>: append the runtime to a CSV, for scaling.out
+  string filename;
+};
+
+// Parses [--quiet|-q] [--verify] [--bits <n> | --color | --clahe [--tiles <cols>x<rows>] [--clip-limit <value>]]
+// <image_path> | --batch <dir|list> [--batch-out <dir>] [--io-threads <n>] | --stream [--memory-budget <MB>] <pgm_path> |
+// --sequence <video|dir> [--smoothing <alpha>];
+// returns false on a usage error
+bool parseOptions(int argc, char **argv, ProgramOptions &options);
+
+// Whether a flag only mpi.out implements is set (--pipeline, --shared, --dynamic, --rank-stats), so
+// the other engines reject it instead of silently ignoring it
+bool hasMpiOnlyOptions(const ProgramOptions &options);
+
+// Whether a flag only auto.out implements is set (--backend, --retune, --tuning-cache)
+bool hasAutoOnlyOptions(const ProgramOptions &options);
+
+// Reads the image as grayscale, or as 3-channel BGR when keepColor is set and the file has colour
+void readImage(const string &filename, ImageType &image, bool keepColor = false);
+
+void writeImage(const string &filename, const ImageType &image, int pngCompression = PNG_DEFAULT_COMPRESSION);
+
+// Reads the image as 16-bit grayscale (8-bit files keep their 0-255 values); throws runtime_error
+// if a value does not fit in bits bits, since the histograms only have 2^bits bins
+void readImage(const string &filename, ImageType16 &image, int bits = 16);
+
+void writeImage(const string &filename, const ImageType16 &image, int pngCompression = PNG_DEFAULT_COMPRESSION);
+
+// Encodes images into files on background threads, one per image, so the independent outputs of
+// a run compress concurrently with each other and with whatever the caller does next. A queued
+// image must stay alive and unchanged until wait() returns; Mats are reference counted, so that
+// only takes care for views of BasicImage buffers.
+class ImageWriter
+{
+private:
+  vector<future<void>> pending;
+  int pngCompression;
+
+public:
+  explicit ImageWriter(int pngCompression = PNG_DEFAULT_COMPRESSION) : pngCompression(pngCompression) {}
+  ~ImageWriter();
+
+  ImageWriter(const ImageWriter &) = delete;
+  ImageWriter &operator=(const ImageWriter &) = delete;
+
+  void write(const string &filename, const Mat &image);
+  void write(const string &filename, const ImageType &image) { write(filename, image.asMat()); }
+  void write(const string &filename, const ImageType16 &image) { write(filename, image.asMat()); }
+
+  // Blocks until every queued image is written; throws runtime_error if one could not be
+  void wait();
+};
+
+// Prints the histogram (unless quiet), plots it, queues the plot to filename on writer and
+// returns it, for generateCombinedOutputs
+Mat outputHistogram(const vector<int> &histogram, const string &filename, const string &title, const bool quiet, ImageWriter &writer);
+
+// Scales a bits-deep image down to 8 bits for the combined preview outputs
+void toDisplayImage(const ImageType16 &image, int bits, ImageType &display);
+
+// Appends one run to the CSV at path, after a header if the file is new: engine, workers (threads,
+// ranks, or ranks x threads), image size and runtime in ms
+void appendTiming(const string &path, const string &engine, int workers, size_t rows, size_t cols, double ms);
 
-void readImage(const string &filename, ImageType &image);
+// Nearest-rank percentile p (0-100) of sorted samples: the smallest one with at least p % of the
+// samples at or below it (0 if there are none). Every tool reports its p50/p95/p99 through this
+double percentile(const vector<double> &sorted, double p);
 
-void writeImage(const string &filename, const ImageType &image);
+// Command line helpers of the tools. splitList takes items separated by commas or spaces (so shell
+// variables like "1 2 4" pass through) and drops empty ones; parseSize takes exactly <width>x<height>
+// with both positive; makeDirectories is mkdir -p
+vector<string> splitList(const string &text);
+bool parseSize(const string &text, size_t &cols, size_t &rows);
+void makeDirectories(const string &path);
 
 template <typename Func, typename... Args>
 double measureRuntime(const string &outputPath, Func &&func, Args &&...args)
@@ -113,13 +347,16 @@ void stackImages(const Mat &img1,
                  double dividerPercent = 0.005,
                  const Scalar &dividerColor = Scalar(0));
 
+// Stacks each image with its histogram plot, then the two results on top of each other, and
+// queues the three composites on writer
 void generateCombinedOutputs(
     const ImageType &beforeImage,
     const ImageType &afterImage,
-    const string &beforeHistPath,
-    const string &afterHistPath,
+    const Mat &histBeforeImg,
+    const Mat &histAfterImg,
     const string &beforeCombinedPath,
     const string &afterCombinedPath,
-    const string &resultCombinedPath);
+    const string &resultCombinedPath,
+    ImageWriter &writer);
 
 #endif
\ No newline at end of file